@@ -0,0 +1,32 @@
+// Time of an airtime lookup in the table of LoRaAirtime, and of the floating
+// point formula of the SX1276 datasheet it replaces. test/test_airtime checks
+// the table against the formula.
+
+#include <LoRaAirtime.h>
+#include <math.h>
+
+#include "Bench.h"
+
+#define AIRTIME_BENCH_LOOKUPS 10000000
+
+// in us
+static double reference(int length, int sf, long bw, int cr, bool header,
+                        bool crc, bool de) {
+    double tSym = pow(2, sf) / bw * 1e6;
+    double payload = ceil((8.0 * length - 4 * sf + 28 + 16 * crc -
+                           20 * (header ? 0 : 1)) /
+                          (4 * (sf - 2 * de)));
+    double symbols = 8 + fmax(payload * cr, 0);
+    return (8 + 4.25 + symbols) * tSym;
+}
+
+BENCH(airtime) {
+    LoRaAirtime calc;
+    volatile float sink = 0;
+    measure("airtime", "lookup", AIRTIME_BENCH_LOOKUPS, [&](uint32_t i) {
+        sink = sink + calc.getAirtime(i & 0xFF);
+    });
+    measure("airtime", "formula", AIRTIME_BENCH_LOOKUPS, [&](uint32_t i) {
+        sink = sink + reference(i & 0xFF, 7, 125000, 5, true, false, false);
+    });
+}
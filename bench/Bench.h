@@ -0,0 +1,74 @@
+// Host micro-benchmarks of the MAC, built by the bench environment. Results
+// are printed as CSV lines of benchmark, metric and value.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+
+typedef void (*BenchFunction)();
+
+// Registers a benchmark during static initialization, see BENCH()
+struct BenchRegistration {
+    BenchRegistration(const char *name, BenchFunction function);
+};
+
+#define BENCH(name)                                                    \
+    static void bench_##name();                                        \
+    static BenchRegistration registration_##name(#name, bench_##name); \
+    static void bench_##name()
+
+void report(const char *benchmark, const char *metric, double value);
+
+// Number of bytes copied with memcpy() so far. The bench environment compiles
+// block copies to memcpy() calls, so this includes struct assignments larger
+// than a few words.
+uint64_t bytesCopied();
+
+// Number of heap allocations so far, counted through --wrap=malloc and the
+// global operator new.
+uint64_t allocations();
+
+// Adds up the time and the heap allocations of the measured parts of a
+// benchmark, e.g. when the state has to be set up again between batches of
+// operations.
+class BenchTimer {
+   public:
+    void start() {
+        startAllocations = allocations();
+        started = std::chrono::steady_clock::now();
+    }
+
+    void stop() {
+        auto now = std::chrono::steady_clock::now();
+        elapsed += std::chrono::duration<double, std::nano>(now - started)
+                       .count();
+        allocated += allocations() - startAllocations;
+    }
+
+    // Reports <operation>_ns and <operation>_allocs, the time and the number
+    // of allocations per operation
+    void report(const char *benchmark, const char *operation,
+                uint64_t operations) const;
+
+    double nanoseconds() const { return elapsed; }
+
+   private:
+    std::chrono::steady_clock::time_point started;
+    uint64_t startAllocations = 0;
+    double elapsed = 0;  // ns
+    uint64_t allocated = 0;
+};
+
+// Calls operation(i) for i from 0 to rounds - 1 and reports the time and the
+// allocations per call, see BenchTimer::report()
+template <typename F>
+void measure(const char *benchmark, const char *operation, uint32_t rounds,
+             F f) {
+    BenchTimer timer;
+    timer.start();
+    for (uint32_t i = 0; i < rounds; i++) f(i);
+    timer.stop();
+    timer.report(benchmark, operation, rounds);
+}
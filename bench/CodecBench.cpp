@@ -0,0 +1,202 @@
+// Compression of payload traces by PayloadCodec, as QMAC sends them with
+// QMACClass::setCompression(). Every payload refers to the previous one of its
+// trace, as if the destination acknowledged it. Reports the coded size per
+// byte of payload, the encoding and decoding time, and the airtime of the
+// frames saved at SF7 and SF12.
+
+#include <LoRaAirtime.h>
+#include <PayloadCodec.h>
+#include <QMAC.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <vector>
+
+#include "Bench.h"
+
+#define CODEC_BENCH_PAYLOADS 500
+#define CODEC_BENCH_ROUNDS   20
+
+typedef std::vector<byte> Payload;
+
+// deterministic, so every run compresses the same traces
+static uint32_t state = 1;
+
+static uint32_t nextRandom() {
+    state = state * 1103515245 + 12345;
+    return state >> 8;
+}
+
+static void put(Payload &p, uint32_t value, int size) {
+    for (int i = 0; i < size; i++) p.push_back(value >> 8 * i);
+}
+
+// GPS fixes of a node walking along a road, one every 10 s
+static std::vector<Payload> gpsTrace() {
+    std::vector<Payload> trace;
+    int32_t lat = 482626000, lon = 115910000, alt = 51900;  // 1e-7 deg, cm
+    for (uint32_t i = 0; i < CODEC_BENCH_PAYLOADS; i++) {
+        lat += 120 + nextRandom() % 40;
+        lon += 60 + nextRandom() % 40;
+        alt += (int32_t)(nextRandom() % 21) - 10;
+        Payload p;
+        put(p, 1700000000 + 10 * i, 4);
+        put(p, lat, 4);
+        put(p, lon, 4);
+        put(p, alt, 4);
+        put(p, 140 + nextRandom() % 10, 2);  // cm/s
+        put(p, 7 + nextRandom() % 3, 1);     // satellites
+        put(p, 90 + nextRandom() % 20, 1);   // HDOP * 100
+        trace.push_back(p);
+    }
+    return trace;
+}
+
+// 16 slowly changing 32-bit readings of a weather station
+static std::vector<Payload> sensorTrace() {
+    std::vector<Payload> trace;
+    int32_t values[16];
+    for (int j = 0; j < 16; j++) values[j] = 1000 * j - 4000;
+    for (uint32_t i = 0; i < CODEC_BENCH_PAYLOADS; i++) {
+        Payload p;
+        for (int j = 0; j < 16; j++) {
+            values[j] += (int32_t)(nextRandom() % 7) - 3;
+            put(p, values[j], 4);
+        }
+        trace.push_back(p);
+    }
+    return trace;
+}
+
+// position reports typed into the serial port of the firmware
+static std::vector<Payload> textTrace() {
+    std::vector<Payload> trace;
+    for (uint32_t i = 0; i < CODEC_BENCH_PAYLOADS; i++) {
+        char line[PAYLOAD_SIZE];
+        int length = snprintf(
+            line, sizeof(line),
+            "$GPGGA,%02u%02u%02u.00,4815.%05u,N,01135.%05u,E,1,%02u,0.9,"
+            "%u.%u,M,46.9,M,,*%02X",
+            (i / 360) % 24, (i / 6) % 60, i % 6 * 10,
+            52000 + i * 7 + nextRandom() % 5, 46000 + i * 3,
+            7 + nextRandom() % 3, 519 + nextRandom() % 3, nextRandom() % 10,
+            nextRandom() & 0xff);
+        trace.push_back(Payload(line, line + length));
+    }
+    return trace;
+}
+
+// the payloads of the simulator, a tag padded with zeros
+static std::vector<Payload> simTrace() {
+    std::vector<Payload> trace;
+    uint64_t created = 0;
+    for (uint32_t i = 0; i < CODEC_BENCH_PAYLOADS; i++) {
+        created += 1000000 * (nextRandom() % 120);
+        Payload p;
+        put(p, 3, 2);
+        put(p, QMAC_PRIORITY_NORMAL, 2);
+        put(p, i, 4);
+        put(p, created, 4);
+        put(p, created >> 32, 4);
+        p.resize(64);
+        trace.push_back(p);
+    }
+    return trace;
+}
+
+// encrypted data, compression cannot help
+static std::vector<Payload> randomTrace() {
+    std::vector<Payload> trace;
+    for (uint32_t i = 0; i < CODEC_BENCH_PAYLOADS; i++) {
+        Payload p;
+        for (int j = 0; j < 48; j++) p.push_back(nextRandom());
+        trace.push_back(p);
+    }
+    return trace;
+}
+
+// ms of a data frame with the payload
+static double airtime(size_t payloadLength, uint8_t sf) {
+    return LoRaCalc.getAirtime(NORMAL_HEADER_SIZE + payloadLength, sf, 125000);
+}
+
+static void run(const char *name, const std::vector<Payload> &trace) {
+    static PayloadCodec<PAYLOAD_SIZE> codec;
+    static byte coded[CODEC_BENCH_PAYLOADS][PAYLOAD_SIZE];
+    static size_t codedLength[CODEC_BENCH_PAYLOADS];
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < CODEC_BENCH_ROUNDS; round++) {
+        for (size_t i = 0; i < trace.size(); i++) {
+            const Payload &p = trace[i];
+            const Payload *reference = i ? &trace[i - 1] : nullptr;
+            codedLength[i] = codec.encode(
+                p.data(), p.size(), CODEC_STAGES,
+                reference ? reference->data() : nullptr,
+                reference ? reference->size() : 0, i - 1, coded[i]);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    double encodeTime =
+        std::chrono::duration<double, std::micro>(end - start).count() /
+        (CODEC_BENCH_ROUNDS * trace.size());
+
+    uint32_t mismatches = 0;
+    size_t rawBytes = 0, sentBytes = 0;
+    uint32_t codedFrames = 0, deltaFrames = 0;
+    double rawAirtime[2] = {}, sentAirtime[2] = {};
+    start = std::chrono::steady_clock::now();
+    for (int round = 0; round < CODEC_BENCH_ROUNDS; round++) {
+        for (size_t i = 0; i < trace.size(); i++) {
+            if (!codedLength[i]) continue;
+            const Payload *reference = i ? &trace[i - 1] : nullptr;
+            byte decoded[PAYLOAD_SIZE];
+            size_t length = codec.decode(
+                coded[i], codedLength[i],
+                reference ? reference->data() : nullptr,
+                reference ? reference->size() : 0, decoded);
+            if (round) continue;
+            if (length != trace[i].size() ||
+                memcmp(decoded, trace[i].data(), length))
+                mismatches++;
+        }
+    }
+    end = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < trace.size(); i++) {
+        size_t sent = codedLength[i] ? codedLength[i] : trace[i].size();
+        rawBytes += trace[i].size();
+        sentBytes += sent;
+        codedFrames += codedLength[i] != 0;
+        deltaFrames += codedLength[i] && (coded[i][0] & CODEC_DELTA);
+        for (int j = 0; j < 2; j++) {
+            rawAirtime[j] += airtime(trace[i].size(), j ? 12 : 7);
+            sentAirtime[j] += airtime(sent, j ? 12 : 7);
+        }
+    }
+    double decodeTime =
+        codedFrames
+            ? std::chrono::duration<double, std::micro>(end - start).count() /
+                  (CODEC_BENCH_ROUNDS * codedFrames)
+            : 0;
+
+    char benchmark[32];
+    snprintf(benchmark, sizeof(benchmark), "codec_%s", name);
+    report(benchmark, "payload_bytes", (double)rawBytes / trace.size());
+    report(benchmark, "ratio", (double)sentBytes / rawBytes);
+    report(benchmark, "coded_share", (double)codedFrames / trace.size());
+    report(benchmark, "delta_share", (double)deltaFrames / trace.size());
+    report(benchmark, "mismatches", mismatches);
+    report(benchmark, "encode_us", encodeTime);
+    report(benchmark, "decode_us", decodeTime);
+    report(benchmark, "airtime_saved_sf7",
+           1 - sentAirtime[0] / rawAirtime[0]);
+    report(benchmark, "airtime_saved_sf12",
+           1 - sentAirtime[1] / rawAirtime[1]);
+}
+
+BENCH(codec) {
+    run("gps", gpsTrace());
+    run("sensor", sensorTrace());
+    run("text", textTrace());
+    run("sim", simTrace());
+    run("random", randomTrace());
+}
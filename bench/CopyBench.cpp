@@ -0,0 +1,122 @@
+// Bytes copied per delivered packet, from push() on one node to the
+// application reading it on another node of the simulator. The copying API
+// (push() and pop()) is compared to the zero-copy one (reserve()/commit() and
+// peek()/release()).
+
+#include <Arduino.h>
+#include <QMAC.h>
+
+#include <algorithm>
+
+#include "Bench.h"
+#include "Simulator.h"
+
+#define COPY_BENCH_PACKETS  200
+#define COPY_BENCH_INTERVAL 30000000  // us between two pushed packets
+
+struct CopyBench {
+    QMACClass mac;
+    bool zeroCopy;
+    byte payloadSize;
+    uint32_t pushed = 0;
+    uint32_t delivered = 0;  // unique packets
+    bool seen[COPY_BENCH_PACKETS] = {};
+};
+
+static CopyBench *peers[2];
+
+static void fill(byte *payload, byte size, uint32_t seq) {
+    for (byte i = 0; i < size; i++) payload[i] = seq + i;
+}
+
+// counts packets with the expected payload which were not delivered before
+static void deliver(CopyBench &b, const Packet &p) {
+    byte seq = p.payload[0];
+    if (p.payloadLength != b.payloadSize || seq >= COPY_BENCH_PACKETS) return;
+    for (byte i = 0; i < p.payloadLength; i++) {
+        if (p.payload[i] != (byte)(seq + i)) return;
+    }
+    if (!b.seen[seq]) b.delivered++;
+    b.seen[seq] = true;
+}
+
+static void produce(CopyBench &b, sim::Node &node, int64_t &next) {
+    byte destination = peers[1]->mac.localAddress;
+    while (node.now >= next && b.pushed < COPY_BENCH_PACKETS) {
+        if (b.zeroCopy) {
+            byte *payload = b.mac.reserve(destination);
+            if (payload) {
+                fill(payload, b.payloadSize, b.pushed);
+                b.mac.commit(b.payloadSize);
+            }
+        } else {
+            byte payload[PAYLOAD_SIZE];
+            fill(payload, b.payloadSize, b.pushed);
+            b.mac.push(payload, b.payloadSize, destination);
+        }
+        b.pushed++;
+        next += COPY_BENCH_INTERVAL;
+    }
+    if (b.pushed == COPY_BENCH_PACKETS) next = INT64_MAX;
+}
+
+static void consume(CopyBench &b) {
+    while (b.mac.numPacketsAvailable() > 0) {
+        if (b.zeroCopy) {
+            deliver(b, *b.mac.peek());
+            b.mac.release();
+        } else {
+            Packet p = b.mac.pop();
+            deliver(b, p);
+        }
+    }
+}
+
+static void copyBenchNode(sim::Node &node) {
+    CopyBench &b = *static_cast<CopyBench *>(node.user);
+    LoRa.begin(868E6);
+    while (!b.mac.begin(node.id + 1));
+    // only the first node produces packets
+    int64_t next = &b == peers[0] ? node.now : INT64_MAX;
+    while (true) {
+        if (&b == peers[0]) produce(b, node, next);
+        uint32_t timeout = b.mac.poll();
+        consume(b);
+        if (timeout) {
+            int64_t deadline = node.toGlobal(node.localTime() + timeout * 1000);
+            sim::simulator->sleepUntilGlobal(std::min(deadline, next), true);
+        }
+    }
+}
+
+static void runCopyBench(bool zeroCopy, byte payloadSize) {
+    sim::Simulator simulator(1);
+    for (int i = 0; i < 2; i++) {
+        peers[i] = new CopyBench();
+        peers[i]->zeroCopy = zeroCopy;
+        peers[i]->payloadSize = payloadSize;
+        peers[i]->mac.localAddress = i + 1;
+        sim::Node &node =
+            simulator.addNode(10 * i, 0, 0, 0, 0, copyBenchNode);
+        node.user = peers[i];
+    }
+    uint64_t start = bytesCopied();
+    simulator.run(
+        (int64_t)COPY_BENCH_PACKETS * COPY_BENCH_INTERVAL * 2 + 60000000);
+    uint64_t copied = bytesCopied() - start;
+
+    char name[32];
+    snprintf(name, sizeof(name), "copies/%s/%u",
+             zeroCopy ? "zero_copy" : "copy", payloadSize);
+    report(name, "delivered", peers[1]->delivered);
+    report(name, "bytes_per_delivered",
+           peers[1]->delivered ? (double)copied / peers[1]->delivered : 0);
+    for (CopyBench *b : peers) delete b;
+}
+
+BENCH(copies) {
+    for (byte payloadSize : {16, 200}) {
+        runCopyBench(false, payloadSize);
+        runCopyBench(true, payloadSize);
+    }
+}
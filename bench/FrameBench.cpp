@@ -0,0 +1,130 @@
+// Encoding and decoding of frames by QMACFrame in both header formats.
+// Reports the time per frame and the throughput, and the time of the
+// table-driven CRC against one computed bit by bit. Encoding includes the CRC
+// but not the payload, which is written to the radio from the packet.
+// test/test_frame checks the frames.
+
+#include <QMAC.h>
+
+#include <chrono>
+
+#include "Bench.h"
+
+#define FRAME_BENCH_ROUNDS 200000
+
+// CRC as the CRC16 class of robtillaart/CRC computes it
+static uint16_t bitwiseCrc(const byte *data, size_t length,
+                           uint16_t crc = 0) {
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 0x8000 ? (uint16_t)(crc << 1 ^ QMAC_CRC16_POLYNOMIAL)
+                               : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static Packet dataPacket(byte payloadLength, uint16_t flags) {
+    Packet p = {};
+    p.destination = 2;
+    p.source = 1;
+    // the low byte has the version bits of the compact header set
+    p.packetID = 0x1266;
+    p.type = payloadLength ? QMAC_DATA_FRAME : QMAC_ACK_FRAME;
+    p.flags = flags;
+    p.ackBase = 0x0107;
+    p.ackBitmap = 0x00810001;
+    p.finalDestination = 9;
+    p.origin = 5;
+    p.originID = 0x0311;
+    p.hops = 2;
+    p.payloadLength = payloadLength;
+    for (byte i = 0; i < payloadLength; i++) p.payload[i] = i * 7;
+    return p;
+}
+
+// the bytes the radio receives
+static size_t flatten(const QMACFrame &f, byte *frame) {
+    memcpy(frame, f.header, f.headerLength);
+    memcpy(frame + f.headerLength, f.payload, f.payloadLength);
+    memcpy(frame + f.headerLength + f.payloadLength, f.trailer,
+           f.trailerLength);
+    return f.length();
+}
+
+static void measureFrame(const char *name, const Packet &p, bool time,
+                         QMACHeaderFormat format) {
+    char benchmark[32];
+    snprintf(benchmark, sizeof(benchmark), "frame_%s%s",
+             format == QMAC_HEADER_COMPACT ? "compact_" : "", name);
+    QMACFrame f;
+    BenchTimer encode;
+    encode.start();
+    for (uint32_t i = 0; i < FRAME_BENCH_ROUNDS; i++) {
+        f.encode(p, p.sinkHops != NO_ROUTE, time, format);
+        f.seal(time, i);
+    }
+    encode.stop();
+    byte frame[MAX_FRAME_SIZE];
+    size_t length = flatten(f, frame);
+    Packet decoded;
+    volatile uint32_t valid = 0;
+    BenchTimer decode;
+    decode.start();
+    for (uint32_t i = 0; i < FRAME_BENCH_ROUNDS; i++) {
+        valid = valid + QMACFrame::decode(frame, length, &decoded);
+    }
+    decode.stop();
+    double encodeTime = encode.nanoseconds() / FRAME_BENCH_ROUNDS;
+    double decodeTime = decode.nanoseconds() / FRAME_BENCH_ROUNDS;
+    report(benchmark, "bytes", length);
+    encode.report(benchmark, "encode", FRAME_BENCH_ROUNDS);
+    decode.report(benchmark, "decode", FRAME_BENCH_ROUNDS);
+    report(benchmark, "encode_mb_s", length * 1e3 / encodeTime);
+    report(benchmark, "decode_mb_s", length * 1e3 / decodeTime);
+}
+
+BENCH(frame) {
+    Packet sync = {};
+    sync.destination = BCADDR;
+    sync.source = 1;
+    sync.type = QMAC_SYNC_FRAME;
+    sync.sinkHops = NO_ROUTE;
+    sync.nextActiveTime = 12345000;
+    Packet ack = dataPacket(0, 0);
+    Packet small = dataPacket(16, 0);
+    Packet full = dataPacket(PAYLOAD_SIZE - ACK_FIELD_HEADER_SIZE - 3 -
+                                 ROUTE_FIELD_SIZE,
+                             QMAC_FLAG_ACKS | QMAC_FLAG_ROUTED);
+    full.nextActiveTime = 0x9abcdef0;
+
+    for (int format = QMAC_HEADER_LEGACY; format <= QMAC_HEADER_COMPACT;
+         format++) {
+        QMACHeaderFormat f = (QMACHeaderFormat)format;
+        measureFrame("sync", sync, true, f);
+        measureFrame("ack", ack, false, f);
+        measureFrame("data16", small, false, f);
+        measureFrame("full", full, true, f);
+    }
+
+    byte data[MAX_FRAME_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = i * 13;
+    volatile uint16_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < FRAME_BENCH_ROUNDS; i++) {
+        sink = sink + QMACFrame::crc(data, sizeof(data));
+    }
+    auto end = std::chrono::steady_clock::now();
+    report("frame", "crc_table_ns_per_byte",
+           std::chrono::duration<double, std::nano>(end - start).count() /
+               FRAME_BENCH_ROUNDS / sizeof(data));
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < FRAME_BENCH_ROUNDS / 10; i++) {
+        sink = sink + bitwiseCrc(data, sizeof(data));
+    }
+    end = std::chrono::steady_clock::now();
+    report("frame", "crc_bitwise_ns_per_byte",
+           std::chrono::duration<double, std::nano>(end - start).count() /
+               (FRAME_BENCH_ROUNDS / 10) / sizeof(data));
+}
@@ -0,0 +1,271 @@
+// Time and heap allocations of the work QMAC does per frame and per packet:
+// frames handed over by the receive interrupt and parsed by run(), the send
+// and reception queues, ACK matching and duplicate lookups, and the
+// scheduling of the send slots. The MAC runs on a node of the simulator, so
+// it reads its clock and drives its radio there, but the simulated time does
+// not advance while measuring. None of these paths allocate, every *_allocs
+// metric stays at 0.
+
+#include <Arduino.h>
+#include <QMAC.h>
+#include <esp_timer.h>
+
+#include "Bench.h"
+#include "Simulator.h"
+
+#define HOT_PATH_BENCH_BATCHES 20000
+#define HOT_PATH_BENCH_SORTS   1024
+#define HOT_PATH_BENCH_PASSES  200
+#define HOT_PATH_BENCH_ROUNDS  1000000
+#define HOT_PATH_BENCH_ADDRESS 1
+#define HOT_PATH_BENCH_PEER    2
+#define HOT_PATH_BENCH_PAYLOAD 16
+
+// Reaches into QMACClass for the steps run() takes per frame
+struct QMACBench {
+    // Hands a frame to the MAC as the receive interrupt does and processes it
+    // as run() does, returns false if it was not valid
+    static bool receive(QMACClass &mac, const byte *frame, size_t length) {
+        QMACClass::RawFrame &raw = mac.rxFrames[mac.rxHead];
+        raw.length = length;
+        raw.rssi = -80;
+        raw.snr = 8;
+        raw.time = esp_timer_get_time();
+        memcpy(raw.data, frame, length);
+        mac.rxHead = (mac.rxHead + 1) % QMAC_RX_FRAMES;
+        Packet &p = mac.receiveBuffer();
+        if (!mac.receive(&p)) return false;
+        mac.handlePacket(p);
+        return true;
+    }
+
+    // Takes the packets out of the send queue as sendingSlot() does once they
+    // were sent, so they wait for their ACKs. Returns their number and writes
+    // their IDs to ids.
+    static size_t sendQueued(QMACClass &mac, uint16_t *ids) {
+        size_t count = 0;
+        uint8_t index;
+        while (mac.sendQueue.pop(&index)) {
+            const Packet &p = mac.sendPool[index];
+            QMACClass::InFlight &f = mac.inFlight[index];
+            f.sentTime = esp_timer_get_time();
+            f.awaitingAck = true;
+            f.frameID = p.packetID;
+            mac.neighbors.get(p.destination).outstanding++;
+            mac.resendQueue.push(index);
+            ids[count++] = p.packetID;
+        }
+        return count;
+    }
+
+    static void assignSlots(QMACClass &mac) { mac.assignSlots(0); }
+
+    static DuplicateFilter<QMAC_DEDUP_SOURCES> &receivedPackets(
+        QMACClass &mac) {
+        return mac.receivedPackets;
+    }
+};
+
+// Frames of the peer as they come from the radio
+template <size_t N>
+struct Frames {
+    byte data[N][MAX_FRAME_SIZE];
+    size_t length[N];
+    size_t count = 0;
+
+    void add(const Packet &p) {
+        QMACFrame f;
+        f.encode(p, false, false, QMAC_HEADER_COMPACT);
+        f.seal(false, 0);
+        byte *frame = data[count];
+        memcpy(frame, f.header, f.headerLength);
+        memcpy(frame + f.headerLength, f.payload, f.payloadLength);
+        memcpy(frame + f.headerLength + f.payloadLength, f.trailer,
+               f.trailerLength);
+        length[count++] = f.length();
+    }
+
+    // returns the number of frames which were not valid
+    uint32_t receive(QMACClass &mac) const {
+        uint32_t invalid = 0;
+        for (size_t i = 0; i < count; i++) {
+            invalid += !QMACBench::receive(mac, data[i], length[i]);
+        }
+        return invalid;
+    }
+};
+
+static Frames<QMAC_RECEPTION_QUEUE_SIZE> dataFrames;
+static Frames<QMAC_SEND_QUEUE_SIZE> ackFrames;
+static const byte payload[HOT_PATH_BENCH_PAYLOAD] = {1, 2, 3, 4, 5, 6, 7, 8};
+
+// a batch of broadcasts of the peer, continuing its IDs
+static void broadcasts(uint16_t *nextID) {
+    Packet p = {};
+    p.destination = BCADDR;
+    p.source = HOT_PATH_BENCH_PEER;
+    p.type = QMAC_DATA_FRAME;
+    p.payloadLength = HOT_PATH_BENCH_PAYLOAD;
+    memcpy(p.payload, payload, HOT_PATH_BENCH_PAYLOAD);
+    dataFrames.count = 0;
+    for (size_t i = 0; i < QMAC_RECEPTION_QUEUE_SIZE; i++) {
+        p.packetID = (*nextID)++;
+        dataFrames.add(p);
+    }
+}
+
+// the ACKs of the peer for the packets with the given IDs
+static void acks(const uint16_t *ids, size_t count) {
+    Packet p = {};
+    p.destination = HOT_PATH_BENCH_ADDRESS;
+    p.source = HOT_PATH_BENCH_PEER;
+    p.type = QMAC_ACK_FRAME;
+    ackFrames.count = 0;
+    for (size_t i = 0; i < count; i++) {
+        p.packetID = ids[i];
+        ackFrames.add(p);
+    }
+}
+
+static void drain(QMACClass &mac) {
+    while (mac.peek()) mac.release();
+}
+
+// Runs the benchmark on a MAC which was started on a node of the simulator
+static void runOnNode(void (*benchmark)(QMACClass &mac)) {
+    sim::Simulator simulator(1);
+    QMACClass *mac = new QMACClass();
+    simulator.addNode(0, 0, 0, 0, 0, [&](sim::Node &) {
+        LoRa.begin(868E6);
+        mac->setInterruptReceive(true);
+        // alone on the channel no node answers the sync, the MAC is running
+        // and sleeping anyway
+        mac->begin(HOT_PATH_BENCH_ADDRESS);
+        benchmark(*mac);
+    });
+    simulator.run(24LL * 3600 * 1000000);
+    delete mac;
+}
+
+BENCH(queue) {
+    runOnNode([](QMACClass &mac) {
+        BenchTimer push, receive, pop;
+        uint32_t invalid = 0;
+        uint16_t nextID = 1;
+        uint16_t ids[QMAC_SEND_QUEUE_SIZE];
+        for (uint32_t batch = 0; batch < HOT_PATH_BENCH_BATCHES; batch++) {
+            push.start();
+            for (size_t i = 0; i < QMAC_SEND_QUEUE_SIZE; i++) {
+                mac.push(payload, HOT_PATH_BENCH_PAYLOAD, HOT_PATH_BENCH_PEER);
+            }
+            push.stop();
+            // the ACKs empty the send queue again
+            acks(ids, QMACBench::sendQueued(mac, ids));
+            invalid += ackFrames.receive(mac);
+
+            broadcasts(&nextID);
+            receive.start();
+            invalid += dataFrames.receive(mac);
+            receive.stop();
+            Packet p;
+            pop.start();
+            while (mac.popInto(p));
+            pop.stop();
+        }
+        push.report("queue", "push",
+                    (uint64_t)HOT_PATH_BENCH_BATCHES * QMAC_SEND_QUEUE_SIZE);
+        receive.report(
+            "queue", "receive",
+            (uint64_t)HOT_PATH_BENCH_BATCHES * QMAC_RECEPTION_QUEUE_SIZE);
+        pop.report(
+            "queue", "pop",
+            (uint64_t)HOT_PATH_BENCH_BATCHES * QMAC_RECEPTION_QUEUE_SIZE);
+        report("queue", "invalid_frames", invalid);
+        report("queue", "packets_left", mac.sendQueueStats().size);
+    });
+}
+
+BENCH(ack) {
+    runOnNode([](QMACClass &mac) {
+        BenchTimer ack, stale, duplicate;
+        uint32_t invalid = 0;
+        uint16_t nextID = 1;
+        uint16_t ids[QMAC_SEND_QUEUE_SIZE];
+        for (uint32_t batch = 0; batch < HOT_PATH_BENCH_BATCHES; batch++) {
+            for (size_t i = 0; i < QMAC_SEND_QUEUE_SIZE; i++) {
+                mac.push(payload, HOT_PATH_BENCH_PAYLOAD, HOT_PATH_BENCH_PEER);
+            }
+            acks(ids, QMACBench::sendQueued(mac, ids));
+            ack.start();
+            invalid += ackFrames.receive(mac);
+            ack.stop();
+            // ACKs which were received before, e.g. sent again by the peer
+            stale.start();
+            invalid += ackFrames.receive(mac);
+            stale.stop();
+
+            broadcasts(&nextID);
+            invalid += dataFrames.receive(mac);
+            // retransmissions of packets which were received before
+            duplicate.start();
+            invalid += dataFrames.receive(mac);
+            duplicate.stop();
+            drain(mac);
+        }
+        uint64_t packets =
+            (uint64_t)HOT_PATH_BENCH_BATCHES * QMAC_SEND_QUEUE_SIZE;
+        ack.report("ack", "match", packets);
+        stale.report("ack", "stale", packets);
+        duplicate.report(
+            "ack", "duplicate",
+            (uint64_t)HOT_PATH_BENCH_BATCHES * QMAC_RECEPTION_QUEUE_SIZE);
+        report("ack", "invalid_frames", invalid);
+        report("ack", "packets_left", mac.sendQueueStats().size);
+        report("ack", "dedup_hits", mac.dedupStats().hits);
+
+        // the lookup alone, with every source of the filter in use
+        DuplicateFilter<QMAC_DEDUP_SOURCES> &filter =
+            QMACBench::receivedPackets(mac);
+        for (uint32_t id = 0; id < 64; id++) {
+            for (uint8_t source = 0; source < QMAC_DEDUP_SOURCES; source++) {
+                filter.insert(source, id, 0);
+            }
+        }
+        volatile uint32_t hits = 0;
+        measure("ack", "dedup_lookup", HOT_PATH_BENCH_ROUNDS, [&](uint32_t i) {
+            hits = hits + filter.contains(i % QMAC_DEDUP_SOURCES, i & 127);
+        });
+    });
+}
+
+static int slots[HOT_PATH_BENCH_SORTS][QMAC_SEND_QUEUE_SIZE];
+
+BENCH(slots) {
+    // KickSort on the random slots of a full send queue, as assignSlots()
+    // sorts them
+    BenchTimer sort;
+    uint32_t state = 1;
+    for (uint32_t pass = 0; pass < HOT_PATH_BENCH_PASSES; pass++) {
+        for (auto &queue : slots) {
+            for (int &slot : queue) {
+                state = state * 1103515245 + 12345;
+                slot = 1 + (state >> 16) % 500;
+            }
+        }
+        sort.start();
+        for (auto &queue : slots) {
+            KickSort<int>::quickSort(queue, QMAC_SEND_QUEUE_SIZE);
+        }
+        sort.stop();
+    }
+    sort.report("slots", "sort",
+                (uint64_t)HOT_PATH_BENCH_PASSES * HOT_PATH_BENCH_SORTS);
+
+    runOnNode([](QMACClass &mac) {
+        for (size_t i = 0; i < QMAC_SEND_QUEUE_SIZE; i++) {
+            mac.push(payload, HOT_PATH_BENCH_PAYLOAD, HOT_PATH_BENCH_PEER);
+        }
+        measure("slots", "assign", HOT_PATH_BENCH_ROUNDS / 10,
+                [&](uint32_t) { QMACBench::assignSlots(mac); });
+    });
+}
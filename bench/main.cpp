@@ -0,0 +1,115 @@
+// Runs the benchmarks given on the command line, or all of them.
+
+#include <LoRaAirtime.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+#include <vector>
+
+#include "Bench.h"
+
+// defined by the application, used by the MAC
+LoRaAirtime LoRaCalc;
+
+struct Benchmark {
+    const char *name;
+    BenchFunction function;
+};
+
+static std::vector<Benchmark> &benchmarks() {
+    static std::vector<Benchmark> registered;
+    return registered;
+}
+
+BenchRegistration::BenchRegistration(const char *name, BenchFunction function) {
+    benchmarks().push_back({name, function});
+}
+
+static uint64_t copied = 0;
+
+extern "C" void *__real_memcpy(void *dest, const void *src, size_t n);
+
+// Linked with --wrap=memcpy
+extern "C" void *__wrap_memcpy(void *dest, const void *src, size_t n) {
+    copied += n;
+    return __real_memcpy(dest, src, n);
+}
+
+uint64_t bytesCopied() { return copied; }
+
+static uint64_t allocated = 0;
+
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_calloc(size_t count, size_t size);
+extern "C" void *__real_realloc(void *p, size_t size);
+
+// Linked with --wrap=malloc, --wrap=calloc and --wrap=realloc
+extern "C" void *__wrap_malloc(size_t size) {
+    allocated++;
+    return __real_malloc(size);
+}
+
+extern "C" void *__wrap_calloc(size_t count, size_t size) {
+    allocated++;
+    return __real_calloc(count, size);
+}
+
+extern "C" void *__wrap_realloc(void *p, size_t size) {
+    allocated++;
+    return __real_realloc(p, size);
+}
+
+// The operator new of the C++ library calls malloc() from outside the
+// wrapped objects, so it is replaced by one which goes through the wrapper
+void *operator new(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+uint64_t allocations() { return allocated; }
+
+void BenchTimer::report(const char *benchmark, const char *operation,
+                        uint64_t operations) const {
+    char metric[64];
+    snprintf(metric, sizeof(metric), "%s_ns", operation);
+    ::report(benchmark, metric, operations ? elapsed / operations : 0);
+    snprintf(metric, sizeof(metric), "%s_allocs", operation);
+    ::report(benchmark, metric,
+             operations ? (double)allocated / operations : 0);
+}
+
+void report(const char *benchmark, const char *metric, double value) {
+    printf("%s,%s,%.3f\n", benchmark, metric, value);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        bool found = false;
+        for (const Benchmark &b : benchmarks()) {
+            found |= !strcmp(argv[i], b.name);
+        }
+        if (!found) {
+            fprintf(stderr, "unknown benchmark %s, available:", argv[i]);
+            for (const Benchmark &b : benchmarks()) {
+                fprintf(stderr, " %s", b.name);
+            }
+            fprintf(stderr, "\n");
+            return 1;
+        }
+    }
+    printf("benchmark,metric,value\n");
+    for (const Benchmark &b : benchmarks()) {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc; i++) selected |= !strcmp(argv[i], b.name);
+        if (selected) b.function();
+    }
+    return 0;
+}
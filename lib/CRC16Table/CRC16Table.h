@@ -0,0 +1,49 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+template <uint16_t... I>
+struct CRC16Indices {};
+
+template <uint16_t N, uint16_t... I>
+struct CRC16Range : CRC16Range<N - 1, N - 1, I...> {};
+
+template <uint16_t... I>
+struct CRC16Range<0, I...> {
+    typedef CRC16Indices<I...> type;
+};
+
+/**
+ * CRC-16 of a polynomial, most significant bit first, without reflection or
+ * final XOR, e.g. CRC16Table<0x8001>::compute(data, length). The table of
+ * the 256 byte values is computed at compile time, so a byte costs one
+ * lookup instead of 8 shifts.
+ */
+template <uint16_t POLYNOMIAL,
+          typename = typename CRC16Range<256>::type>
+struct CRC16Table;
+
+template <uint16_t POLYNOMIAL, uint16_t... BYTE>
+struct CRC16Table<POLYNOMIAL, CRC16Indices<BYTE...>> {
+    // one bit at a time, as the table is built
+    static constexpr uint16_t entry(uint16_t crc, int bits) {
+        return bits ? entry(crc & 0x8000 ? (uint16_t)(crc << 1 ^ POLYNOMIAL)
+                                         : (uint16_t)(crc << 1),
+                            bits - 1)
+                    : crc;
+    }
+
+    static constexpr uint16_t table[] = {entry(BYTE << 8, 8)...};
+
+    static uint16_t compute(const uint8_t *data, size_t length,
+                            uint16_t crc = 0) {
+        for (size_t i = 0; i < length; i++) {
+            crc = crc << 8 ^ table[(crc >> 8 ^ data[i]) & 0xff];
+        }
+        return crc;
+    }
+};
+
+template <uint16_t POLYNOMIAL, uint16_t... BYTE>
+constexpr uint16_t
+    CRC16Table<POLYNOMIAL, CRC16Indices<BYTE...>>::table[];
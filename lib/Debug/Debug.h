@@ -5,4 +5,5 @@
 #ifdef DEBUG
 #define LOG(str) Serial.println(str)
 #else
+#define LOG(str)
 #endif
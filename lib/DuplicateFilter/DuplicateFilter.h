@@ -0,0 +1,75 @@
+#pragma once
+#include <NeighborTable.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Remembers which packet IDs were received from up to N sources, so
+// retransmissions of packets whose ACK got lost can be recognized. For every
+// source the highest ID and a bitmap of the 64 IDs below it are kept, IDs are
+// compared modulo 65536. Lookups and insertions are O(1), when all N windows
+// are used the oldest one is reused for a new source. A source which restarts
+// counts its IDs from the start again, which would fall into its old window,
+// so the window is forgotten once the source was silent for long enough, see
+// expire().
+template <size_t N>
+class DuplicateFilter {
+   public:
+    // returns true if the packet was inserted before
+    bool contains(uint8_t source, uint16_t id) {
+        const Window *w = windows.find(source);
+        if (!w) return false;
+        int distance = (int16_t)(uint16_t)(w->last - id);
+        if (distance < 0 || distance >= WINDOW_SIZE) return false;
+        return (w->seen >> distance) & 1;
+    }
+
+    // now is the time in ms the packet was received
+    void insert(uint8_t source, uint16_t id, int64_t now) {
+        Window &w = windows.get(source);
+        w.heard = now;
+        int distance = (int16_t)(uint16_t)(w.last - id);
+        if (!w.seen || distance >= WINDOW_SIZE) {
+            // new source, or far behind the window as if the source restarted
+            w.last = id;
+            w.seen = 1;
+        } else if (distance < 0) {
+            // newer than all IDs seen so far, slide the window
+            w.seen = -distance < WINDOW_SIZE ? w.seen << -distance | 1 : 1;
+            w.last = id;
+        } else {
+            w.seen |= 1ull << distance;
+        }
+    }
+
+    // Returns the ID within 128 of the highest one of the source which ends
+    // with the given low byte, for sources which only send that
+    uint16_t extend(uint8_t source, uint8_t low) {
+        const Window *w = windows.find(source);
+        if (!w) return low;
+        return w->last + (int8_t)(uint8_t)(low - w->last);
+    }
+
+    // Forgets the IDs received from the source if it was not heard from for
+    // longer than maxSilence ms, to be called before looking up its packets
+    void expire(uint8_t source, int64_t now, int64_t maxSilence) {
+        Window *w = windows.find(source);
+        if (w && now - w->heard > maxSilence) w->seen = 0;
+    }
+
+    // Moves the time base by offset ms, e.g. after the clock was reset
+    void shift(int64_t offset) {
+        for (size_t i = 0; i < windows.size(); i++) windows[i].heard += offset;
+    }
+
+    void clear() { windows.clear(); }
+
+   private:
+    static const int WINDOW_SIZE = 64;
+    typedef struct {
+        uint16_t last;  // highest ID received
+        uint64_t seen;  // bit i is set if ID last - i was received
+        int64_t heard;  // ms, when the last packet was inserted
+    } Window;
+
+    NeighborTable<Window, N> windows;
+};
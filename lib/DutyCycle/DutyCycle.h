@@ -0,0 +1,167 @@
+#pragma once
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Sub-bands of the 868 MHz band and their duty cycle limits, from ETSI
+// EN 300 220-2 and ERC Recommendation 70-03 annex 1
+typedef struct {
+    long low;  // Hz
+    long high;
+    float dutyCycle;
+} DutyCycleBand;
+
+// Limits the airtime of transmissions per sub-band. Every band has a token
+// bucket which is refilled at the duty cycle and holds the airtime earned in
+// the burst time, so a band that was quiet for a long time cannot send more
+// than that at once. In addition, at most the duty cycle of the sliding
+// window (ETSI uses 1 h) is used within the window. The window is kept as
+// airtime per interval, so a transmission may be counted up to one interval
+// longer than necessary, but never shorter. A share of the bucket is reserved
+// for priority transmissions, others may only use what is left over.
+template <size_t INTERVALS>
+class DutyCycleRegulator {
+   public:
+    static const uint32_t NEVER = UINT32_MAX;
+
+    DutyCycleRegulator() { configure(3600000, 360000, 0.2); }
+
+    // window and burst in ms, reserve is a share of the bucket
+    void configure(uint32_t window, uint32_t burst, float reserve) {
+        this->intervalLength = (window + INTERVALS - 2) / (INTERVALS - 1);
+        this->window = window;
+        this->burst = burst;
+        this->reserve = reserve;
+        for (Band &b : bands) b.started = false;
+    }
+
+    // Returns the ms until `airtime` ms may be sent on `frequency`, 0 if now
+    // or NEVER if it exceeds the limits of the band
+    uint32_t delay(long frequency, float airtime, bool priority, int64_t now) {
+        Band &b = update(frequency, now);
+        float need = airtime + (priority ? 0 : reserve * capacity(b));
+        if (need > capacity(b) || need > b.limit->dutyCycle * window) {
+            return NEVER;
+        }
+        int64_t wait = 0;
+        if (b.tokens < need) {
+            wait = ceil((need - b.tokens) / b.limit->dutyCycle);
+        }
+        // the oldest intervals leave the window first
+        float used = windowUsed(b);
+        for (size_t k = 0;
+             k < INTERVALS && used + need > b.limit->dutyCycle * window; k++) {
+            int64_t n = b.current - (int64_t)(INTERVALS - 1) + (int64_t)k;
+            used -= b.used[slot(n)];
+            int64_t expiry =
+                (n + (int64_t)INTERVALS) * (int64_t)intervalLength - now;
+            if (expiry > wait) wait = expiry;
+        }
+        return wait;
+    }
+
+    void consume(long frequency, float airtime, int64_t now) {
+        Band &b = update(frequency, now);
+        b.tokens -= airtime;
+        b.used[slot(b.current)] += airtime;
+    }
+
+    // ms of airtime which may be sent on `frequency` right now
+    float available(long frequency, bool priority, int64_t now) {
+        Band &b = update(frequency, now);
+        float left =
+            fmin(b.tokens, b.limit->dutyCycle * window - windowUsed(b));
+        return fmax(0, left - (priority ? 0 : reserve * capacity(b)));
+    }
+
+    // ms of airtime sent on `frequency` within the window
+    float used(long frequency, int64_t now) {
+        return windowUsed(update(frequency, now));
+    }
+
+    // ms of airtime the window allows on `frequency`
+    float budget(long frequency, int64_t now) {
+        return update(frequency, now).limit->dutyCycle * window;
+    }
+
+    // Moves the time base by `offset` ms, e.g. after the clock was reset.
+    // The intervals move by whole interval lengths, so the airtime sent in
+    // them leaves the window later rather than earlier.
+    void shift(int64_t offset) {
+        int64_t intervals = offset / (int64_t)intervalLength;
+        if (offset > intervals * (int64_t)intervalLength) intervals++;
+        for (Band &b : bands) {
+            if (!b.started) continue;
+            b.updated += offset;
+            b.current += intervals;
+        }
+    }
+
+   private:
+    static const size_t NUM_BANDS = 6;
+    typedef struct {
+        const DutyCycleBand *limit;
+        bool started;
+        float tokens;           // ms
+        int64_t updated;        // ms
+        int64_t current;        // number of the current interval
+        float used[INTERVALS];  // ms of airtime per interval
+    } Band;
+
+    static const DutyCycleBand *limits() {
+        // the last entry applies outside of the sub-bands
+        static const DutyCycleBand table[NUM_BANDS] = {
+            {863000000, 868000000, 0.01},  {868000000, 868600000, 0.01},
+            {868700000, 869200000, 0.001}, {869400000, 869650000, 0.1},
+            {869700000, 870000000, 0.01},  {0, 0, 0.01}};
+        return table;
+    }
+
+    static size_t slot(int64_t n) {
+        return ((n % (int64_t)INTERVALS) + INTERVALS) % INTERVALS;
+    }
+
+    float capacity(const Band &b) const { return b.limit->dutyCycle * burst; }
+
+    static float windowUsed(const Band &b) {
+        float used = 0;
+        for (float u : b.used) used += u;
+        return used;
+    }
+
+    // refills the bucket and slides the window up to now
+    Band &update(long frequency, int64_t now) {
+        size_t i = 0;
+        while (i < NUM_BANDS - 1 && (frequency < limits()[i].low ||
+                                     frequency >= limits()[i].high)) {
+            i++;
+        }
+        Band &b = bands[i];
+        int64_t current = now / intervalLength;
+        if (!b.started) {
+            b.limit = &limits()[i];
+            b.started = true;
+            b.tokens = capacity(b);
+            b.updated = now;
+            b.current = current;
+            for (float &u : b.used) u = 0;
+        }
+        if (now > b.updated) {
+            b.tokens = fmin(capacity(b), b.tokens + (now - b.updated) *
+                                                        b.limit->dutyCycle);
+            b.updated = now;
+        }
+        for (int64_t n = b.current + 1;
+             n <= current && n <= b.current + (int64_t)INTERVALS; n++) {
+            b.used[slot(n)] = 0;
+        }
+        if (current > b.current) b.current = current;
+        return b;
+    }
+
+    uint32_t intervalLength;  // ms
+    uint32_t window;
+    uint32_t burst;
+    float reserve;
+    Band bands[NUM_BANDS] = {};
+};
@@ -1,63 +1,194 @@
 #pragma once
 #include <Arduino.h>
 
+// Airtime of LoRa frames as given in the SX1276/77/78/79 datasheet, section
+// 4.1.1.7, and Semtech AN1200.13. Every computation is done in integers so
+// it can run at compile time, see LoRaAirtimeTable.
+struct LoRaAirtimeModel {
+    // Symbols of a payload of `length` bytes, without the preamble. The code
+    // rate is the denominator of 4/5 ... 4/8.
+    static constexpr uint16_t payloadSymbols(uint8_t length, uint8_t sf,
+                                             uint8_t codeRate,
+                                             bool explicitHeader, bool crc,
+                                             bool lowDataRate) {
+        return 8 + blocks((int16_t)8 * length - 4 * sf + 28 + 16 * crc -
+                              20 * !explicitHeader,
+                          4 * (sf - 2 * lowDataRate)) *
+                       codeRate;
+    }
+
+    // Semtech recommends the low data rate optimization for symbols of 16 ms
+    // and longer
+    static constexpr bool lowDataRateNeeded(uint8_t sf, long bandwidth) {
+        return (1L << sf) * 1000 >= 16 * bandwidth;
+    }
+
+    // in us, rounded to the nearest us
+    static constexpr uint32_t airtime(uint8_t length, uint8_t sf,
+                                      long bandwidth, uint8_t codeRate,
+                                      bool explicitHeader, bool crc,
+                                      bool lowDataRate,
+                                      uint16_t preambleLength) {
+        // in quarter symbols because of the 4.25 symbols of the sync word
+        return ((4ULL * (preambleLength + payloadSymbols(length, sf, codeRate,
+                                                         explicitHeader, crc,
+                                                         lowDataRate)) +
+                 17) *
+                    (1ULL << sf) * 1000000 +
+                2 * bandwidth) /
+               (4 * bandwidth);
+    }
+
+   private:
+    // code rate blocks needed for `bits`, a block carries `bitsPerBlock`
+    static constexpr int16_t blocks(int16_t bits, int16_t bitsPerBlock) {
+        return bits > 0 ? (bits + bitsPerBlock - 1) / bitsPerBlock : 0;
+    }
+};
+
+template <uint16_t... I>
+struct LoRaAirtimeIndices {};
+
+template <uint16_t N, uint16_t... I>
+struct LoRaAirtimeRange : LoRaAirtimeRange<N - 1, N - 1, I...> {};
+
+template <uint16_t... I>
+struct LoRaAirtimeRange<0, I...> {
+    typedef LoRaAirtimeIndices<I...> type;
+};
+
+/**
+ * Airtime in us of every payload length from 0 to 255 bytes, computed at
+ * compile time for fixed radio settings, e.g.
+ * LoRaAirtimeTable<7, 125000>::micros[length]. The defaults are the ones of
+ * the arduino-LoRa library.
+ */
+template <uint8_t SF, long BANDWIDTH, uint8_t CODE_RATE = 5,
+          bool EXPLICIT_HEADER = true, bool CRC = false,
+          bool LOW_DATA_RATE = LoRaAirtimeModel::lowDataRateNeeded(SF,
+                                                                  BANDWIDTH),
+          uint16_t PREAMBLE_LENGTH = 8,
+          typename = typename LoRaAirtimeRange<256>::type>
+struct LoRaAirtimeTable;
+
+template <uint8_t SF, long BANDWIDTH, uint8_t CODE_RATE, bool EXPLICIT_HEADER,
+          bool CRC, bool LOW_DATA_RATE, uint16_t PREAMBLE_LENGTH,
+          uint16_t... LENGTH>
+struct LoRaAirtimeTable<SF, BANDWIDTH, CODE_RATE, EXPLICIT_HEADER, CRC,
+                        LOW_DATA_RATE, PREAMBLE_LENGTH,
+                        LoRaAirtimeIndices<LENGTH...>> {
+    static constexpr uint32_t micros[] = {LoRaAirtimeModel::airtime(
+        LENGTH, SF, BANDWIDTH, CODE_RATE, EXPLICIT_HEADER, CRC, LOW_DATA_RATE,
+        PREAMBLE_LENGTH)...};
+};
+
+template <uint8_t SF, long BANDWIDTH, uint8_t CODE_RATE, bool EXPLICIT_HEADER,
+          bool CRC, bool LOW_DATA_RATE, uint16_t PREAMBLE_LENGTH,
+          uint16_t... LENGTH>
+constexpr uint32_t
+    LoRaAirtimeTable<SF, BANDWIDTH, CODE_RATE, EXPLICIT_HEADER, CRC,
+                     LOW_DATA_RATE, PREAMBLE_LENGTH,
+                     LoRaAirtimeIndices<LENGTH...>>::micros[];
+
 class LoRaAirtime {
    private:
     uint8_t sf;
-    uint16_t bw;
+    long bw;
     uint8_t cr;
     boolean h;
     boolean crc;
     boolean de;
+    boolean autoDe;
     uint8_t preambleLength;
+    // airtime in us by payload length, rebuilt after the settings changed
+    uint32_t table[256];
+    boolean tableValid;
+
+    void update() {
+        if (autoDe) de = LoRaAirtimeModel::lowDataRateNeeded(sf, bw);
+        tableValid = false;
+    }
 
    public:
+    // defaults of the arduino-LoRa library
     LoRaAirtime() {
         this->sf = 7;
-        this->bw = 125;
-        this->cr = 4;
+        this->bw = 125E3;
+        this->cr = 5;
         this->preambleLength = 8;
-        this->h = false;
+        this->h = true;
         this->crc = false;
-        this->de = false;
+        this->autoDe = true;
+        update();
     }
 
     void setSpreadingFactor(uint8_t spreadingFactor) {
         this->sf = spreadingFactor;
+        update();
     }
 
-    void setBandwidth(uint16_t bandWidth) { this->bw = bandWidth; }
+    // in Hz
+    void setBandwidth(long bandWidth) {
+        this->bw = bandWidth;
+        update();
+    }
 
-    void setCodeRate(uint8_t codeRate) { this->cr = 4 / (codeRate + 4); }
+    // denominator of the code rate 4/5 ... 4/8, as LoRa.setCodingRate4()
+    void setCodeRate(uint8_t codeRate) {
+        this->cr = codeRate;
+        update();
+    }
 
     void setHasExplicitHeader(boolean hasExplicitHeader) {
         this->h = hasExplicitHeader;
+        update();
     }
 
-    void setCRC(boolean hasCRC) { this->crc = hasCRC; }
+    void setCRC(boolean hasCRC) {
+        this->crc = hasCRC;
+        update();
+    }
 
+    // Overrides the optimization which is otherwise enabled for symbols of
+    // 16 ms and longer
     void setLowDataRateEnabled(boolean lowDataRateEnabled) {
         this->de = lowDataRateEnabled;
+        this->autoDe = false;
+        update();
     }
 
     void setPreambleLength(uint8_t preambleLength) {
         this->preambleLength = preambleLength;
+        update();
     }
 
     // returns airtime in ms
     float getAirtime(uint8_t payloadLength) {
-        // Calculation based on:
-        // https://www.openhacks.com/uploadsproductos/loradesignguide_std.pdf
-        const float tSym = pow(2, sf) / bw;
-        const float tPreamble = (preambleLength + 4.25) * tSym;
-        float payloadSymbNb = ceil((8 * payloadLength - 4 * sf + 44 - 20 * h) /
-                                   (4 * (sf - 2 * de))) *
-                              (cr + 4);
-        payloadSymbNb = payloadSymbNb > 0 ? payloadSymbNb : 0;
-        payloadSymbNb += 8;
-
-        const float tPayload = payloadSymbNb * tSym;
-        return tPayload + tPreamble;
+        if (!tableValid) {
+            for (int length = 0; length < 256; length++) {
+                table[length] = LoRaAirtimeModel::airtime(
+                    length, sf, bw, cr, h, crc, de, preambleLength);
+            }
+            tableValid = true;
+        }
+        return table[payloadLength] / 1000.0f;
+    }
+
+    // returns airtime in ms at a data rate which may differ from the
+    // configured one, the other settings are the same
+    float getAirtime(uint8_t payloadLength, uint8_t spreadingFactor,
+                     long bandwidth) {
+        if (spreadingFactor == sf && bandwidth == bw) {
+            return getAirtime(payloadLength);
+        }
+        bool lowDataRate =
+            autoDe ? LoRaAirtimeModel::lowDataRateNeeded(spreadingFactor,
+                                                         bandwidth)
+                   : de;
+        return LoRaAirtimeModel::airtime(payloadLength, spreadingFactor,
+                                         bandwidth, cr, h, crc, lowDataRate,
+                                         preambleLength) /
+               1000.0f;
     }
 };
-extern LoRaAirtime LoRaCalc;
\ No newline at end of file
+extern LoRaAirtime LoRaCalc;
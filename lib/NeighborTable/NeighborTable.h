@@ -0,0 +1,58 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Fixed table of per-node state for up to N addresses. A byte array maps every
+// address to its entry, so lookups are O(1). When all entries are used, the
+// entry which was added first is reused for a new address.
+template <typename T, size_t N>
+class NeighborTable {
+    static_assert(N > 0 && N <= 255, "entry indices are stored in a byte");
+
+   public:
+    NeighborTable() { clear(); }
+
+    // returns nullptr if the address has no entry
+    T *find(uint8_t address) {
+        uint8_t slot = index[address];
+        return slot ? &entries[slot - 1] : nullptr;
+    }
+
+    // returns the entry of the address, adding a value-initialized one if
+    // there is none
+    T &get(uint8_t address) {
+        uint8_t slot = index[address];
+        if (slot) return entries[slot - 1];
+        // forget the address which used this entry before
+        if (used == N) {
+            index[addresses[next]] = 0;
+        } else {
+            used++;
+        }
+        addresses[next] = address;
+        entries[next] = T();
+        index[address] = next + 1;
+        T &entry = entries[next];
+        next = (next + 1) % N;
+        return entry;
+    }
+
+    // entries in no particular order, i < size()
+    T &operator[](size_t i) { return entries[i]; }
+    uint8_t address(size_t i) const { return addresses[i]; }
+    size_t size() const { return used; }
+
+    void clear() {
+        memset(index, 0, sizeof(index));
+        used = 0;
+        next = 0;
+    }
+
+   private:
+    T entries[N];
+    uint8_t addresses[N];
+    uint8_t index[256];  // entry of each address + 1, 0 if none
+    size_t used;
+    uint8_t next;  // entry to use for the next new address
+};
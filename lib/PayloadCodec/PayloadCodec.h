@@ -0,0 +1,332 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// stages a payload is passed through, in this order, and undone in reverse
+// the 32-bit little endian words are replaced by their difference to the words
+// of a reference payload, e.g. the previous payload sent to the same node
+#define CODEC_DELTA 0x01
+// the 32-bit little endian words are written as zigzag varints, the bytes
+// after the last full word as they are
+#define CODEC_VARINT 0x02
+// repeated byte strings are replaced by references to their previous
+// occurrence, in the format of LZF
+#define CODEC_LZ     0x04
+#define CODEC_STAGES 0x07
+// The encoded payload starts with a format byte of the stages and the number
+// of bytes after the last full word. With CODEC_DELTA the tag of the reference
+// and a check of its content follow.
+#define CODEC_TAIL_SHIFT   3
+#define CODEC_TAIL_MASK    0x18
+#define CODEC_FORMAT_SIZE  1
+#define CODEC_DELTA_HEADER 2
+// the LZ stage finds matches through a hash table of the last position of
+// every 3-byte string, and refers back at most CODEC_LZ_WINDOW bytes
+#define CODEC_LZ_HASH_BITS   8
+#define CODEC_LZ_WINDOW      8192
+#define CODEC_LZ_MAX_LITERAL 32
+#define CODEC_LZ_MAX_MATCH   264
+
+// Compresses payloads of up to N bytes with every combination of the stages
+// and keeps the smallest result. All buffers are inside the object, so it
+// never allocates and its time and stack use are bounded by N.
+template <size_t N>
+class PayloadCodec {
+    static_assert(N >= 4 && N <= 255, "payload lengths are stored in a byte");
+
+   public:
+    /**
+     * Encodes a payload.
+     *
+     * @param in The payload.
+     * @param length The length of the payload, at most N.
+     * @param stages The stages which may be used, CODEC_DELTA is only used if
+     *               the reference is not empty.
+     * @param reference The payload the receiver decodes the delta against.
+     * @param referenceLength The length of the reference, 0 if there is none.
+     * @param tag Tells the receiver which reference to use, see
+     *            PayloadCodec::referenceTag.
+     * @param out The buffer for the encoded payload.
+     * @return The length of the encoded payload, or 0 if no combination of the
+     *         stages makes the payload shorter.
+     */
+    size_t encode(const uint8_t *in, size_t length, uint8_t stages,
+                  const uint8_t *reference, size_t referenceLength,
+                  uint8_t tag, uint8_t *out) {
+        if (length > N) return 0;
+        if (!referenceLength) stages &= ~CODEC_DELTA;
+        if (stages & CODEC_DELTA) {
+            delta(in, length, reference, referenceLength, deltaBuffer, false);
+        }
+        size_t best = length;
+        for (uint8_t format = 1; format <= CODEC_STAGES; format++) {
+            if ((format & stages) != format) continue;
+            size_t header = CODEC_FORMAT_SIZE;
+            if (format & CODEC_DELTA) header += CODEC_DELTA_HEADER;
+            if (header >= best) continue;
+            const uint8_t *data = format & CODEC_DELTA ? deltaBuffer : in;
+            size_t size = length;
+            if (format & CODEC_VARINT) {
+                size = varint(data, size, varintBuffer);
+                if (!size) continue;
+                data = varintBuffer;
+            }
+            if (format & CODEC_LZ) {
+                size = lz(data, size, lzBuffer, best - header);
+                if (!size) continue;
+                data = lzBuffer;
+            }
+            if (header + size >= best) continue;
+            best = header + size;
+            out[0] = format | (length % 4) << CODEC_TAIL_SHIFT;
+            if (format & CODEC_DELTA) {
+                out[1] = tag;
+                out[2] = check(reference, referenceLength);
+            }
+            memcpy(out + header, data, size);
+        }
+        return best < length ? best : 0;
+    }
+
+    /**
+     * Decodes a payload.
+     *
+     * @param in The encoded payload.
+     * @param length The length of the encoded payload.
+     * @param reference The reference the tag of the payload refers to, see
+     *                  PayloadCodec::referenceTag.
+     * @param referenceLength The length of the reference.
+     * @param out The buffer for the payload, at least N bytes.
+     * @return The length of the payload, or 0 if the encoding is invalid or
+     *         the reference does not match the one of the sender.
+     */
+    size_t decode(const uint8_t *in, size_t length, const uint8_t *reference,
+                  size_t referenceLength, uint8_t *out) {
+        if (length < CODEC_FORMAT_SIZE) return 0;
+        uint8_t format = in[0];
+        if (format & ~(CODEC_STAGES | CODEC_TAIL_MASK)) return 0;
+        size_t header = CODEC_FORMAT_SIZE;
+        if (format & CODEC_DELTA) {
+            header += CODEC_DELTA_HEADER;
+            if (length < header || !referenceLength ||
+                in[2] != check(reference, referenceLength))
+                return 0;
+        }
+        const uint8_t *data = in + header;
+        size_t size = length - header;
+        if (format & CODEC_LZ) {
+            size = unlz(data, size, lzBuffer);
+            if (!size) return 0;
+            data = lzBuffer;
+        }
+        if (format & CODEC_VARINT) {
+            size_t tail = (format & CODEC_TAIL_MASK) >> CODEC_TAIL_SHIFT;
+            size = unvarint(data, size, tail, varintBuffer);
+            if (!size) return 0;
+            data = varintBuffer;
+        }
+        if (format & CODEC_DELTA) {
+            delta(data, size, reference, referenceLength, out, true);
+        } else {
+            memcpy(out, data, size);
+        }
+        return size;
+    }
+
+    // returns false if the encoded payload does not refer to a reference,
+    // otherwise the tag the sender passed to encode()
+    static bool referenceTag(const uint8_t *in, size_t length, uint8_t *tag) {
+        if (length < CODEC_FORMAT_SIZE + CODEC_DELTA_HEADER ||
+            !(in[0] & CODEC_DELTA))
+            return false;
+        *tag = in[1];
+        return true;
+    }
+
+    // CRC-8 (polynomial 0x07) of a reference, so a receiver whose reference
+    // differs from the one of the sender does not decode garbage
+    static uint8_t check(const uint8_t *data, size_t length) {
+        uint8_t crc = length;
+        for (size_t i = 0; i < length; i++) {
+            crc ^= data[i];
+            for (int bit = 0; bit < 8; bit++) {
+                crc = crc & 0x80 ? (uint8_t)(crc << 1 ^ 0x07) : crc << 1;
+            }
+        }
+        return crc;
+    }
+
+   private:
+    static uint32_t word(const uint8_t *p, size_t i, size_t length) {
+        // the bytes past the end count as 0
+        uint32_t w = 0;
+        for (size_t j = 0; j < 4 && i + j < length; j++) {
+            w |= (uint32_t)p[i + j] << 8 * j;
+        }
+        return w;
+    }
+
+    static void delta(const uint8_t *in, size_t length,
+                      const uint8_t *reference, size_t referenceLength,
+                      uint8_t *out, bool undo) {
+        size_t i = 0;
+        for (; i + 4 <= length; i += 4) {
+            uint32_t r = word(reference, i, referenceLength);
+            uint32_t w = word(in, i, length);
+            w = undo ? w + r : w - r;
+            for (int j = 0; j < 4; j++) out[i + j] = w >> 8 * j;
+        }
+        for (; i < length; i++) {
+            uint8_t r = i < referenceLength ? reference[i] : 0;
+            out[i] = undo ? in[i] + r : in[i] - r;
+        }
+    }
+
+    // returns 0 if the result is longer than N
+    static size_t varint(const uint8_t *in, size_t length, uint8_t *out) {
+        size_t o = 0;
+        size_t i = 0;
+        for (; i + 4 <= length; i += 4) {
+            uint32_t w = word(in, i, length);
+            // small negative differences become small numbers as well
+            uint32_t z = w << 1 ^ (uint32_t)((int32_t)w >> 31);
+            do {
+                if (o == N) return 0;
+                out[o++] = (z & 0x7f) | (z > 0x7f ? 0x80 : 0);
+                z >>= 7;
+            } while (z);
+        }
+        if (o + length - i > N) return 0;
+        memcpy(out + o, in + i, length - i);
+        return o + length - i;
+    }
+
+    static size_t unvarint(const uint8_t *in, size_t length, size_t tail,
+                           uint8_t *out) {
+        if (length < tail) return 0;
+        size_t o = 0;
+        size_t i = 0;
+        while (i < length - tail) {
+            uint32_t z = 0;
+            for (int shift = 0;; shift += 7) {
+                if (i == length - tail || shift > 28) return 0;
+                z |= (uint32_t)(in[i] & 0x7f) << shift;
+                if (!(in[i++] & 0x80)) break;
+            }
+            if (o + 4 > N) return 0;
+            uint32_t w = z >> 1 ^ -(z & 1);
+            for (int j = 0; j < 4; j++) out[o++] = w >> 8 * j;
+        }
+        if (o + tail > N) return 0;
+        memcpy(out + o, in + i, tail);
+        o += tail;
+        return o;
+    }
+
+    static size_t hash(const uint8_t *p) {
+        uint32_t v = p[0] << 16 | p[1] << 8 | p[2];
+        return (v * 2654435761u) >> (32 - CODEC_LZ_HASH_BITS);
+    }
+
+    // Greedy LZF. Literal runs are a control byte of the length - 1 and the
+    // bytes, matches are the length - 2 in the top 3 bits of the control byte
+    // (7 means the next byte adds to it) and the offset - 1 in the other 13
+    // bits. Returns 0 if the result does not fit into capacity.
+    size_t lz(const uint8_t *in, size_t length, uint8_t *out,
+              size_t capacity) {
+        memset(positions, 0, sizeof(positions));
+        size_t o = 0;
+        size_t literals = 0;  // pending literals before position i
+        size_t i = 0;
+        while (i < length) {
+            size_t match = 0;
+            size_t offset = 0;
+            if (i + 3 <= length) {
+                size_t h = hash(in + i);
+                size_t candidate = positions[h];
+                positions[h] = i + 1;
+                if (candidate) {
+                    size_t r = candidate - 1;
+                    offset = i - r - 1;
+                    while (match < CODEC_LZ_MAX_MATCH && i + match < length &&
+                           in[r + match] == in[i + match])
+                        match++;
+                    if (offset >= CODEC_LZ_WINDOW || match < 3) match = 0;
+                }
+            }
+            if (!match) {
+                literals++;
+                i++;
+                if (literals == CODEC_LZ_MAX_LITERAL) {
+                    if (!literal(in + i - literals, literals, out, &o,
+                                 capacity))
+                        return 0;
+                    literals = 0;
+                }
+                continue;
+            }
+            if (literals &&
+                !literal(in + i - literals, literals, out, &o, capacity))
+                return 0;
+            literals = 0;
+            size_t code = match - 2;
+            if (o + (code < 7 ? 2 : 3) > capacity) return 0;
+            out[o++] = (code < 7 ? code : 7) << 5 | offset >> 8;
+            if (code >= 7) out[o++] = code - 7;
+            out[o++] = offset;
+            // later strings can refer into the match as well
+            for (size_t j = i + 1; j < i + match && j + 3 <= length; j++) {
+                positions[hash(in + j)] = j + 1;
+            }
+            i += match;
+        }
+        if (literals &&
+            !literal(in + i - literals, literals, out, &o, capacity))
+            return 0;
+        return o;
+    }
+
+    static bool literal(const uint8_t *in, size_t count, uint8_t *out,
+                        size_t *o, size_t capacity) {
+        if (*o + 1 + count > capacity) return false;
+        out[(*o)++] = count - 1;
+        memcpy(out + *o, in, count);
+        *o += count;
+        return true;
+    }
+
+    static size_t unlz(const uint8_t *in, size_t length, uint8_t *out) {
+        size_t o = 0;
+        size_t i = 0;
+        while (i < length) {
+            size_t control = in[i++];
+            if (control < CODEC_LZ_MAX_LITERAL) {
+                size_t count = control + 1;
+                if (i + count > length || o + count > N) return 0;
+                memcpy(out + o, in + i, count);
+                i += count;
+                o += count;
+                continue;
+            }
+            size_t count = control >> 5;
+            if (count == 7) {
+                if (i == length) return 0;
+                count += in[i++];
+            }
+            count += 2;
+            if (i == length) return 0;
+            size_t offset = ((control & 0x1f) << 8 | in[i++]) + 1;
+            if (offset > o || o + count > N) return 0;
+            // the copy may overlap, e.g. for runs of one byte
+            for (size_t j = 0; j < count; j++, o++) out[o] = out[o - offset];
+        }
+        return o;
+    }
+
+    uint8_t deltaBuffer[N];
+    uint8_t varintBuffer[N];
+    uint8_t lzBuffer[N];
+    // last position + 1 of every hash of 3 bytes, 0 if none
+    uint8_t positions[1 << CODEC_LZ_HASH_BITS];
+};
@@ -1,160 +1,1755 @@
 #include <QMAC.h>
 
+QMACClass *QMACClass::receiver = nullptr;
+
+// Copies a packet without the unused part of the payload
+static void copyPacket(Packet &to, const Packet &from) {
+    memcpy(&to, &from, offsetof(Packet, payload) + from.payloadLength);
+    to.sendRetryCount = from.sendRetryCount;
+}
+
+// Bandwidths of the SX127x in Hz, follow frames carry the index
+static const long BANDWIDTHS[] = {7800,  10400, 15600,  20800,  31250,
+                                  41700, 62500, 125000, 250000, 500000};
+static const int NUM_BANDWIDTHS = sizeof(BANDWIDTHS) / sizeof(BANDWIDTHS[0]);
+// SNR in dB the SX127x needs to demodulate, indexed by spreading factor - 6
+static const float REQUIRED_SNR[] = {-5, -7.5, -10, -12.5, -15, -17.5, -20};
+
+static int bandwidthIndex(long bandwidth) {
+    for (int i = 0; i < NUM_BANDWIDTHS; i++) {
+        if (BANDWIDTHS[i] == bandwidth) return i;
+    }
+    return -1;
+}
+
+// in ms, looked up in the table of LoRaCalc at the base data rate
+static float frameAirtime(size_t length, QMACDataRate rate) {
+    return LoRaCalc.getAirtime(length, rate.spreadingFactor, rate.bandwidth);
+}
+
+// Maps an offset between two schedules to the nearest one within half a cycle
+static float wrapOffset(float offset, float cycle) {
+    return offset - cycle * roundf(offset / cycle);
+}
+
+static bool sameDataRate(QMACDataRate a, QMACDataRate b) {
+    return a.spreadingFactor == b.spreadingFactor && a.bandwidth == b.bandwidth;
+}
+
+static void countIn(QMACHistogram &h, uint32_t value) {
+    uint8_t bin = 0;
+    while (bin < QMAC_HISTOGRAM_BINS - 1 && value >= h.unit << bin) bin++;
+    h.bins[bin]++;
+}
+
+static byte *putUint32(byte *out, uint32_t value) {
+    for (int i = 0; i < 4; i++) *out++ = value >> (8 * i);
+    return out;
+}
+
 bool QMACClass::begin(byte localAddress) {
     // assign random address if address not specified
     this->localAddress = localAddress == BCADDR ? random(254) : localAddress;
-    // Corresponds to the 1% LoRa Airtime rule
-    this->availableAirtimePerCycle = 0.01 * (activeDuration + sleepDuration);
 
-    esp_timer_create_args_t timer_args = {.callback = &QMACClass::timerCallback,
-                                          .arg = this,
-                                          .name = "duty_cycle_timer"};
-    esp_timer_create(&timer_args, &this->timer_handle);
+    // begin() may be retried until it succeeds, only create the timer once
+    if (!this->timer_handle) {
+        esp_timer_create_args_t timer_args = {
+            .callback = &QMACClass::timerCallback,
+            .arg = this,
+            .name = "duty_cycle_timer"};
+        esp_timer_create(&timer_args, &this->timer_handle);
+    }
+    accountedTime = esp_timer_get_time();
+    counters.ackRtt.unit = ACK_RTT_UNIT;
+    counters.latency.unit = LATENCY_UNIT;
+    QMACPlatform::begin();
+    LoRaCalc.setSpreadingFactor(baseRate.spreadingFactor);
+    LoRaCalc.setBandwidth(baseRate.bandwidth);
+    setRadioDataRate(baseRate);
+    if (interruptReceive) {
+        receiver = this;
+        LoRa.onReceive(&QMACClass::onReceiveISR);
+        if (listenBeforeTalk) LoRa.onCadDone(&QMACClass::onCadDoneISR);
+    }
+    if (sleepMode == QMAC_DEEP_SLEEP && restoreState()) return true;
+    esp_timer_stop(timer_handle);
     esp_timer_start_once(timer_handle, sleepDuration * 1000);
-    return synchronize();
+    startSync(true);
+    return runUntilSleep();
 }
 
 bool QMACClass::run() {
-    if (!this->active) return true;
+    if (!this->active) {
+        powerDown();
+        return true;
+    }
+    return runUntilSleep();
+}
+
+bool QMACClass::runUntilSleep() {
+    // Drive the state machine until the active period or synchronization is
+    // over and block whenever there is nothing to do
+    do {
+        uint32_t timeout = poll();
+        if (timeout) QMACPlatform::waitForEvent(timeout);
+    } while (state != QMAC_SLEEP);
+    return cycleResult;
+}
 
+uint32_t QMACClass::poll() {
+    uint64_t start = esp_timer_get_time();
+    accountTime(start);
+    bool inCycle = state != QMAC_SLEEP;
+    uint32_t timeout = 0;
+    switch (state) {
+        case QMAC_SLEEP:
+            timeout = sleeping();
+            break;
+        case QMAC_SCHEDULE:
+            timeout = scheduling();
+            break;
+        case QMAC_CAD:
+            timeout = sensingChannel();
+            break;
+        case QMAC_TX_SLOT:
+            timeout = sendingSlot();
+            break;
+        case QMAC_RX_WAIT:
+            timeout = listening();
+            break;
+        case QMAC_SYNC_SEND:
+            timeout = sendingSync();
+            break;
+        case QMAC_SYNC_LISTEN:
+            timeout = listeningSync();
+            break;
+        case QMAC_SYNC_PAUSE:
+            timeout = pausingSync();
+            break;
+        default:
+            // e.g. a corrupted state, the next active period starts over
+            LOG("Unknown state " + String((int)state));
+            state = QMAC_SLEEP;
+            break;
+    }
+    // Only time spent in an active period or synchronization counts as busy
+    if (inCycle || state != QMAC_SLEEP) {
+        cycleBusyTime += esp_timer_get_time() - start;
+    }
+    if (inCycle && state == QMAC_SLEEP) {
+        lastBusyTime = cycleBusyTime;
+        totalBusyTime += cycleBusyTime;
+        cycleBusyTime = 0;
+        lastAirtimeSaved = cycleAirtimeSaved;
+        totalAirtimeSaved += cycleAirtimeSaved;
+        cycleAirtimeSaved = 0;
+    }
+    return timeout;
+}
+
+uint32_t QMACClass::sleeping() {
+    if (!this->active) {
+        int64_t timeout = esp_timer_get_next_alarm() / 1000 - millis();
+        return timeout > 1 ? timeout : 1;
+    }
+    cycleResult = true;
     if (this->periodsSinceSync >= this->periodsUntilSync) {
-        if (!synchronize()) return false;
+        if (!driftPredicted()) {
+            startSync(true);
+            return 0;
+        }
+        LOG("Skipping synchronization, the drift is predicted");
+        syncs.skipped++;
         this->periodsSinceSync = 0;
-        return true;
     }
-    availableAirtime += availableAirtimePerCycle;
+    state = QMAC_SCHEDULE;
+    return 0;
+}
 
-    // Schedule in which time slots packets in the queue should be sent
-    // We assign a random time slot for every packets to send to avoid collision
-    int slotTime = 100;  // TODO: move
-    int numSlots = activeDuration / slotTime;
-    int numPacketsReady = sendQueue.getSize();
-    int activeSlots[numPacketsReady];
-    bool receivedSync = false;
-    for (size_t i = 0; i < numPacketsReady; i++) {
-        activeSlots[i] = random(numSlots);
-    }
-    KickSort<int>::quickSort(activeSlots, numPacketsReady);
+uint32_t QMACClass::scheduling() {
+    dropExpired();
+    queueFragments();
+    extensions = 0;
+    assignSlots(0);
 
     // Start listening and sending packets
-    int64_t startTime = millis();
-    size_t idx = 0;
+    activeStartTime = millis();
+    lastActivity = activeStartTime;
+    slotJitter = listenBeforeTalk ? random(LBT_JITTER) : 0;
+    receivedSync = false;
     resendQueue.clear();
-    while (this->active) {
-        // For each packet, we send it only when it's its turn:
-        if (!sendQueue.isEmpty() &&
-            millis() >= activeSlots[idx] * slotTime + startTime) {
-            Packet nextPacket = sendQueue[0];
-            // resend the packet in the broadcast packet in the next active
-            // time if sending failed
-            //  don't expect acks when sending broadcast messsages
-            if (!send(nextPacket) || nextPacket.destination != BCADDR) {
-                nextPacket.sendRetryCount++;
-                if (nextPacket.sendRetryCount > maxPacketResendTries) {
-                    LOG("Dropping packet with ID " +
-                        String(nextPacket.packetID) + " after " +
-                        String(nextPacket.sendRetryCount) + " retries");
-                } else {
-                    resendQueue.add(nextPacket);
-                }
-            }
-            sendQueue.removeFirst();
-            idx++;
+    if (interruptReceive) LoRa.receive();
+    state = QMAC_RX_WAIT;
+    return 0;
+}
+
+int QMACClass::periodSlots() {
+    return (activeDuration + extension / 1000) / SLOT_TIME;
+}
+
+void QMACClass::assignSlots(int first) {
+    // Schedule in which time slots packets in the queue should be sent
+    // We assign a random time slot for every packets to send to avoid collision
+    // The queue is ordered by urgency, so when the duty cycle does not allow
+    // to send all packets the most urgent ones are scheduled
+    int numSlots = periodSlots();
+    // Frames have to start a slot before the receivers consider the channel
+    // idle. The first slot is kept free, receivers which are a little late
+    // would miss its frames, and with few slots to choose from they are
+    // frequent.
+    int idleSlots = idleTimeout / SLOT_TIME - 1;
+    if (adaptiveActivePeriod && first == 0) first = 1;
+    int window = numSlots - first;
+    if (adaptiveActivePeriod && window > idleSlots) window = idleSlots;
+    // near the end of the period there may be no slot left, the first
+    // packet is dropped from the schedule below then
+    if (window < 1) window = 1;
+    float airtime =
+        dutyCycle.available(frequency, false, esp_timer_get_time() / 1000);
+    numPacketsReady = 0;
+    while (numPacketsReady < sendQueue.size()) {
+        airtime -= getAirTime(sendPool[sendQueue[numPacketsReady]]);
+        if (airtime < 0) break;
+        numPacketsReady++;
+    }
+    if (!adaptiveActivePeriod) {
+        for (size_t i = 0; i < numPacketsReady; i++) {
+            activeSlots[i] = first + random(window);
+        }
+        KickSort<int>::quickSort(activeSlots, numPacketsReady);
+    }
+    // A frame must not start before the previous one and its ACK are over,
+    // long frames such as fragments would otherwise run into their own ACKs.
+    // With the adaptive period every frame contends anew after the previous
+    // one, the frames of several backlogged nodes interleave instead of
+    // colliding slot after slot.
+    if (adaptiveActivePeriod && numPacketsReady > 0) {
+        activeSlots[0] = first + random(window);
+    }
+    if (numPacketsReady > 0 && activeSlots[0] >= numSlots) numPacketsReady = 0;
+    for (size_t i = 1; i < numPacketsReady; i++) {
+        float previous = getAirTime(sendPool[sendQueue[i - 1]]) + ACK_AIRTIME;
+        int earliest = activeSlots[i - 1] + (int)ceil(previous / SLOT_TIME);
+        if (adaptiveActivePeriod) activeSlots[i] = earliest + random(window);
+        if (activeSlots[i] < earliest) activeSlots[i] = earliest;
+        if (activeSlots[i] >= numSlots) {
+            numPacketsReady = i;
+            break;
         }
+    }
+    slotIndex = 0;
+}
+
+bool QMACClass::backlogged() {
+    // whether packets are left over which the duty cycle allows to send
+    if (sendQueue.isEmpty()) return false;
+    float airtime =
+        dutyCycle.available(frequency, false, esp_timer_get_time() / 1000);
+    return airtime >= getAirTime(sendPool[sendQueue[0]]);
+}
+
+bool QMACClass::reserveStep() {
+    // Makes sure the active period lasts for one step from now, returns
+    // whether it does. A period which ends earlier is extended to it, the
+    // time is taken from the following sleep, one which is long enough is
+    // left alone and not counted as extended.
+    if (!this->active || extensions >= maxExtensions) return false;
+    // the extensions are taken from the sleep, which may have been changed
+    // since the adaptive period was enabled
+    if ((extensions + 1) * extensionStep >= sleepDuration) return false;
+    int64_t now = esp_timer_get_time();
+    int64_t end = esp_timer_get_next_alarm();
+    int64_t target = now + (int64_t)extensionStep * 1000;
+    if (target <= end) return true;
+    esp_timer_stop(timer_handle);
+    esp_timer_start_once(timer_handle, target - now);
+    extension += target - end;
+    extensions++;
+    activity.extended++;
+    LOG("Extending the active period by " + String((uint32_t)(target - end)) +
+        " us");
+    return true;
+}
+
+void QMACClass::noteActivity() {
+    // a wait for selective ACKs may already reach further
+    int64_t now = millis();
+    if (now > lastActivity) lastActivity = now;
+}
+
+bool QMACClass::idle() {
+    // whether the own slots are over and the channel was quiet for the idle
+    // timeout
+    return slotIndex >= numPacketsReady && nextAckDue == INT64_MAX &&
+           !rateUntil && (int64_t)millis() - lastActivity >= idleTimeout;
+}
+
+void QMACClass::sleepEarly() {
+    // Ends the active period before its time, the timer is moved to the
+    // start of the next one
+    int64_t next = nextActiveMicros(esp_timer_get_time());
+    esp_timer_stop(timer_handle);
+    this->active = false;
+    extension = 0;
+    esp_timer_start_once(timer_handle, next);
+    activity.shortened++;
+    LOG("Channel idle, sleeping early");
+}
 
-        Packet p = {};
-        // start listening and ignore if nothing received
-        if (!QMAC.receive(&p)) continue;
-        // ignore packet if it is not for this device
-        if (p.destination != this->localAddress && p.destination != BCADDR)
+void QMACClass::accountTime(int64_t now) {
+    // The time since the last call is counted for the state the MAC was in,
+    // except for the time spent sending
+    int64_t elapsed = now - accountedTime - (txTime - txAccounted);
+    accountedTime = now;
+    txAccounted = txTime;
+    if (elapsed <= 0) return;
+    switch (state) {
+        case QMAC_SLEEP:
+        case QMAC_SYNC_PAUSE:
+            sleepTime += elapsed;
+            break;
+        case QMAC_SYNC_SEND:
+        case QMAC_SYNC_LISTEN:
+            syncTime += elapsed;
+            break;
+        default:
+            rxTime += elapsed;
+    }
+}
+
+uint32_t QMACClass::sendingSlot() {
+    // packets may have expired since the active period started
+    dropExpired();
+    uint8_t index;
+    if (!sendQueue.pop(&index)) {
+        slotIndex++;
+        state = QMAC_RX_WAIT;
+        return 0;
+    }
+    route(sendPool[index]);
+    Packet &frame = aggregate(index);
+    bool piggyback = attachAcks(frame);
+    // further frames follow, in this period or in an extension of it
+    bool more = adaptiveActivePeriod && !sendQueue.isEmpty();
+    if (more) frame.flags |= QMAC_FLAG_MORE;
+    const Packet &coded = compress(frame);
+    QMACDataRate rate = selectDataRate(
+        frame.destination,
+        QMACFrame::frameLength(coded, forwarding, driftCorrection,
+                               headerFormat));
+    bool adaptive = !sameDataRate(rate, baseRate);
+    int64_t sentTime = esp_timer_get_time();
+    bool sent = adaptive ? sendAtDataRate(coded, rate) : send(coded);
+    if (sent && adaptive) neighbors.get(frame.destination).adaptiveSent = true;
+    if (sent && compression) {
+        codecCounters.payloadBytes += frame.payloadLength;
+        codecCounters.codedBytes += coded.payloadLength;
+        if (&coded == &frame) {
+            codecCounters.raw++;
+        } else {
+            codecCounters.coded++;
+            if (coded.payload[0] & CODEC_DELTA) codecCounters.delta++;
+            codecCounters.airtimeSaved += getAirTime(frame) - getAirTime(coded);
+        }
+    }
+    frame.flags &= ~QMAC_FLAG_MORE;
+    // selective ACKs come after the ACK delay
+    if (sent && ackMode == QMAC_ACK_SELECTIVE) {
+        lastActivity = millis() + ackDelay;
+    }
+    if (piggyback) {
+        // the queued packet may be sent again later without the ACKs
+        frame.flags &= ~QMAC_FLAG_ACKS;
+        if (sent) {
+            neighbors.get(frame.destination).ackBitmap = 0;
+            acks.piggybacked++;
+        }
+    }
+    float separateAirtime = 0;
+    for (uint8_t i = index, next; i != NO_SLOT; i = next) {
+        next = inFlight[i].nextInFrame;
+        Packet &packet = sendPool[i];
+        separateAirtime += getAirTime(packet);
+        if (sent && !inFlight[i].sentTime) {
+            // the first transmission ends the queueing latency
+            QMACClassStats &c = classes[inFlight[i].priority];
+            uint32_t latency = sentTime / 1000 - inFlight[i].queuedTime;
+            c.sent++;
+            classLatencySum[inFlight[i].priority] += latency;
+            if (latency > c.maxLatency) c.maxLatency = latency;
+        }
+        // resend the packet in the broadcast packet in the next active
+        // time if sending failed
+        //  don't expect acks when sending broadcast messsages
+        if (sent && packet.destination == BCADDR) {
+            releaseSendSlot(i, true);
             continue;
-        // react according to packet type
-        if (p.isSyncPacket()) {
-            receivedSync = true;
-            sendSyncPacket(p.source);
-        } else if (p.isAck()) {
-            // When ACK for a packet is received, we can remove the packet
-            // from the unacked queue:
-            LOG("Received ACK for ID " + String(p.packetID));
-            for (size_t i = 0; i < resendQueue.getSize(); i++) {
-                if (resendQueue[i].packetID == p.packetID) {
-                    resendQueue.remove(i);
-                    break;
-                }
+        }
+        // dropped at the end of the active period if no retries are left
+        packet.sendRetryCount++;
+        if (sent) {
+            inFlight[i].sentTime = sentTime;
+            inFlight[i].awaitingAck = true;
+            inFlight[i].frameID = frame.packetID;
+            Neighbor &n = neighbors.get(packet.destination);
+            n.outstanding++;
+            n.periodSent++;
+        }
+        resendQueue.push(i);
+    }
+    if (sent && &frame == &aggregateFrame) {
+        cycleAirtimeSaved += separateAirtime - getAirTime(frame);
+    }
+    slotIndex++;
+    slotJitter = listenBeforeTalk ? random(LBT_JITTER) : 0;
+    state = QMAC_RX_WAIT;
+    return 0;
+}
+
+uint32_t QMACClass::sensingChannel() {
+    // the end of the active period is handled while listening
+    if (!this->active) {
+        state = QMAC_RX_WAIT;
+        return 0;
+    }
+    if (!cadDone) {
+        int64_t remaining = cadStartTime + CAD_TIMEOUT - (int64_t)millis();
+        if (remaining > 0) return remaining;
+        // the radio did not report back, send without sensing
+        LOG("Channel activity detection timed out");
+        state = QMAC_TX_SLOT;
+        return 0;
+    }
+    lbt.checks++;
+    if (!cadDetected) {
+        state = QMAC_TX_SLOT;
+        return 0;
+    }
+    lbt.hits++;
+    LOG("Channel busy, deferring slot " + String(activeSlots[slotIndex]));
+    deferSlot();
+    LoRa.receive();
+    state = QMAC_RX_WAIT;
+    return 0;
+}
+
+void QMACClass::deferSlot() {
+    // Moves the current slot back by a random number of slots, keeping the
+    // slots sorted. Slots beyond the active period are dropped, the packet
+    // stays queued for the next one.
+    int numSlots = periodSlots();
+    int current = (millis() - activeStartTime) / SLOT_TIME;
+    int slot = current + 1 + random(QMAC_LBT_MAX_BACKOFF);
+    slotJitter = random(LBT_JITTER);
+    if (slot >= numSlots) {
+        lbt.postponed++;
+        numPacketsReady--;
+        for (size_t i = slotIndex; i < numPacketsReady; i++) {
+            activeSlots[i] = activeSlots[i + 1];
+        }
+        return;
+    }
+    lbt.deferrals++;
+    size_t i = slotIndex;
+    for (; i + 1 < numPacketsReady && activeSlots[i + 1] < slot; i++) {
+        activeSlots[i] = activeSlots[i + 1];
+    }
+    activeSlots[i] = slot;
+}
+
+uint32_t QMACClass::listening() {
+    if (this->active && adaptiveActivePeriod) {
+        // the packets left over get slots in the step which is left
+        if (slotIndex >= numPacketsReady && backlogged() && reserveStep()) {
+            assignSlots((millis() - activeStartTime) / SLOT_TIME + 1);
+        } else if (idle()) {
+            sleepEarly();
+        }
+    }
+    if (!this->active) {
+        finishActivePeriod();
+        return 0;
+    }
+    // Nothing is sent while following a node or waiting for an ACK at another
+    // data rate
+    if (rateUntil && (int64_t)millis() >= rateUntil) {
+        setRadioDataRate(baseRate);
+    }
+    // For each packet, we send it only when it's its turn:
+    bool pendingSlot = slotIndex < numPacketsReady && !sendQueue.isEmpty();
+    int64_t slotTime =
+        activeSlots[slotIndex] * SLOT_TIME + activeStartTime + slotJitter;
+    if (pendingSlot && !rateUntil && (int64_t)millis() >= slotTime) {
+        if (listenBeforeTalk && interruptReceive) {
+            cadDone = false;
+            cadStartTime = millis();
+            LoRa.channelActivityDetection();
+            state = QMAC_CAD;
+        } else {
+            state = QMAC_TX_SLOT;
+        }
+        return 0;
+    }
+    if (!rateUntil && (int64_t)millis() >= nextAckDue) {
+        sendDueAcks();
+        return 0;
+    }
+
+    Packet &p = receiveBuffer();
+    if (receive(&p)) {
+        bool switched = rateUntil;
+        handlePacket(p);
+        // the announced frame or the ACK arrived at the other data rate
+        if (switched) setRadioDataRate(baseRate);
+        return 0;
+    }
+    // the radio has to be polled if the receive interrupt is not used
+    if (!interruptReceive) return 0;
+    // otherwise wait for the next slot, a due ACK, a packet or the end of the
+    // active period
+    int64_t deadline = pendingSlot && !rateUntil
+                           ? slotTime
+                           : esp_timer_get_next_alarm() / 1000 + 1;
+    int64_t next = rateUntil ? rateUntil : nextAckDue;
+    if (next < deadline) deadline = next;
+    int64_t timeout = deadline - millis();
+    return timeout > 1 ? timeout : 1;
+}
+
+void QMACClass::handlePacket(Packet &p) {
+    // ignore packet if it is not for this device
+    if (p.destination != this->localAddress && p.destination != BCADDR)
+        return;
+    // react according to packet type
+    if (p.isSyncPacket()) {
+        receivedSync = true;
+        sendSyncPacket(p.source);
+        return;
+    }
+    if ((p.flags & QMAC_FLAG_MORE) && adaptiveActivePeriod) {
+        // the next frame of the sender may be lost in a collision, the
+        // channel counts as busy for another idle timeout
+        int64_t hold = (int64_t)millis() + idleTimeout;
+        if (hold > lastActivity) lastActivity = hold;
+        reserveStep();
+    }
+    if (p.flags & QMAC_FLAG_FOLLOW) {
+        if (p.destination == this->localAddress) follow(p);
+        return;
+    }
+    if (p.flags & QMAC_FLAG_ACKS) {
+        // selective ACK, on its own or along with data
+        LOG("Received ACKs from ID " + String(p.ackBase));
+        for (uint8_t i = 0; i < ACK_FIELD_IDS; i++) {
+            if (p.ackBitmap >> i & 1) {
+                acknowledge(p.source, p.ackBase + i,
+                            (QMACHeaderFormat)p.format);
             }
+        }
+    }
+    if (p.isAck()) {
+        // the ACK field was handled above
+        if (p.flags & QMAC_FLAG_ACKS) return;
+        // When ACK for a packet is received, we can remove the packet
+        // from the unacked queue:
+        LOG("Received ACK for ID " + String(p.packetID));
+        acknowledge(p.source, p.packetID, (QMACHeaderFormat)p.format);
+    } else {
+        LOG("Received Packet with ID " + String(p.packetID));
+        // the previous hop is acknowledged
+        byte source = p.source;
+        uint16_t id = p.packetID;
+        bool accepted;
+        if ((p.flags & QMAC_FLAG_ROUTED) &&
+            p.finalDestination != this->localAddress) {
+            accepted = forward(p);
         } else {
-            LOG("Received Packet with ID " + String(p.packetID));
-            bool isAlreadyReceived = false;
-            for (size_t i = 0; i < receptionQueue.getSize(); i++) {
-                if (receptionQueue[i].packetID == p.packetID) {
-                    isAlreadyReceived = true;
-                    break;
-                }
+            if (p.flags & QMAC_FLAG_ROUTED) {
+                // delivered as if it came from the origin directly
+                p.source = p.origin;
+                p.packetID = p.originID;
+                p.flags &= ~QMAC_FLAG_ROUTED;
             }
-            if (!isAlreadyReceived) {
-                receptionQueue.add(p);
+            // A source which was silent for longer than a cycle may have
+            // restarted, retransmissions come in the next active period.
+            // One after a longer gap is delivered again, rather than
+            // dropping what a restarted node sends.
+            receivedPackets.expire(p.source, millis(), maxSilence());
+            if (p.format == QMAC_HEADER_LEGACY) {
+                // continues the IDs received from the source before
+                p.packetID = receivedPackets.extend(p.source, p.packetID);
             }
-            if (p.destination != BCADDR) {
-                LOG("SENDING ACK");
-                sendAck(p);
+            accepted = p.flags & QMAC_FLAG_AGGREGATED ? enqueueRecords(p)
+                       : p.flags & QMAC_FLAG_FRAGMENT ? reassemble(p)
+                                                      : enqueueReceived(p);
+        }
+        // without an ACK the sender retries once there is room again
+        if (!accepted) return;
+        if (!(p.flags & QMAC_FLAG_ACK_REQUEST)) return;
+        if (ackMode == QMAC_ACK_SELECTIVE) {
+            queueAck(source, id);
+        } else {
+            LOG("SENDING ACK");
+            sendAck(source, id);
+        }
+    }
+}
+
+Packet &QMACClass::receiveBuffer() {
+    if (rxSlot < 0) rxSlot = receptionPool.allocate();
+    return rxSlot >= 0 ? receptionPool[rxSlot] : rxPacket;
+}
+
+bool QMACClass::enqueueReceived(const Packet &p) {
+    if (receivedPackets.contains(p.source, p.packetID)) {
+        dedup.hits++;
+        return true;
+    }
+    dedup.misses++;
+    if (rxSlot >= 0 && &p == &receptionPool[rxSlot]) {
+        // the packet was received into rxSlot, queue it in place
+        receptionQueue.push(rxSlot);
+        rxSlot = -1;
+    } else {
+        bool rejected;
+        int index = allocateReceptionSlot(&rejected);
+        if (rejected) return false;
+        if (index >= 0) {
+            copyPacket(receptionPool[index], p);
+            receptionQueue.push(index);
+        }
+    }
+    receivedPackets.insert(p.source, p.packetID, millis());
+    return true;
+}
+
+bool QMACClass::enqueueRecords(const Packet &frame) {
+    // Splits the payload into the packets it aggregates, returns false if one
+    // of them was rejected
+    bool accepted = true;
+    size_t i = 0;
+    while (i + RECORD_HEADER_SIZE <= frame.payloadLength) {
+        // records carry the low byte of their ID, the IDs of a frame are
+        // within 128 of the one of the frame
+        uint16_t id = frame.packetID +
+                      (int8_t)(uint8_t)(frame.payload[i] - frame.packetID);
+        byte length = frame.payload[i + 1];
+        const byte *payload = frame.payload + i + RECORD_HEADER_SIZE;
+        i += RECORD_HEADER_SIZE + length;
+        if (i > frame.payloadLength) break;
+        if (receivedPackets.contains(frame.source, id)) {
+            dedup.hits++;
+            continue;
+        }
+        dedup.misses++;
+        bool rejected;
+        int index = allocateReceptionSlot(&rejected);
+        if (rejected) {
+            accepted = false;
+            continue;
+        }
+        if (index >= 0) {
+            Packet &p = receptionPool[index];
+            p.destination = frame.destination;
+            p.source = frame.source;
+            p.packetID = id;
+            p.type = QMAC_DATA_FRAME;
+            p.format = frame.format;
+            p.flags = 0;
+            p.payloadLength = length;
+            memcpy(p.payload, payload, length);
+            receptionQueue.push(index);
+        }
+        receivedPackets.insert(frame.source, id, millis());
+    }
+    return accepted;
+}
+
+int QMACClass::allocateReceptionSlot(bool *rejected) {
+    // Returns -1 if the packet has to be dropped, rejected is set if it must
+    // not be acknowledged
+    *rejected = false;
+    int index = receptionPool.allocate();
+    if (index >= 0) return index;
+    receptionQueueDrops++;
+    if (receptionQueuePolicy == QMAC_DROP_NEWEST) return -1;
+    uint8_t oldest;
+    if (receptionQueuePolicy == QMAC_REJECT || !receptionQueue.pop(&oldest)) {
+        *rejected = true;
+        return -1;
+    }
+    return oldest;
+}
+
+Packet &QMACClass::aggregate(uint8_t index) {
+    // Appends the queued packets for the same destination to the packet in
+    // the given slot while they fit into one frame. Every packet becomes a
+    // record of its ID, payload length and payload. The packets of the frame
+    // are linked through nextInFrame and the frame has the ID of the first
+    // one, which is acknowledged for all of them.
+    Packet &first = sendPool[index];
+    inFlight[index].nextInFrame = NO_SLOT;
+    size_t length = RECORD_HEADER_SIZE + first.payloadLength;
+    // records have no flags, fragments are sent on their own
+    if (!aggregation || first.flags || length > PAYLOAD_SIZE) return first;
+    uint8_t last = index;
+    for (size_t i = 0; i < sendQueue.size();) {
+        uint8_t candidate = sendQueue[i];
+        const Packet &p = sendPool[candidate];
+        if (p.destination != first.destination || p.flags ||
+            length + RECORD_HEADER_SIZE + p.payloadLength > PAYLOAD_SIZE ||
+            (uint16_t)(p.packetID - first.packetID + 128) >= 256) {
+            i++;
+            continue;
+        }
+        length += RECORD_HEADER_SIZE + p.payloadLength;
+        sendQueue.remove(i);
+        inFlight[last].nextInFrame = candidate;
+        inFlight[candidate].nextInFrame = NO_SLOT;
+        last = candidate;
+    }
+    if (last == index) return first;
+
+    aggregateFrame.destination = first.destination;
+    aggregateFrame.source = this->localAddress;
+    aggregateFrame.packetID = first.packetID;
+    aggregateFrame.type = QMAC_DATA_FRAME;
+    aggregateFrame.flags = QMAC_FLAG_AGGREGATED;
+    aggregateFrame.payloadLength = length;
+    byte *record = aggregateFrame.payload;
+    for (uint8_t i = index; i != NO_SLOT; i = inFlight[i].nextInFrame) {
+        const Packet &p = sendPool[i];
+        record[0] = p.packetID & 0xff;
+        record[1] = p.payloadLength;
+        memcpy(record + RECORD_HEADER_SIZE, p.payload, p.payloadLength);
+        record += RECORD_HEADER_SIZE + p.payloadLength;
+    }
+    return aggregateFrame;
+}
+
+int QMACClass::allocateSendSlot(QMACPushResult *result,
+                                QMACPriority priority) {
+    *result = QMAC_QUEUED;
+    if (sendPool.isFull()) {
+        sendQueueDrops++;
+        if (sendQueuePolicy == QMAC_DROP_NEWEST) {
+            *result = QMAC_DROPPED_NEWEST;
+            return -1;
+        }
+        if (sendQueuePolicy == QMAC_REJECT || !dropOldestUnsent(priority)) {
+            *result = QMAC_REJECTED;
+            return -1;
+        }
+        *result = QMAC_DROPPED_OLDEST;
+    }
+    return sendPool.allocate();
+}
+
+void QMACClass::enqueueSendSlot(uint8_t index, byte payloadSize) {
+    Packet &p = sendPool[index];
+    p.source = localAddress;
+    // Skip IDs whose low byte is used by a packet still queued, as it is
+    // all the legacy header carries, ID 0 identifies sync packets there
+    while ((this->msgCount & 0xff) == 0 ||
+           sendSlotOfID[this->msgCount & 0xff]) {
+        this->msgCount++;
+    }
+    p.packetID = this->msgCount++;
+    p.type = QMAC_DATA_FRAME;
+    sendSlotOfID[p.packetID & 0xff] = index + 1;
+    p.flags = 0;
+    p.payloadLength = payloadSize < PAYLOAD_SIZE ? payloadSize : PAYLOAD_SIZE;
+    p.sendRetryCount = 0;
+    inFlight[index].sentTime = 0;
+    inFlight[index].queuedTime = esp_timer_get_time() / 1000;
+    queueInOrder(index);
+}
+
+bool QMACClass::moreUrgent(uint8_t a, uint8_t b) {
+    const InFlight &x = inFlight[a];
+    const InFlight &y = inFlight[b];
+    if (x.priority != y.priority) return x.priority < y.priority;
+    if (x.deadline != y.deadline) return x.deadline < y.deadline;
+    return x.queuedTime < y.queuedTime;
+}
+
+void QMACClass::queueInOrder(uint8_t index) {
+    // behind all packets which are at least as urgent
+    size_t i = sendQueue.size();
+    while (i > 0 && moreUrgent(index, sendQueue[i - 1])) i--;
+    sendQueue.insert(i, index);
+}
+
+bool QMACClass::dropIfExpired(uint8_t index, int64_t now) {
+    // the rest of a failed message is dropped as well
+    bool abandoned = inFlight[index].fragment && outgoing.failed;
+    if (inFlight[index].deadline > now && !abandoned) return false;
+    LOG("Dropping expired packet with ID " + String(sendPool[index].packetID));
+    if (!abandoned) classes[inFlight[index].priority].expired++;
+    stopWaitingForAck(index);
+    releaseSendSlot(index);
+    return true;
+}
+
+void QMACClass::dropExpired() {
+    int64_t now = esp_timer_get_time() / 1000;
+    for (size_t i = 0; i < sendQueue.size();) {
+        if (dropIfExpired(sendQueue[i], now)) {
+            sendQueue.remove(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+bool QMACClass::dropOldestUnsent(QMACPriority priority) {
+    // The oldest packet of the lowest priority class, which may be waiting
+    // for an ACK. Packets waiting for an ACK were queued before the ones in
+    // the send queue of the same class, unless they are retried.
+    int oldest = -1;
+    int position = -1;  // in the send queue
+    uint8_t index;
+    if (resendQueue.peek(&index)) oldest = index;
+    for (size_t i = 0; i < sendQueue.size(); i++) {
+        uint8_t candidate = sendQueue[i];
+        if (oldest < 0 ||
+            inFlight[candidate].priority > inFlight[oldest].priority ||
+            (inFlight[candidate].priority == inFlight[oldest].priority &&
+             inFlight[candidate].queuedTime < inFlight[oldest].queuedTime)) {
+            oldest = candidate;
+            position = i;
+        }
+    }
+    if (oldest < 0 || inFlight[oldest].priority < priority) return false;
+    LOG("Send queue full, dropping packet with ID " +
+        String(sendPool[oldest].packetID));
+    if (position >= 0) {
+        sendQueue.remove(position);
+    } else {
+        resendQueue.remove(oldest);
+    }
+    stopWaitingForAck(oldest);
+    releaseSendSlot(oldest);
+    return true;
+}
+
+void QMACClass::releaseSendSlot(uint8_t index, bool delivered) {
+    sendSlotOfID[sendPool[index].packetID & 0xff] = 0;
+    sendPool.release(index);
+    if (!inFlight[index].fragment) return;
+    // The outgoing message fails with the first fragment which is dropped,
+    // it is finished once none of its fragments are queued anymore
+    inFlight[index].fragment = false;
+    OutgoingMessage &m = outgoing;
+    m.queued--;
+    if (delivered) {
+        m.delivered++;
+    } else {
+        m.failed = true;
+    }
+    if (m.queued || (!m.failed && m.next < m.count)) return;
+    if (m.failed) {
+        LOG("Sending message " + String(m.messageID) + " failed");
+        messages.failed++;
+        outgoingState = QMAC_MESSAGE_FAILED;
+    } else {
+        messages.sent++;
+        outgoingState = QMAC_MESSAGE_SENT;
+    }
+    m.data = nullptr;
+}
+
+void QMACClass::queueFragments() {
+    // Queues the next fragments of the outgoing message while there is room,
+    // without dropping other packets
+    OutgoingMessage &m = outgoing;
+    while (outgoingState == QMAC_MESSAGE_SENDING && !m.failed &&
+           m.next < m.count && m.queued < QMAC_FRAGMENT_WINDOW &&
+           !sendPool.isFull()) {
+        int index = sendPool.allocate();
+        Packet &p = sendPool[index];
+        size_t offset = (size_t)m.next * FRAGMENT_DATA_SIZE;
+        size_t length = m.length - offset < FRAGMENT_DATA_SIZE
+                            ? m.length - offset
+                            : FRAGMENT_DATA_SIZE;
+        p.destination = m.destination;
+        p.payload[0] = m.messageID;
+        p.payload[1] = m.next;
+        p.payload[2] = m.count;
+        memcpy(p.payload + FRAGMENT_HEADER_SIZE, m.data + offset, length);
+        inFlight[index].priority = m.priority;
+        inFlight[index].deadline = m.deadline;
+        enqueueSendSlot(index, FRAGMENT_HEADER_SIZE + length);
+        p.flags = QMAC_FLAG_FRAGMENT;
+        inFlight[index].fragment = true;
+        m.next++;
+        m.queued++;
+    }
+}
+
+bool QMACClass::reassemble(const Packet &p) {
+    // Returns false if there is no room for the message, so the fragment is
+    // not acknowledged and the sender retries
+    if (receivedPackets.contains(p.source, p.packetID)) {
+        dedup.hits++;
+        return true;
+    }
+    if (p.payloadLength < FRAGMENT_HEADER_SIZE) return true;
+    byte messageID = p.payload[0];
+    uint8_t index = p.payload[1];
+    uint8_t count = p.payload[2];
+    if (index >= count) return true;
+    size_t offset = (size_t)index * FRAGMENT_DATA_SIZE;
+    size_t length = p.payloadLength - FRAGMENT_HEADER_SIZE;
+    const byte *data = p.payload + FRAGMENT_HEADER_SIZE;
+    if (!fragmentCallback &&
+        ((size_t)(count - 1) * FRAGMENT_DATA_SIZE >= QMAC_REASSEMBLY_SIZE ||
+         offset + length > QMAC_REASSEMBLY_SIZE)) {
+        LOG("Message " + String(messageID) + " is too large to reassemble");
+        return false;
+    }
+    Reassembly *r = findReassembly(p.source, messageID, count);
+    if (!r) return false;
+    dedup.misses++;
+    receivedPackets.insert(p.source, p.packetID, millis());
+    uint32_t bit = (uint32_t)1 << (index % 32);
+    if (r->receivedFragments[index / 32] & bit) return true;
+    r->receivedFragments[index / 32] |= bit;
+    r->received++;
+    r->updated = esp_timer_get_time() / 1000;
+    if (index == count - 1) r->length = offset + length;
+    bool complete = r->received == r->count;
+    if (complete) messages.received++;
+    if (fragmentCallback) {
+        fragmentCallback(p.source, messageID, offset, data, length, complete);
+        if (complete) r->used = false;
+    } else {
+        memcpy(r->data + offset, data, length);
+        r->complete = complete;
+    }
+    return true;
+}
+
+QMACClass::Reassembly *QMACClass::findReassembly(byte source, byte messageID,
+                                                 uint8_t count) {
+    Reassembly *unused = nullptr;
+    for (Reassembly &r : reassemblies) {
+        if (r.used && r.source == source && r.messageID == messageID) {
+            return &r;
+        }
+        if (!r.used && !unused) unused = &r;
+    }
+    if (!unused) return nullptr;
+    unused->used = true;
+    unused->complete = false;
+    unused->source = source;
+    unused->messageID = messageID;
+    unused->count = count;
+    unused->received = 0;
+    memset(unused->receivedFragments, 0, sizeof(unused->receivedFragments));
+    unused->length = 0;
+    return unused;
+}
+
+void QMACClass::expireReassemblies() {
+    int64_t now = esp_timer_get_time() / 1000;
+    for (Reassembly &r : reassemblies) {
+        if (r.used && !r.complete && now - r.updated >= reassemblyTimeout) {
+            LOG("Discarding incomplete message " + String(r.messageID) +
+                " from " + String(r.source));
+            r.used = false;
+            messages.timedOut++;
+        }
+    }
+}
+
+bool QMACClass::forward(const Packet &p) {
+    // Queues a copy of a packet for another node, returns false if it cannot,
+    // so the frame is not acknowledged and the previous hop retries or gives
+    // up instead of taking it for delivered
+    // the legacy header only carries the low byte of the origin ID
+    forwardedPackets.expire(p.origin, millis(), maxSilence());
+    uint16_t originID =
+        p.format == QMAC_HEADER_LEGACY
+            ? forwardedPackets.extend(p.origin, p.originID)
+            : p.originID;
+    if (forwardedPackets.contains(p.origin, originID)) {
+        routing.duplicates++;
+        return true;
+    }
+    if (!forwarding) {
+        routing.disabled++;
+        return false;
+    }
+    if (!findRoute(p.finalDestination)) {
+        LOG("No route to " + String(p.finalDestination));
+        routing.noRoute++;
+        return false;
+    }
+    // hops counts the hops before the one to this node
+    if (p.hops + 2 > maxHops) {
+        LOG("Hop limit reached for packet from " + String(p.origin));
+        routing.hopLimit++;
+        return true;
+    }
+    // forwarding never evicts other packets
+    if (sendPool.isFull()) {
+        routing.rejected++;
+        return false;
+    }
+    int index = sendPool.allocate();
+    Packet &q = sendPool[index];
+    q.destination = p.finalDestination;
+    memcpy(q.payload, p.payload, p.payloadLength);
+    inFlight[index].priority = QMAC_PRIORITY_NORMAL;
+    inFlight[index].deadline = INT64_MAX;
+    inFlight[index].fragment = false;
+    enqueueSendSlot(index, p.payloadLength);
+    q.flags = QMAC_FLAG_ROUTED | (p.flags & QMAC_FLAG_FRAGMENT);
+    q.finalDestination = p.finalDestination;
+    q.origin = p.origin;
+    q.originID = originID;
+    q.hops = p.hops + 1;
+    forwardedPackets.insert(p.origin, originID, millis());
+    routing.forwarded++;
+    return true;
+}
+
+void QMACClass::route(Packet &p) {
+    // Addresses a packet to the next hop towards its destination. A packet
+    // of this node gets a route field once it has to take more than one hop,
+    // and keeps it for its retries.
+    if (!forwarding || p.destination == BCADDR) return;
+    if (!(p.flags & QMAC_FLAG_ROUTED)) {
+        const Route *r = findRoute(p.destination);
+        if (!r || r->nextHop == p.destination) return;
+        p.flags |= QMAC_FLAG_ROUTED;
+        p.finalDestination = p.destination;
+        p.origin = this->localAddress;
+        p.originID = p.packetID;
+        p.hops = 0;
+    }
+    p.destination = nextHop(p.finalDestination);
+}
+
+const QMACClass::Route *QMACClass::findRoute(byte destination) {
+    return routes.find(destination);
+}
+
+void QMACClass::learnRoute(byte destination, byte via, uint8_t hops) {
+    // Keeps the route with the fewest hops. The next hop may change the hops
+    // of its route, and a route which was not confirmed for
+    // QMAC_ROUTE_TIMEOUT gives way to any other.
+    if (destination == this->localAddress || destination == BCADDR ||
+        hops > maxHops)
+        return;
+    int64_t now = esp_timer_get_time() / 1000;
+    Route *r = routes.find(destination);
+    if (!r) {
+        r = &routes.get(destination);
+        r->hops = NO_ROUTE;
+    }
+    if (via == r->nextHop || hops < r->hops ||
+        now - r->updated >= QMAC_ROUTE_TIMEOUT) {
+        r->nextHop = via;
+        r->hops = hops;
+        r->updated = now;
+    }
+}
+
+void QMACClass::learnRoutes(const Packet &p) {
+    // The sender is a neighbor, and the next hop towards the origin of a
+    // forwarded frame or towards the sink it advertises
+    if (!forwarding) return;
+    Neighbor *n = neighbors.find(p.source);
+    if (!n || n->snr < REQUIRED_SNR[baseRate.spreadingFactor - 6] +
+                           ROUTE_LINK_MARGIN)
+        return;
+    learnRoute(p.source, p.source, 1);
+    if (p.isSyncPacket()) {
+        if (p.sinkHops != NO_ROUTE) learnRoute(sink, p.source, p.sinkHops + 1);
+    } else if (p.flags & QMAC_FLAG_ROUTED) {
+        learnRoute(p.origin, p.source, p.hops + 1);
+    }
+}
+
+uint8_t QMACClass::sinkHops() {
+    if (sink == this->localAddress) return 0;
+    const Route *r = findRoute(sink);
+    return r ? r->hops : NO_ROUTE;
+}
+
+void QMACClass::sampleOffset(byte source, uint32_t nextActiveTime,
+                             int64_t sent) {
+    // Offsets of one active period are merged, so the line is fitted to
+    // offsets which are spread over time. An offset far off the line means
+    // that the neighbor synchronized, the estimate starts over then.
+    if (!driftCorrection) return;
+    Neighbor &n = neighbors.get(source);
+    int64_t now = millis();
+    float cycle = activeDuration + sleepDuration;
+    float offset =
+        wrapOffset((nextActiveTime - nextActiveMicros(sent)) / 1000.0f,
+                   cycle) +
+        scheduleShift;
+    if (n.offsets) {
+        uint8_t last = (n.nextOffset + QMAC_DRIFT_SAMPLES - 1) %
+                       QMAC_DRIFT_SAMPLES;
+        // continuous with the previous offset
+        offset = n.offset[last] + wrapOffset(offset - n.offset[last], cycle);
+        float predicted =
+            n.driftOffset + n.driftRate * (now - n.offsetTime[last]);
+        if (fabsf(offset - predicted) > guardTime) {
+            n.offsets = 0;
+            n.nextOffset = 0;
+        } else if (now - n.offsetTime[last] < (int64_t)activeDuration) {
+            n.offset[last] = (n.offset[last] + offset) / 2;
+            n.offsetTime[last] = now;
+            fitDrift(n);
+            return;
+        }
+    }
+    n.offset[n.nextOffset] = offset;
+    n.offsetTime[n.nextOffset] = now;
+    n.nextOffset = (n.nextOffset + 1) % QMAC_DRIFT_SAMPLES;
+    if (n.offsets < QMAC_DRIFT_SAMPLES) n.offsets++;
+    fitDrift(n);
+}
+
+void QMACClass::fitDrift(Neighbor &n) {
+    // Least squares line through the offsets, with the time relative to the
+    // newest one to keep the precision of floats
+    uint8_t newest =
+        (n.nextOffset + QMAC_DRIFT_SAMPLES - 1) % QMAC_DRIFT_SAMPLES;
+    int64_t origin = n.offsetTime[newest];
+    n.driftOffset = n.offset[newest];
+    n.driftRate = 0;
+    n.driftResidual = 0;
+    if (n.offsets < DRIFT_MIN_SAMPLES) return;
+    float meanT = 0, meanO = 0;
+    for (uint8_t i = 0; i < n.offsets; i++) {
+        meanT += n.offsetTime[i] - origin;
+        meanO += n.offset[i];
+    }
+    meanT /= n.offsets;
+    meanO /= n.offsets;
+    float varT = 0, cov = 0;
+    for (uint8_t i = 0; i < n.offsets; i++) {
+        float t = n.offsetTime[i] - origin - meanT;
+        varT += t * t;
+        cov += t * (n.offset[i] - meanO);
+    }
+    if (varT <= 0) return;
+    n.driftRate = cov / varT;
+    n.driftOffset = meanO - n.driftRate * meanT;
+    float squares = 0;
+    for (uint8_t i = 0; i < n.offsets; i++) {
+        float t = n.offsetTime[i] - origin;
+        float error = n.offset[i] - (n.driftOffset + n.driftRate * t);
+        squares += error * error;
+    }
+    n.driftResidual = sqrtf(squares / n.offsets);
+}
+
+bool QMACClass::driftPredicted() {
+    // Whether the offsets of all neighbors with a recent estimate are known
+    // within the guard time. The error grows with the drift since the newest
+    // offset, in case the drift changed.
+    if (!driftCorrection) return false;
+    int64_t now = millis();
+    bool predicted = false;
+    for (size_t i = 0; i < neighbors.size(); i++) {
+        const Neighbor &n = neighbors[i];
+        if (n.offsets < DRIFT_MIN_SAMPLES) continue;
+        uint8_t newest =
+            (n.nextOffset + QMAC_DRIFT_SAMPLES - 1) % QMAC_DRIFT_SAMPLES;
+        int64_t age = now - n.offsetTime[newest];
+        if (age >= DRIFT_MAX_AGE) continue;
+        if (n.driftResidual + fabsf(n.driftRate) * age >= guardTime) {
+            return false;
+        }
+        predicted = true;
+    }
+    return predicted;
+}
+
+void QMACClass::correctDrift() {
+    // Moves the schedule halfway towards the mean offset the neighbors are
+    // predicted to have now. Called when the active period is over. Only
+    // neighbors heard since the schedule moved count, they may have moved
+    // towards this node as well.
+    if (!driftCorrection) return;
+    int64_t now = millis();
+    float sum = 0;
+    int count = 0;
+    for (size_t i = 0; i < neighbors.size(); i++) {
+        const Neighbor &n = neighbors[i];
+        if (!n.offsets) continue;
+        uint8_t newest =
+            (n.nextOffset + QMAC_DRIFT_SAMPLES - 1) % QMAC_DRIFT_SAMPLES;
+        int64_t age = now - n.offsetTime[newest];
+        if (age >= DRIFT_MAX_AGE || n.offsetTime[newest] <= scheduleMoved) {
+            continue;
+        }
+        sum += n.driftOffset + n.driftRate * age - scheduleShift;
+        count++;
+    }
+    if (!count) return;
+    // in us
+    int32_t shift = lroundf(sum / count * 500);
+    int64_t timeUntilActive = nextActiveMicros(esp_timer_get_time()) + shift;
+    if (!shift || timeUntilActive <= 0) return;
+    LOG("Moving the schedule by " + String(shift) + " us");
+    updateTimer(timeUntilActive);
+    syncs.corrections++;
+}
+
+void QMACClass::acknowledge(byte source, uint16_t id,
+                            QMACHeaderFormat format) {
+    // The ACK has to come from the destination of the packet. An ACK in the
+    // legacy header only has the low byte of the ID, which is unique among
+    // the queued packets.
+    uint16_t mask = format == QMAC_HEADER_LEGACY ? 0xff : 0xffff;
+    int index = sendSlotOfID[id & 0xff] - 1;
+    if (index < 0 || !inFlight[index].awaitingAck ||
+        ((inFlight[index].frameID ^ id) & mask) ||
+        sendPool[index].destination != source)
+        return;
+    id = inFlight[index].frameID;
+    Neighbor &n = neighbors.get(source);
+    int64_t now = esp_timer_get_time();
+    uint32_t rtt = now - inFlight[index].sentTime;
+    n.roundTripTime = n.roundTripTime ? (7 * n.roundTripTime + rtt) / 8 : rtt;
+    countIn(counters.ackRtt, rtt / 1000);
+    if (compression && inFlight[index].nextInFrame == NO_SLOT) {
+        // the next payload for the node may refer to this one
+        const Packet &p = sendPool[index];
+        CodecReference &r = codecReferences.get(source);
+        r.sentID = id & 0xff;
+        r.sentLength = p.payloadLength;
+        memcpy(r.sent, p.payload, p.payloadLength);
+    }
+    // the ACK is for all packets sent in the same frame
+    for (uint8_t i = index, next; i != NO_SLOT; i = next) {
+        next = inFlight[i].nextInFrame;
+        if (!inFlight[i].awaitingAck || inFlight[i].frameID != id) break;
+        n.periodAcked++;
+        countIn(counters.latency, now / 1000 - inFlight[i].queuedTime);
+        stopWaitingForAck(i);
+        resendQueue.remove(i);
+        releaseSendSlot(i, true);
+    }
+}
+
+void QMACClass::queueAck(byte source, uint16_t id) {
+    // Adds the frame to the selective ACK for its source. An ID which does not
+    // fit into the bitmap starts a new one after sending the pending ACKs.
+    Neighbor &n = neighbors.get(source);
+    if (n.ackBitmap) {
+        uint16_t offset = id - n.ackBase;
+        if (offset < ACK_FIELD_IDS) {
+            n.ackBitmap |= (uint32_t)1 << offset;
+            return;
+        }
+        sendSelectiveAck(source, n);
+    }
+    n.ackBase = id;
+    n.ackBitmap = 1;
+    // Delayed by whole slots, so the ACK is sent where ACKs are sent in
+    // another slot instead of colliding with the packets starting it. The
+    // sender only waits for ACKs until the end of the active period.
+    int64_t now = millis();
+    int64_t slotsLeft = (esp_timer_get_next_alarm() / 1000 - now) / SLOT_TIME;
+    int64_t slots = ackDelay / SLOT_TIME;
+    if (slots > slotsLeft - 1) slots = slotsLeft - 1;
+    n.ackDue = now + (slots > 0 ? slots * SLOT_TIME : 0);
+    if (n.ackDue < nextAckDue) nextAckDue = n.ackDue;
+}
+
+bool QMACClass::attachAcks(Packet &frame) {
+    // Piggybacks the selective ACK for the destination on a data frame
+    if (frame.destination == BCADDR) return false;
+    Neighbor *n = neighbors.find(frame.destination);
+    if (!n || !n->ackBitmap) return false;
+    frame.flags |= QMAC_FLAG_ACKS;
+    frame.ackBase = n->ackBase;
+    frame.ackBitmap = n->ackBitmap;
+    return true;
+}
+
+void QMACClass::sendDueAcks() {
+    int64_t now = millis();
+    nextAckDue = INT64_MAX;
+    for (size_t i = 0; i < neighbors.size(); i++) {
+        Neighbor &n = neighbors[i];
+        if (!n.ackBitmap) continue;
+        if (n.ackDue <= now) {
+            sendSelectiveAck(neighbors.address(i), n);
+        } else if (n.ackDue < nextAckDue) {
+            nextAckDue = n.ackDue;
+        }
+    }
+}
+
+bool QMACClass::sendSelectiveAck(byte destination, Neighbor &n) {
+    // An ACK frame with an ACK field, or a plain ACK if there is only one ID.
+    // Its ID is the base of the field, which is never 0, so it is not taken
+    // for a sync packet
+    Packet ackPacket = {
+        .destination = destination,
+        .source = this->localAddress,
+        .packetID = n.ackBase,
+        .type = QMAC_ACK_FRAME,
+        .flags = n.ackBitmap == 1 ? (uint16_t)0 : (uint16_t)QMAC_FLAG_ACKS,
+        .ackBase = n.ackBase,
+        .ackBitmap = n.ackBitmap,
+        .payloadLength = 0,
+    };
+    // not kept if sending fails, the sender retries the packets instead
+    n.ackBitmap = 0;
+    LOG("Sending ACKs from ID " + String(ackPacket.ackBase));
+    if (!send(ackPacket)) return false;
+    acks.frames++;
+    acks.airtime += getAirTime(ackPacket);
+    return true;
+}
+
+QMACDataRate QMACClass::selectDataRate(byte destination, size_t length) {
+    // Picks the data rate with the least airtime for the frame and the follow
+    // frame among the ones the SNR of the link allows
+    QMACDataRate best = baseRate;
+    if (!adaptiveDataRate || destination == BCADDR) return best;
+    Neighbor *n = neighbors.find(destination);
+    if (!n || !n->linkSamples) return best;
+    long maxBandwidth = adrMaxBandwidth > baseRate.bandwidth
+                            ? adrMaxBandwidth
+                            : baseRate.bandwidth;
+    float snr = n->snr - n->adrPenalty - adrMargin;
+    float bestAirtime = frameAirtime(length, baseRate);
+    // follow frames have a flag, so they are sent in the compact header
+    float followAirtime = frameAirtime(COMPACT_HEADER_SIZE + 1, baseRate);
+    for (uint8_t sf = 7; sf <= baseRate.spreadingFactor; sf++) {
+        for (int i = 0; i < NUM_BANDWIDTHS; i++) {
+            long bw = BANDWIDTHS[i];
+            if (bw < baseRate.bandwidth || bw > maxBandwidth) continue;
+            // the noise floor rises with the bandwidth
+            float required = REQUIRED_SNR[sf - 6] +
+                             10 * log10((float)bw / baseRate.bandwidth);
+            if (snr < required) continue;
+            QMACDataRate rate = {sf, bw};
+            float airtime = followAirtime + frameAirtime(length, rate);
+            if (airtime < bestAirtime) {
+                best = rate;
+                bestAirtime = airtime;
+            }
+        }
+    }
+    return best;
+}
+
+bool QMACClass::sendAtDataRate(const Packet &frame, QMACDataRate rate) {
+    // Tells the destination to switch with a follow frame at the base data
+    // rate, then sends the frame and waits for the ACK at the new data rate
+    Packet followFrame = {
+        .destination = frame.destination,
+        .source = this->localAddress,
+        .packetID = frame.packetID,
+        .type = QMAC_DATA_FRAME,
+        .flags = QMAC_FLAG_FOLLOW,
+        .payloadLength = 1,
+    };
+    followFrame.payload[0] =
+        rate.spreadingFactor << 4 | bandwidthIndex(rate.bandwidth);
+    LOG("Sending follow frame for SF" + String(rate.spreadingFactor));
+    if (!send(followFrame)) return false;
+    setRadioDataRate(rate);
+    delay(FOLLOW_GAP);
+    if (!send(frame)) {
+        setRadioDataRate(baseRate);
+        return false;
+    }
+    Packet ack = {.packetID = frame.packetID, .type = QMAC_ACK_FRAME};
+    rateUntil = millis() + FOLLOW_GAP + (int64_t)ceil(2 * getAirTime(ack));
+    return true;
+}
+
+void QMACClass::follow(const Packet &p) {
+    // Switches to the data rate of the next frame of the sender, until it
+    // arrives or could have been received completely
+    if (p.payloadLength < 1) return;
+    uint8_t sf = p.payload[0] >> 4;
+    int bwIndex = p.payload[0] & 0x0F;
+    if (sf < 7 || sf > 12 || bwIndex >= NUM_BANDWIDTHS) return;
+    QMACDataRate rate = {sf, BANDWIDTHS[bwIndex]};
+    LOG("Following with SF" + String(sf));
+    setRadioDataRate(rate);
+    rateUntil = millis() + 2 * FOLLOW_GAP +
+                (int64_t)ceil(frameAirtime(MAX_FRAME_SIZE, rate));
+}
+
+void QMACClass::setRadioDataRate(QMACDataRate rate) {
+    LoRa.idle();
+    LoRa.setSpreadingFactor(rate.spreadingFactor);
+    LoRa.setSignalBandwidth(rate.bandwidth);
+    radioRate = rate;
+    rateUntil = 0;
+    if (interruptReceive) LoRa.receive();
+}
+
+void QMACClass::trackLink(byte source, int rssi, float snr) {
+    Neighbor &n = neighbors.get(source);
+    // the noise floor rises with the bandwidth
+    snr += 10 * log10((float)radioRate.bandwidth / baseRate.bandwidth);
+    if (n.linkSamples == 0) {
+        n.snr = snr;
+        n.rssi = rssi;
+    } else {
+        n.snr += (snr - n.snr) / 4;
+        n.rssi += (rssi - n.rssi) / 4;
+    }
+    if (n.linkSamples < UINT8_MAX) n.linkSamples++;
+}
+
+const Packet &QMACClass::compress(const Packet &frame) {
+    // Returns a copy of the frame with the payload compressed, or the frame
+    // itself if that does not make it shorter. The destination may have
+    // replaced the payload acknowledged last by the time a packet is
+    // retransmitted, or a following one is sent, so those refer to none.
+    if (!compression || frame.isAck()) return frame;
+    byte stages = CODEC_VARINT | CODEC_LZ;
+    const CodecReference *r = codecReferences.find(frame.destination);
+    const Neighbor *n = neighbors.find(frame.destination);
+    if (r && r->sentLength && frame.sendRetryCount == 0 &&
+        !(frame.flags & QMAC_FLAG_AGGREGATED) && n && !n->outstanding) {
+        stages |= CODEC_DELTA;
+    }
+    size_t length = codec.encode(frame.payload, frame.payloadLength, stages,
+                                 r ? r->sent : nullptr, r ? r->sentLength : 0,
+                                 r ? r->sentID : 0, codedFrame.payload);
+    if (!length) return frame;
+    memcpy(&codedFrame, &frame, offsetof(Packet, payload));
+    codedFrame.flags |= QMAC_FLAG_CODED;
+    codedFrame.payloadLength = length;
+    codedFrame.sendRetryCount = frame.sendRetryCount;
+    return codedFrame;
+}
+
+bool QMACClass::decompress(Packet &p) {
+    // Restores the payload of a compressed frame, returns false if it is
+    // invalid or refers to a payload which is not kept
+    const byte *reference = nullptr;
+    size_t referenceLength = 0;
+    byte id;
+    if (PayloadCodec<PAYLOAD_SIZE>::referenceTag(p.payload, p.payloadLength,
+                                                 &id)) {
+        const CodecReference *r = codecReferences.find(p.source);
+        for (int i = 0; r && i < CODEC_RECEIVED_PAYLOADS; i++) {
+            if (r->receivedLength[i] && r->receivedID[i] == id) {
+                reference = r->received[i];
+                referenceLength = r->receivedLength[i];
             }
         }
+        if (!reference) return false;
+    }
+    byte payload[PAYLOAD_SIZE];
+    size_t length = codec.decode(p.payload, p.payloadLength, reference,
+                                 referenceLength, payload);
+    if (!length) return false;
+    memcpy(p.payload, payload, length);
+    p.payloadLength = length;
+    p.flags &= ~QMAC_FLAG_CODED;
+    return true;
+}
+
+void QMACClass::keepReceivedPayload(const Packet &p) {
+    // Keeps the payload of a frame of one packet for this node, the sender
+    // refers to it once it was acknowledged
+    if (p.isAck() || p.destination != this->localAddress ||
+        (p.flags & (QMAC_FLAG_AGGREGATED | QMAC_FLAG_FOLLOW)))
+        return;
+    CodecReference &r = codecReferences.get(p.source);
+    // a retransmission replaces the payload it was received with before
+    int i = 0;
+    while (i < CODEC_RECEIVED_PAYLOADS &&
+           !(r.receivedLength[i] && r.receivedID[i] == (p.packetID & 0xff)))
+        i++;
+    if (i == CODEC_RECEIVED_PAYLOADS) {
+        i = (r.newest + 1) % CODEC_RECEIVED_PAYLOADS;
+        r.newest = i;
+    }
+    r.receivedID[i] = p.packetID & 0xff;
+    r.receivedLength[i] = p.payloadLength;
+    memcpy(r.received[i], p.payload, p.payloadLength);
+}
+
+void QMACClass::stopWaitingForAck(uint8_t index) {
+    if (!inFlight[index].awaitingAck) return;
+    inFlight[index].awaitingAck = false;
+    Neighbor *n = neighbors.find(sendPool[index].destination);
+    if (n && n->outstanding) n->outstanding--;
+}
+
+void QMACClass::powerDown() {
+    // The SoC sleeps until the wake margin before the next active period,
+    // after a deep sleep begin() continues from the retained state
+    if (sleepMode == QMAC_STAY_AWAKE || state != QMAC_SLEEP) return;
+    int64_t now = esp_timer_get_time();
+    int64_t duration = nextActiveMicros(now) - (int64_t)wakeMargin * 1000;
+    if (duration < MIN_POWER_DOWN * 1000) return;
+    accountTime(now);
+    if (sleepMode == QMAC_DEEP_SLEEP && retainState(now)) {
+        LOG("Deep sleep for " + String((uint32_t)(duration / 1000)) + " ms");
+        QMACPlatform::deepSleep(duration);
+    }
+    QMACPlatform::lightSleep(duration);
+}
+
+bool QMACClass::retainState(int64_t now) {
+    // the message and the received packets only live in RAM
+    if (outgoingState == QMAC_MESSAGE_SENDING || !receptionQueue.isEmpty() ||
+        reservedSlot >= 0) {
+        return false;
+    }
+    byte *memory = (byte *)QMACPlatform::retainedMemory();
+    Retained &r = *(Retained *)memory;
+    r.magic = 0;
+    r.savedAt = now;
+    r.savedClock = QMACPlatform::retainedTime();
+    r.nextActive = nextActiveMicros(now);
+    r.localAddress = localAddress;
+    r.msgCount = msgCount;
+    r.messageCount = messageCount;
+    r.periodsSinceSync = periodsSinceSync;
+    r.dutyCycle = dutyCycle;
+    r.receivedPackets = receivedPackets;
+    r.numPackets = 0;
+    // the most urgent packets first, records are kept 8 byte aligned
+    size_t used = (sizeof(Retained) + 7) & ~7;
+    for (size_t i = 0; i < sendQueue.size(); i++) {
+        uint8_t index = sendQueue[i];
+        const Packet &p = sendPool[index];
+        size_t length = offsetof(Packet, payload) + p.payloadLength;
+        size_t size = (sizeof(RetainedPacket) + length + 7) & ~7;
+        if (used + size > QMAC_RETAINED_MEMORY) {
+            LOG("Not retaining " + String(sendQueue.size() - i) + " packets");
+            break;
+        }
+        RetainedPacket &rp = *(RetainedPacket *)(memory + used);
+        rp.priority = inFlight[index].priority;
+        rp.sent = inFlight[index].sentTime != 0;
+        rp.sendRetryCount = p.sendRetryCount;
+        rp.queuedTime = inFlight[index].queuedTime;
+        rp.deadline = inFlight[index].deadline;
+        memcpy(&rp + 1, &p, length);
+        used += size;
+        r.numPackets++;
     }
+    r.magic = RETAINED_MAGIC;
+    return true;
+}
 
+bool QMACClass::restoreState() {
+    byte *memory = (byte *)QMACPlatform::retainedMemory();
+    Retained &r = *(Retained *)memory;
+    if (r.magic != RETAINED_MAGIC) return false;
+    // a state is only restored once, a reset starts over
+    r.magic = 0;
+    int64_t now = esp_timer_get_time();
+    int64_t slept = QMACPlatform::retainedTime() - r.savedClock;
+    if (slept < 0) return false;
+    // the schedule continues, periods which were overslept count as periods
+    // without synchronization
+    int64_t cycle = (activeDuration + sleepDuration) * 1000;
+    int64_t timeUntilActive = r.nextActive - slept;
+    int64_t missed = 0;
+    if (timeUntilActive <= 0) {
+        missed = -timeUntilActive / cycle + 1;
+        timeUntilActive += missed * cycle;
+    }
+    localAddress = r.localAddress;
+    msgCount = r.msgCount;
+    messageCount = r.messageCount;
+    int64_t periods = r.periodsSinceSync + missed;
+    periodsSinceSync = periods < UINT8_MAX ? periods : UINT8_MAX;
+    // ms to add to the time stamps taken before the sleep
+    int64_t offset = (now - slept - r.savedAt) / 1000;
+    dutyCycle = r.dutyCycle;
+    dutyCycle.shift(offset);
+    receivedPackets = r.receivedPackets;
+    receivedPackets.shift(offset);
+    size_t used = (sizeof(Retained) + 7) & ~7;
+    for (uint8_t i = 0; i < r.numPackets; i++) {
+        const RetainedPacket &rp = *(RetainedPacket *)(memory + used);
+        const byte *data = (const byte *)(&rp + 1);
+        int index = sendPool.allocate();
+        if (index < 0) break;
+        Packet &p = sendPool[index];
+        memcpy(&p, data, offsetof(Packet, payload));
+        memcpy(p.payload, data + offsetof(Packet, payload), p.payloadLength);
+        p.sendRetryCount = rp.sendRetryCount;
+        InFlight &f = inFlight[index];
+        f = InFlight();
+        // the time of the first transmission only matters for the queueing
+        // latency, which was counted already
+        f.sentTime = rp.sent;
+        f.nextInFrame = NO_SLOT;
+        f.priority = rp.priority;
+        f.queuedTime = rp.queuedTime + offset;
+        f.deadline = rp.deadline;
+        if (f.deadline != INT64_MAX) f.deadline += offset;
+        sendSlotOfID[p.packetID & 0xff] = index + 1;
+        queueInOrder(index);
+        used += (sizeof(RetainedPacket) + offsetof(Packet, payload) +
+                 p.payloadLength + 7) & ~7;
+    }
+    LOG("Restored the state with " + String(sendQueue.size()) +
+        " packets after " + String((uint32_t)(slept / 1000)) + " ms");
+    esp_timer_stop(timer_handle);
+    active = false;
+    state = QMAC_SLEEP;
+    esp_timer_start_once(timer_handle, timeUntilActive);
+    return true;
+}
+
+void QMACClass::finishActivePeriod() {
+    if (rateUntil) setRadioDataRate(baseRate);
     // Go to sleep when active time is over
     LoRa.sleep();
-    // synchronize if a percentage of packets didn't arrive
-    double unackedRatio = numPacketsReady > 0
-                              ? (double)resendQueue.getSize() / numPacketsReady
-                              : 0;
+    uint32_t radioOn = millis() - activeStartTime;
+    activity.periods++;
+    activity.radioOnTime += radioOn;
+    activity.lastRadioOnTime = radioOn;
+    // synchronize if a percentage of the packets sent to a neighbor didn't
+    // arrive
+    double unackedRatio = 0;
+    for (size_t i = 0; i < neighbors.size(); i++) {
+        Neighbor &n = neighbors[i];
+        if (n.periodSent > 0) {
+            double ratio =
+                (double)(n.periodSent - n.periodAcked) / n.periodSent;
+            if (ratio > unackedRatio) unackedRatio = ratio;
+        }
+        // be more careful with faster data rates for the node if they failed
+        if (n.adaptiveSent) {
+            if (n.periodAcked < n.periodSent) {
+                n.adrPenalty += ADR_PENALTY_STEP;
+            } else {
+                n.adrPenalty = n.adrPenalty > ADR_PENALTY_DECAY
+                                   ? n.adrPenalty - ADR_PENALTY_DECAY
+                                   : 0;
+            }
+            n.adaptiveSent = false;
+        }
+        n.periodSent = 0;
+        n.periodAcked = 0;
+        // too late for ACKs, the senders retry in the next active period
+        n.ackBitmap = 0;
+    }
+    nextAckDue = INT64_MAX;
+    expireReassemblies();
+    // Putting all unacked packets to the send packets queue, so they will be
+    // sent during the next active period:
+    uint8_t index;
+    while (resendQueue.pop(&index)) {
+        stopWaitingForAck(index);
+        Packet &packet = sendPool[index];
+        if (packet.sendRetryCount > maxPacketResendTries) {
+            LOG("Dropping packet with ID " + String(packet.packetID) +
+                " after " + String(packet.sendRetryCount) + " retries");
+            counters.retryDrops++;
+            releaseSendSlot(index);
+        } else if (!dropIfExpired(index, esp_timer_get_time() / 1000)) {
+            queueInOrder(index);
+        }
+    }
     if (unackedRatio >= unackedPacketThreshold && !receivedSync) {
         LOG("PERCENTAGE of UNACKED packets: " + String(100 * unackedRatio) +
             "%");
-        synchronize();
+        startSync(false);
     } else {
         this->periodsSinceSync++;
+        correctDrift();
+        state = QMAC_SLEEP;
     }
+}
 
-    // Putting all unacked packets to the send packets queue, so they will be
-    // sent during the next active period:
-    sendQueue.addAll(resendQueue);
+int QMACClass::numPacketsAvailable() { return receptionQueue.size(); }
+
+Packet QMACClass::pop() {
+    Packet p = {};
+    popInto(p);
+    return p;
+}
+
+bool QMACClass::popInto(Packet &p) {
+    const Packet *front = peek();
+    if (!front) return false;
+    copyPacket(p, *front);
+    release();
     return true;
 }
 
-int QMACClass::numPacketsAvailable() { return receptionQueue.getSize(); }
+const Packet *QMACClass::peek() {
+    if (receptionQueue.isEmpty()) return nullptr;
+    return &receptionPool[receptionQueue.front()];
+}
 
-Packet QMACClass::pop() {
-    if (receptionQueue.isEmpty()) {
-        return {};
+void QMACClass::release() {
+    uint8_t index;
+    if (receptionQueue.pop(&index)) receptionPool.release(index);
+}
+
+QMACPushResult QMACClass::push(const byte *payload, byte payloadSize,
+                               byte destination, QMACPriority priority,
+                               uint32_t ttl) {
+    QMACPushResult result;
+    int index = allocateSendSlot(&result, priority);
+    if (index < 0) return result;
+    sendPool[index].destination = destination;
+    inFlight[index].priority = priority;
+    inFlight[index].deadline =
+        ttl ? esp_timer_get_time() / 1000 + ttl : INT64_MAX;
+    memcpy(sendPool[index].payload, payload,
+           payloadSize < PAYLOAD_SIZE ? payloadSize : PAYLOAD_SIZE);
+    enqueueSendSlot(index, payloadSize);
+    return result;
+}
+
+byte *QMACClass::reserve(byte destination, QMACPriority priority,
+                         uint32_t ttl) {
+    if (reservedSlot < 0) {
+        reservedSlot = allocateSendSlot(&reservedResult, priority);
+        if (reservedSlot < 0) return nullptr;
     }
-    Packet p = receptionQueue[0];
-    receptionQueue.remove(0);
-    return p;
+    sendPool[reservedSlot].destination = destination;
+    inFlight[reservedSlot].priority = priority;
+    inFlight[reservedSlot].deadline =
+        ttl ? esp_timer_get_time() / 1000 + ttl : INT64_MAX;
+    return sendPool[reservedSlot].payload;
 }
 
-void QMACClass::push(byte payload[PAYLOAD_SIZE], byte payloadSize,
-                     byte destination) {
-    Packet p;
-    p.destination = destination;
-    p.source = localAddress;
-    p.packetID = this->msgCount++;
-    p.payloadLength = payloadSize;
-    p.sendRetryCount = 0;
-    memcpy(p.payload, payload, payloadSize);
-    sendQueue.add(p);
+QMACPushResult QMACClass::commit(byte payloadSize) {
+    if (reservedSlot < 0) return QMAC_REJECTED;
+    enqueueSendSlot(reservedSlot, payloadSize);
+    reservedSlot = -1;
+    return reservedResult;
 }
 
-bool QMACClass::sendAck(Packet p) {
+bool QMACClass::sendAck(byte destination, uint16_t id) {
     // Just switches sender and receiver address, and setting the payload length
     // to 0, to identify it as an ACK packet (chosen arbitrarily):
     Packet ackPacket = {
-        .destination = p.source,
+        .destination = destination,
         .source = this->localAddress,
-        .packetID = p.packetID,
+        .packetID = id,
+        .type = QMAC_ACK_FRAME,
         .payloadLength = 0,
     };
-    LOG("Sending ACK for ID " + String(p.packetID));
-    return send(ackPacket);
+    LOG("Sending ACK for ID " + String(id));
+    if (!send(ackPacket)) return false;
+    acks.frames++;
+    acks.airtime += getAirTime(ackPacket);
+    return true;
 }
 
 bool QMACClass::sendSyncPacket(byte destination) {
@@ -165,186 +1760,303 @@ bool QMACClass::sendSyncPacket(byte destination) {
         .destination = destination,
         .source = this->localAddress,
         .packetID = 0,
-        .nextActiveTime = nextActiveTime(),
+        .type = QMAC_SYNC_FRAME,
+        .sinkHops = sinkHops(),
         .payloadLength = 0,
     };
-    LOG("Sending Sync Packet with timestamp " +
-        String(syncResponse.nextActiveTime));
-    return send(syncResponse);
+    LOG("Sending Sync Packet");
+    if (!send(syncResponse)) return false;
+    syncs.frames++;
+    syncs.airtime += getAirTime(syncResponse);
+    return true;
 }
 
-float getAirTime(Packet p) {
-    if (p.isAck()) {
-        return ACK_AIRTIME;
-    } else if (p.isSyncPacket()) {
-        return SYNC_AIRTIME;
-    } else {
-        return LoRaCalc.getAirtime(NORMAL_HEADER_SIZE + p.payloadLength);
-    }
+float QMACClass::getAirTime(const Packet &p) {
+    // at the data rate the radio is configured with, as sent by this node
+    return frameAirtime(QMACFrame::frameLength(p, forwarding, driftCorrection,
+                                               headerFormat),
+                        radioRate);
 }
 
-bool QMACClass::send(Packet p) {
-    // check if we have enough airime
+bool QMACClass::send(const Packet &p) {
+    // check if we have enough airime, ACKs and sync packets come first
     float packetAirTime = getAirTime(p);
+    bool priority = p.isSyncPacket() || p.isAck();
+    int64_t now = esp_timer_get_time() / 1000;
     LOG("Sending Packet " + String(p.packetID) + " with airtime " +
-        String(packetAirTime) +
-        ". Remaining Airtime: " + String(availableAirtime));
-    if (packetAirTime > availableAirtime) {
+        String(packetAirTime) + ". Remaining Airtime: " +
+        String(dutyCycle.available(frequency, priority, now)));
+    if (dutyCycle.delay(frequency, packetAirTime, priority, now) > 0) {
         LOG("Maximum Airtime Reached. Available Airtime: " +
-            String(availableAirtime));
+            String(dutyCycle.available(frequency, priority, now)));
+        if (priority) {
+            dutyCycleRefusals.refusedPriority++;
+        } else {
+            dutyCycleRefusals.refused++;
+        }
         return false;
     }
 
+    // the frame is built first, so it is written to the radio in one burst
+    QMACFrame frame;
+    frame.encode(p, forwarding, driftCorrection, headerFormat);
     if (!LoRa.beginPacket()) {
         LOG("LoRa beginPacket failed");
         return false;
     }
-    CRC16 crc;
-    // Sends all fields of the packet in order:
-    LoRa.write(p.destination);
-    crc.add(p.destination);
-    LoRa.write(p.source);
-    crc.add(p.source);
-    LoRa.write(p.packetID);
-    crc.add(p.packetID);
-    if (p.isSyncPacket()) {
-        // convert nextActiveTime to byte array
-        byte b[2] = {p.nextActiveTime & 0xff, p.nextActiveTime >> 8};
-        LoRa.write(b, 2);
-        crc.add(b, 2);
-    } else {
-        LoRa.write(p.payloadLength);
-        crc.add(p.payloadLength);
-        LoRa.write(p.payload, p.payloadLength);
-        crc.add(p.payload, p.payloadLength);
-    }
-    uint16_t checksum = crc.calc();
-    byte c[2] = {checksum & 0xff, checksum >> 8};
-    LoRa.write(c, 2);
-    if (!LoRa.endPacket()) {
+    // The time is taken as late as possible, only the CRC follows. The delay
+    // until the transmission starts was measured with the previous frames.
+    bool time = p.isSyncPacket() || driftCorrection;
+    int64_t stamp = 0;
+    uint32_t next = 0;
+    if (time) {
+        stamp = esp_timer_get_time();
+        // receivers only take the time within a cycle, which is what the
+        // 16 bits of ms of a sync packet in the legacy header cover
+        int64_t cycle = (int64_t)(activeDuration + sleepDuration) * 1000;
+        next = (nextActiveMicros(stamp + txStartDelay) % cycle + cycle) % cycle;
+    }
+    frame.seal(time, next);
+    QMACPlatform::writeFrame(frame.header, frame.headerLength, frame.payload,
+                             frame.payloadLength, frame.trailer,
+                             frame.trailerLength);
+    bool sent = LoRa.endPacket();
+    // endPacket() returns at TxDone, the start is one airtime earlier
+    int64_t started = esp_timer_get_time() - (int64_t)(packetAirTime * 1000);
+    // the radio is in standby after transmitting
+    if (interruptReceive) LoRa.receive();
+    if (!sent) {
         LOG("LoRa endPacket failed");
         return false;
     }
-    availableAirtime -= packetAirTime;
+    if (stamp && started > stamp) {
+        txStartDelay = (3 * txStartDelay + (started - stamp)) / 4;
+    }
+    dutyCycle.consume(frequency, packetAirTime, now);
+    txTime += (int64_t)(packetAirTime * 1000);
+    counters.framesSent++;
+    noteActivity();
     return true;
 }
 
 bool QMACClass::receive(Packet* p) {
-    if (!LoRa.parsePacket()) return false;
-    // Parses the received data as a packet:
-    CRC16 crc;
-    p->destination = LoRa.read();
-    crc.add(p->destination);
-    p->source = LoRa.read();
-    crc.add(p->source);
-    p->packetID = LoRa.read();
-    crc.add(p->packetID);
-    if (p->isSyncPacket()) {
-        byte t[2];
-        LoRa.readBytes(t, 2);
-        p->nextActiveTime = *((int*)t);
-        crc.add(t, 2);
+    bool valid;
+    int rssi;
+    float snr;
+    if (interruptReceive) {
+        // frames were already read by the receive interrupt
+        if (rxTail == rxHead) return false;
+        const RawFrame& frame = rxFrames[rxTail];
+        valid = QMACFrame::decode(frame.data, frame.length, p);
+        rssi = frame.rssi;
+        snr = frame.snr;
+        int64_t airtime = frameAirtime(frame.length, radioRate) * 1000;
+        frameStart = frame.time - airtime;
+        rxTail = (rxTail + 1) % QMAC_RX_FRAMES;
     } else {
-        p->payloadLength = LoRa.read();
-        crc.add(p->payloadLength);
-        LoRa.readBytes(p->payload, p->payloadLength);
-        crc.add(p->payload, p->payloadLength);
+        int length = LoRa.parsePacket();
+        if (!length) return false;
+        // the RxDone time is not known when polling, the frame is at most a
+        // poll late
+        int64_t done = esp_timer_get_time();
+        byte frame[MAX_FRAME_SIZE];
+        length = length < MAX_FRAME_SIZE ? length : MAX_FRAME_SIZE;
+        QMACPlatform::readFrame(frame, length);
+        rssi = LoRa.packetRssi();
+        snr = LoRa.packetSnr();
+        int64_t airtime = frameAirtime(length, radioRate) * 1000;
+        frameStart = done - airtime;
+        valid = QMACFrame::decode(frame, length, p);
     }
-    byte checksum[2];
-    LoRa.readBytes(checksum, 2);
-    // return true if CRC check is successfull
-    // TODO: should the checksum be added to the Packet struct? should checking
-    // be done outside of the receive function?
-    return crc.calc() == *((uint16_t*)checksum);
+    if (!valid) {
+        counters.crcErrors++;
+        return false;
+    }
+    counters.framesReceived++;
+    noteActivity();
+    trackLink(p->source, rssi, snr);
+    learnRoutes(*p);
+    if (p->isSyncPacket() || (p->flags & QMAC_FLAG_TIME)) {
+        sampleOffset(p->source, p->nextActiveTime, frameStart);
+    }
+    // frames for other nodes are ignored, they cannot refer to their payloads
+    if (p->isSyncPacket() ||
+        (p->destination != this->localAddress && p->destination != BCADDR))
+        return true;
+    if (p->flags & QMAC_FLAG_CODED) {
+        // not acknowledged, the sender retries without the reference
+        codecCounters.decoded++;
+        if (!decompress(*p)) {
+            codecCounters.failures++;
+            return false;
+        }
+    }
+    if (compression) keepReceivedPayload(*p);
+    return true;
+}
+
+void IRAM_ATTR QMACClass::onReceiveISR(int packetSize) {
+    // Only copies the frame into a preallocated slot, it is parsed by the MAC
+    // the time is taken first, as close to the RxDone edge as possible
+    int64_t time = esp_timer_get_time();
+    QMACClass* self = receiver;
+    if (!self) return;
+    uint8_t next = (self->rxHead + 1) % QMAC_RX_FRAMES;
+    if (next == self->rxTail) return;  // buffer full, drop the frame
+    RawFrame& frame = self->rxFrames[self->rxHead];
+    frame.length = packetSize < MAX_FRAME_SIZE ? packetSize : MAX_FRAME_SIZE;
+    frame.rssi = LoRa.packetRssi();
+    frame.snr = LoRa.packetSnr();
+    frame.time = time;
+    QMACPlatform::readFrame(frame.data, frame.length);
+    self->rxHead = next;
+    QMACPlatform::notifyFromISR();
+}
+
+void IRAM_ATTR QMACClass::onCadDoneISR(boolean detected) {
+    QMACClass* self = receiver;
+    if (!self) return;
+    self->cadDetected = detected;
+    self->cadDone = true;
+    QMACPlatform::notifyFromISR();
 }
 
 void QMACClass::timerCallback(void* arg) {
     QMACClass* self = static_cast<QMACClass*>(arg);
-    esp_timer_start_once(self->timer_handle, self->active
-                                                 ? self->sleepDuration * 1000
-                                                 : self->activeDuration * 1000);
+    // the sleep is shorter by the time the active period was extended
+    esp_timer_start_once(self->timer_handle,
+                         self->active
+                             ? self->sleepDuration * 1000 - self->extension
+                             : self->activeDuration * 1000);
+    self->extension = 0;
     self->active = !self->active;
+    // wake up the MAC if it is waiting for the end of the active period
+    QMACPlatform::notify();
 }
 
-uint16_t QMACClass::nextActiveTime() {
-    int64_t nextTimeout = esp_timer_get_next_alarm() / 1000 - millis();
-    return active ? nextTimeout + this->sleepDuration : nextTimeout;
+int64_t QMACClass::maxSilence() {
+    // ms after which the packet IDs of a source are forgotten, a node which
+    // restarts synchronizes for a cycle and sends in a later active period
+    return 2 * activeDuration + sleepDuration;
 }
 
-bool QMACClass::synchronize() {
+uint32_t QMACClass::nextActiveTime() {
+    return nextActiveMicros(esp_timer_get_time()) / 1000;
+}
+
+int64_t QMACClass::nextActiveMicros(int64_t at) {
+    // us from the local time `at` until the next active period starts
+    int64_t next = esp_timer_get_next_alarm() - at;
+    return active ? next + this->sleepDuration * 1000 - extension : next;
+}
+
+void QMACClass::startSync(bool periodic) {
     LOG("Start synchronization");
-    List<uint16_t> receivedTimestamps;
-    List<uint64_t> transmissionDelays;
-    List<uint64_t> receptionTimestamps;
-    List<uint8_t> addresses;  // TODO: Use better data structure
-    uint64_t cycleDuration = this->activeDuration + this->sleepDuration;
-    int minimumListeningDuration = 200;
+    syncs.cycles++;
+    periodicSync = periodic;
+    syncResponses.clear();
 
     // Sending sync packets and waiting until a response is received:
-    uint64_t syncStartTime = millis();
-    availableAirtime += availableAirtimePerCycle;
+    syncStartTime = millis();
+    state = QMAC_SYNC_SEND;
+}
+
+uint32_t QMACClass::sendingSync() {
     // wait for messages for a minimum of one cycleDuration
-    while ((millis() - syncStartTime) < cycleDuration) {
-        uint64_t period =
-            random(minimumListeningDuration, this->activeDuration);
-
-        long transmissionStartTime = millis();
-        sendSyncPacket(BCADDR);
-
-        // listen for sync responses for some time
-        long listeningStartTime = millis();
-        while (millis() - listeningStartTime < period) {
-            Packet p = {};
-            if (!receive(&p)) continue;
-            boolean knownAddress = false;
-            for (size_t i = 0; i < addresses.getSize(); i++) {
-                if (p.source == addresses[i]) {
-                    knownAddress = true;
-                    break;
-                }
-            }
-            if (p.isSyncPacket() && !knownAddress) {
-                LOG("Received sync packet");
-                transmissionDelays.add(millis() - transmissionStartTime);
-                receivedTimestamps.add(p.nextActiveTime);
-                receptionTimestamps.add(millis());
-                addresses.add(p.source);
-            }
-        }
-        LoRa.sleep();
-        delay(period);
+    if (millis() - syncStartTime >= activeDuration + sleepDuration) {
+        finishSync();
+        return 0;
     }
-    if (receivedTimestamps.isEmpty()) return false;
+    syncPeriod = random(MIN_SYNC_LISTENING_DURATION, this->activeDuration);
 
-    int numResponses = receivedTimestamps.getSize();
-    uint64_t averageNextActiveTime = 0;
-    for (size_t i = 0; i < numResponses; i++) {
-        // Results show removing the delay from the calculation improves the
-        // synchronization for some reason
-        // uint64_t timeResponseSent = receptionTimestamps[i] - 0.5 *
-        // transmissionDelays[i];
-        uint64_t timeResponseSent = receptionTimestamps[i];
-        uint64_t timeSinceResponseSent = millis() - timeResponseSent;
+    sendSyncPacket(BCADDR);
+
+    // listen for sync responses for some time
+    syncListeningTime = millis();
+    if (interruptReceive) LoRa.receive();
+    state = QMAC_SYNC_LISTEN;
+    return 0;
+}
+
+uint32_t QMACClass::listeningSync() {
+    int64_t elapsed = millis() - syncListeningTime;
+    if (elapsed >= (int64_t)syncPeriod) {
+        LoRa.sleep();
+        syncPauseEnd = millis() + syncPeriod;
+        state = QMAC_SYNC_PAUSE;
+        return syncPeriod;
+    }
 
-        averageNextActiveTime +=
-            receivedTimestamps[i] - (millis() - timeResponseSent);
-        if (timeSinceResponseSent > receivedTimestamps[i]) {
-            averageNextActiveTime += cycleDuration;
+    Packet &p = receiveBuffer();
+    if (!receive(&p)) {
+        // the radio has to be polled if the receive interrupt is not used
+        return interruptReceive ? syncPeriod - elapsed : 0;
+    }
+    if (!p.isSyncPacket()) return 0;
+    LOG("Received sync packet");
+    SyncResponse response = {.address = p.source,
+                             .nextActiveTime = p.nextActiveTime,
+                             .sent = frameStart};
+    // the newest response of a node is kept, it may have moved its schedule
+    // since the previous one
+    for (size_t i = 0; i < syncResponses.size(); i++) {
+        if (p.source == syncResponses[i].address) {
+            syncResponses[i] = response;
+            return 0;
         }
     }
-    averageNextActiveTime += nextActiveTime();
-    averageNextActiveTime = averageNextActiveTime / (numResponses + 1);
-    LOG("Own Schedule " + String(nextActiveTime()));
-    LOG("Average next time active " + String(averageNextActiveTime));
+    // responses beyond the capacity are ignored
+    syncResponses.push(response);
+    return 0;
+}
 
-    updateTimer(averageNextActiveTime);
-    return true;
+uint32_t QMACClass::pausingSync() {
+    int64_t remaining = syncPauseEnd - (int64_t)millis();
+    if (remaining > 0) return remaining;
+    state = QMAC_SYNC_SEND;
+    return 0;
 }
 
-void QMACClass::updateTimer(uint64_t timeUntilActive) {
+void QMACClass::finishSync() {
+    state = QMAC_SLEEP;
+    cycleResult = !syncResponses.isEmpty();
+    if (!cycleResult) return;
+    if (periodicSync) this->periodsSinceSync = 0;
+
+    // The responses carry the time from their start until the next active
+    // period of the responder. The mean is taken of the offsets to the own
+    // schedule, within half a cycle, in ms.
+    float cycle = activeDuration + sleepDuration;
+    size_t numResponses = syncResponses.size();
+    int64_t now = esp_timer_get_time();
+    int64_t own = nextActiveMicros(now);
+    float sum = 0;
+    for (size_t i = 0; i < numResponses; i++) {
+        const SyncResponse &response = syncResponses[i];
+        int64_t next = response.nextActiveTime - (now - response.sent);
+        sum += wrapOffset((next - own) / 1000.0f, cycle);
+    }
+    int64_t timeUntilActive = own + llroundf(sum / (numResponses + 1) * 1000);
+    if (timeUntilActive <= 0) timeUntilActive += (int64_t)cycle * 1000;
+    LOG("Own Schedule " + String((uint32_t)own));
+    LOG("Average next time active " + String((uint32_t)timeUntilActive));
+
+    updateTimer(timeUntilActive);
+}
+
+void QMACClass::updateTimer(int64_t timeUntilActive) {
+    // the drift estimates are kept against the schedule without any moves
+    float cycle = activeDuration + sleepDuration;
+    int64_t own = nextActiveMicros(esp_timer_get_time());
+    float shift = wrapOffset((timeUntilActive - own) / 1000.0f, cycle);
+    scheduleShift += shift;
+    scheduleMoved = millis();
+    counters.corrections++;
+    counters.lastCorrection = lroundf(shift * 1000);
+    correctionSum += abs(counters.lastCorrection);
     esp_timer_stop(this->timer_handle);
     this->active = false;
-    esp_timer_start_once(this->timer_handle, timeUntilActive * 1000);
+    esp_timer_start_once(this->timer_handle, timeUntilActive);
 }
 
 void QMACClass::setSleepingDuration(uint64_t duration) {
@@ -367,6 +2079,309 @@ void QMACClass::setUnackedPacketThreshold(float threshold) {
     unackedPacketThreshold = threshold;
 }
 
+void QMACClass::setLowPowerSleep(QMACSleepMode mode, uint32_t wakeMargin) {
+    sleepMode = mode;
+    this->wakeMargin = wakeMargin;
+}
+
+void QMACClass::setInterruptReceive(bool enabled) {
+    interruptReceive = enabled;
+}
+
+uint64_t QMACClass::lastCycleBusyTime() { return lastBusyTime; }
+
+uint64_t QMACClass::busyTime() { return totalBusyTime; }
+
+void QMACClass::setSendQueuePolicy(QMACOverflowPolicy policy) {
+    sendQueuePolicy = policy;
+}
+
+void QMACClass::setReceptionQueuePolicy(QMACOverflowPolicy policy) {
+    receptionQueuePolicy = policy;
+}
+
+QMACQueueStats QMACClass::sendQueueStats() {
+    return {.size = sendPool.used(),
+            .capacity = QMAC_SEND_QUEUE_SIZE,
+            .highWaterMark = sendPool.highWaterMark(),
+            .drops = sendQueueDrops};
+}
+
+QMACDedupStats QMACClass::dedupStats() { return dedup; }
+
+void QMACClass::setAggregation(bool enabled) { aggregation = enabled; }
+
+void QMACClass::setAckMode(QMACAckMode mode) { ackMode = mode; }
+
+void QMACClass::setAckDelay(uint32_t delay) { ackDelay = delay; }
+
+QMACAckStats QMACClass::ackStats() { return acks; }
+
+void QMACClass::setBaseDataRate(uint8_t spreadingFactor, long bandwidth) {
+    baseRate = {spreadingFactor, bandwidth};
+}
+
+void QMACClass::setAdaptiveDataRate(bool enabled, float margin,
+                                    long maxBandwidth) {
+    adaptiveDataRate = enabled;
+    adrMargin = margin;
+    adrMaxBandwidth = maxBandwidth;
+}
+
+QMACDataRate QMACClass::dataRate(byte destination) {
+    return selectDataRate(destination, NORMAL_HEADER_SIZE + PAYLOAD_SIZE);
+}
+
+float QMACClass::linkSnr(byte address) {
+    Neighbor *n = neighbors.find(address);
+    return n && n->linkSamples ? n->snr : NAN;
+}
+
+int QMACClass::linkRssi(byte address) {
+    Neighbor *n = neighbors.find(address);
+    return n && n->linkSamples ? lround(n->rssi) : 0;
+}
+
+void QMACClass::setListenBeforeTalk(bool enabled) {
+    listenBeforeTalk = enabled;
+}
+
+QMACLbtStats QMACClass::lbtStats() { return lbt; }
+
+void QMACClass::setFrequency(long frequency) { this->frequency = frequency; }
+
+void QMACClass::setDutyCycle(uint32_t window, uint32_t burst, float reserve) {
+    dutyCycle.configure(window * 1000, burst * 1000, reserve);
+}
+
+uint32_t QMACClass::sendDelay(byte payloadLength) {
+    float airtime = frameAirtime(NORMAL_HEADER_SIZE + payloadLength, baseRate);
+    return dutyCycle.delay(frequency, airtime, false,
+                           esp_timer_get_time() / 1000);
+}
+
+QMACDutyCycleStats QMACClass::dutyCycleStats() { return dutyCycleRefusals; }
+
+bool QMACClass::sendMessage(const byte *message, size_t length,
+                            byte destination, QMACPriority priority,
+                            uint32_t ttl) {
+    if (outgoingState == QMAC_MESSAGE_SENDING || length > MAX_MESSAGE_SIZE) {
+        return false;
+    }
+    OutgoingMessage &m = outgoing;
+    m.data = message;
+    m.length = length;
+    m.destination = destination;
+    m.messageID = messageCount++;
+    m.count = length ? (length + FRAGMENT_DATA_SIZE - 1) / FRAGMENT_DATA_SIZE
+                     : 1;
+    m.next = 0;
+    m.queued = 0;
+    m.delivered = 0;
+    m.failed = false;
+    m.priority = priority;
+    m.deadline = ttl ? esp_timer_get_time() / 1000 + ttl : INT64_MAX;
+    outgoingState = QMAC_MESSAGE_SENDING;
+    queueFragments();
+    return true;
+}
+
+QMACMessageState QMACClass::messageState() { return outgoingState; }
+
+const byte *QMACClass::peekMessage(size_t *length, byte *source) {
+    for (Reassembly &r : reassemblies) {
+        if (!r.used || !r.complete) continue;
+        *length = r.length;
+        if (source) *source = r.source;
+        return r.data;
+    }
+    return nullptr;
+}
+
+void QMACClass::releaseMessage() {
+    for (Reassembly &r : reassemblies) {
+        if (r.used && r.complete) {
+            r.used = false;
+            return;
+        }
+    }
+}
+
+void QMACClass::setFragmentCallback(QMACFragmentCallback callback) {
+    fragmentCallback = callback;
+}
+
+void QMACClass::setReassemblyTimeout(uint32_t timeout) {
+    reassemblyTimeout = timeout;
+}
+
+QMACMessageStats QMACClass::messageStats() { return messages; }
+
+QMACClassStats QMACClass::classStats(QMACPriority priority) {
+    QMACClassStats stats = classes[priority];
+    if (stats.sent) stats.meanLatency = classLatencySum[priority] / stats.sent;
+    return stats;
+}
+
+void QMACClass::setForwarding(bool enabled, byte sink, uint8_t maxHops) {
+    this->forwarding = enabled;
+    this->sink = sink;
+    this->maxHops = maxHops;
+    routes.clear();
+}
+
+byte QMACClass::nextHop(byte destination, uint8_t *hops) {
+    const Route *r = findRoute(destination);
+    if (hops) *hops = r ? r->hops : NO_ROUTE;
+    return r ? r->nextHop : destination;
+}
+
+QMACRoutingStats QMACClass::routingStats() { return routing; }
+
+void QMACClass::setDriftCorrection(bool enabled, uint32_t guardTime) {
+    this->driftCorrection = enabled;
+    this->guardTime = guardTime;
+}
+
+float QMACClass::clockDrift(byte address) {
+    Neighbor *n = neighbors.find(address);
+    if (!n || n->offsets < DRIFT_MIN_SAMPLES) return NAN;
+    return n->driftRate * 1e6;
+}
+
+QMACSyncStats QMACClass::syncStats() { return syncs; }
+
+void QMACClass::setAdaptiveActivePeriod(bool enabled, uint32_t idleTimeout,
+                                        uint32_t step, uint8_t maxSteps) {
+    this->adaptiveActivePeriod = enabled;
+    this->idleTimeout = idleTimeout;
+    // an extension has to leave room for at least one slot
+    this->extensionStep = step > 2 * SLOT_TIME ? step : 2 * SLOT_TIME;
+    this->maxExtensions = maxSteps;
+}
+
+QMACActivityStats QMACClass::activityStats() { return activity; }
+
+void QMACClass::setCompression(bool enabled) { compression = enabled; }
+
+QMACCodecStats QMACClass::codecStats() { return codecCounters; }
+
+void QMACClass::setHeaderFormat(QMACHeaderFormat format) {
+    headerFormat = format;
+}
+
+QMACStats QMACClass::stats() {
+    int64_t now = esp_timer_get_time();
+    accountTime(now);
+    QMACStats s = counters;
+    s.rxTime = rxTime / 1000;
+    s.txTime = txTime / 1000;
+    s.syncTime = syncTime / 1000;
+    s.sleepTime = sleepTime / 1000;
+    s.uptime = s.rxTime + s.txTime + s.syncTime + s.sleepTime;
+    s.airtime = dutyCycle.used(frequency, now / 1000);
+    s.airtimeBudget = dutyCycle.budget(frequency, now / 1000);
+    s.duplicates = dedup.hits;
+    for (const QMACClassStats &c : classes) s.expired += c.expired;
+    if (s.corrections) s.meanCorrection = correctionSum / s.corrections;
+    return s;
+}
+
+size_t QMACClass::dumpStats(byte *buffer, size_t size,
+                            QMACStatsFormat format) {
+    QMACStats s = stats();
+    // the binary record holds the bits of a signed field as they are
+    struct Field {
+        uint32_t value;
+        bool isSigned;
+    } fields[] = {{s.uptime, false},
+                  {s.rxTime, false},
+                  {s.txTime, false},
+                  {s.syncTime, false},
+                  {s.sleepTime, false},
+                  {(uint32_t)lroundf(s.airtime), false},
+                  {(uint32_t)lroundf(s.airtimeBudget), false},
+                  {s.framesSent, false},
+                  {s.framesReceived, false},
+                  {s.crcErrors, false},
+                  {s.duplicates, false},
+                  {s.retryDrops, false},
+                  {s.expired, false},
+                  {s.corrections, false},
+                  {(uint32_t)s.lastCorrection, true},
+                  {s.meanCorrection, false}};
+    const QMACHistogram *histograms[] = {&s.ackRtt, &s.latency};
+    if (format == QMAC_STATS_BINARY) {
+        if (size < QMAC_STATS_RECORD_SIZE) return 0;
+        byte *out = buffer;
+        *out++ = QMAC_STATS_VERSION;
+        *out++ = 0;
+        for (const Field &f : fields) out = putUint32(out, f.value);
+        for (const QMACHistogram *h : histograms) {
+            out = putUint32(out, h->unit);
+            for (uint32_t b : h->bins) out = putUint32(out, b);
+        }
+        return out - buffer;
+    }
+    size_t length = 0;
+    for (const Field &f : fields) {
+        if (length >= size) break;
+        if (f.isSigned) {
+            length += snprintf((char *)buffer + length, size - length, "%ld,",
+                               (long)(int32_t)f.value);
+        } else {
+            length += snprintf((char *)buffer + length, size - length, "%lu,",
+                               (unsigned long)f.value);
+        }
+    }
+    for (const QMACHistogram *h : histograms) {
+        for (uint32_t b : h->bins) {
+            if (length >= size) break;
+            length += snprintf((char *)buffer + length, size - length, "%lu,",
+                               (unsigned long)b);
+        }
+    }
+    if (length >= size) return 0;
+    // the newline replaces the last comma
+    buffer[length - 1] = '\n';
+    return length;
+}
+
+const char *QMACClass::statsCsvHeader() {
+    // the bins follow ACK_RTT_UNIT and LATENCY_UNIT
+    return "uptime_ms,rx_ms,tx_ms,sync_ms,sleep_ms,airtime_ms,"
+           "airtime_budget_ms,frames_sent,frames_received,crc_errors,"
+           "duplicates,retry_drops,expired,corrections,last_correction_us,"
+           "mean_correction_us,ack_rtt_lt32ms,ack_rtt_lt64ms,"
+           "ack_rtt_lt128ms,ack_rtt_lt256ms,ack_rtt_lt512ms,"
+           "ack_rtt_lt1024ms,ack_rtt_lt2048ms,ack_rtt_ge2048ms,"
+           "latency_lt4s,latency_lt8s,latency_lt16s,latency_lt32s,"
+           "latency_lt64s,latency_lt128s,latency_lt256s,latency_ge256s\n";
+}
+
+float QMACClass::lastCycleAirtimeSaved() { return lastAirtimeSaved; }
+
+float QMACClass::airtimeSaved() { return totalAirtimeSaved; }
+
+uint8_t QMACClass::outstandingPackets(byte destination) {
+    Neighbor *n = neighbors.find(destination);
+    return n ? n->outstanding : 0;
+}
+
+uint32_t QMACClass::roundTripTime(byte destination) {
+    Neighbor *n = neighbors.find(destination);
+    return n ? n->roundTripTime : 0;
+}
+
+QMACQueueStats QMACClass::receptionQueueStats() {
+    return {.size = receptionQueue.size(),
+            .capacity = QMAC_RECEPTION_QUEUE_SIZE,
+            .highWaterMark = receptionQueue.highWaterMark(),
+            .drops = receptionQueueDrops};
+}
+
+QMACState QMACClass::getState() { return state; }
+
 boolean QMACClass::isActive() { return this->active; }
 
 QMACClass QMAC;
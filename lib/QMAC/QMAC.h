@@ -1,42 +1,264 @@
 #pragma once
 
 #include <Arduino.h>
-#include <CRC.h>
-#include <CRC16.h>
+#include <CRC16Table.h>
 #include <Debug.h>
+#include <DuplicateFilter.h>
+#include <DutyCycle.h>
 #include <KickSort.h>
 #include <LoRa.h>
 #include <LoRaAirtime.h>
+#include <NeighborTable.h>
+#include <PayloadCodec.h>
+#include <QMACPlatform.h>
+#include <RingBuffer.h>
 #include <esp_timer.h>
 
-#include <List.hpp>
-
 #define BCADDR             0xFF
+// sizes of the frames in the legacy header with the CRC, see
+// QMACClass::setHeaderFormat
 #define ACK_PACKET_SIZE    6
 #define SYNC_PACKET_SIZE   7
 #define NORMAL_HEADER_SIZE 6
 #define PREAMBLE_LENGTH    7
-// 235 (max lora packet length) - 8 (preamble length) - 6 (normal header size) =
-// 221
-#define PAYLOAD_SIZE 221
-// following calculated with https://www.loratools.nl/#/airtime
-#define SYNC_AIRTIME 28.93
-#define ACK_AIRTIME  28.93
+// 235 (max lora packet length) - 8 (preamble length) - NORMAL_HEADER_SIZE (6)
+// = 221
+#define PAYLOAD_SIZE (235 - 8 - NORMAL_HEADER_SIZE)
+// in ms for SF7 and 125 kHz, see LoRaAirtimeTable
+#define SYNC_AIRTIME \
+    (LoRaAirtimeTable<7, 125000>::micros[SYNC_PACKET_SIZE] / 1000.0)
+#define ACK_AIRTIME \
+    (LoRaAirtimeTable<7, 125000>::micros[ACK_PACKET_SIZE] / 1000.0)
+// the payload consists of records of several packets, see QMACClass::aggregate
+#define QMAC_FLAG_AGGREGATED 0x01
+// ID and length in front of every aggregated payload
+#define RECORD_HEADER_SIZE 2
+// the header is followed by an ACK field, see QMACClass::setAckMode
+#define QMAC_FLAG_ACKS 0x02
+// The ACK field is the base ID, the length of the bitmap and the bitmap of
+// the following IDs which are acknowledged as well
+#define ACK_FIELD_HEADER_SIZE 2
+#define ACK_FIELD_IDS         32
+// the destination has to switch to the data rate in the payload for the next
+// frame, see QMACClass::setAdaptiveDataRate
+#define QMAC_FLAG_FOLLOW 0x04
+// the payload is a fragment of a message, it starts with the message ID, the
+// index of the fragment and the number of fragments, see
+// QMACClass::sendMessage
+#define QMAC_FLAG_FRAGMENT   0x08
+#define FRAGMENT_HEADER_SIZE 3
+#define FRAGMENT_DATA_SIZE   (PAYLOAD_SIZE - FRAGMENT_HEADER_SIZE)
+#define MAX_MESSAGE_SIZE     (255 * FRAGMENT_DATA_SIZE)
+// the frame is forwarded towards another node, it carries a route field after
+// the ACK field, see QMACClass::setForwarding
+#define QMAC_FLAG_ROUTED 0x10
+// The route field is the final destination, the origin, the ID the origin
+// gave the packet and the number of hops it already took
+#define ROUTE_FIELD_SIZE 4
+// hops of an unknown route
+#define NO_ROUTE 0xFF
+// the frame carries the time until the next active period of the sender in
+// front of the CRC, see QMACClass::setDriftCorrection
+#define QMAC_FLAG_TIME 0x20
+// The time field is the us from the start of the transmission until the next
+// active period of the sender, sync packets in the compact header carry it as
+// well. Sync packets in the legacy header carry the ms in 16 bits instead.
+#define TIME_FIELD_SIZE        4
+#define LEGACY_TIME_FIELD_SIZE 2
+// the sender has more packets queued, the receivers stay awake and extend the
+// active period if needed, see QMACClass::setAdaptiveActivePeriod
+#define QMAC_FLAG_MORE 0x40
+// the payload is compressed, it starts with the format byte of PayloadCodec,
+// see QMACClass::setCompression
+#define QMAC_FLAG_CODED 0x80
+// the sender waits for an ACK, only set by QMACFrame::decode, the legacy header
+// implies it for data frames to a single node
+#define QMAC_FLAG_ACK_REQUEST 0x100
+// The legacy header is the destination, the source, the 8-bit packet ID and
+// the payload length, ID 0 makes it a sync packet with the time instead of
+// the length, and a length of 0 an ACK. It has no room for flags or the hops
+// to the sink, a frame with any of them, or a data or ACK frame with the time
+// field, is sent in the compact header.
+// The compact header, see QMACClass::setHeaderFormat, is the destination, the
+// source, a control byte and the 16-bit packet ID, which sync packets do not
+// have. The control byte holds the version of the header, the frame type and
+// the flags set on most frames, a byte of the other flags follows if one of
+// them is set. The base ID of the ACK field and the origin ID of the route
+// field have 16 bits. The payload length is not sent, the payload ends at the
+// time field or the CRC. The CRC starts from COMPACT_CRC_INIT instead of 0, so
+// frames of one format are rarely taken for the other, see QMACFrame::decode.
+#define QMAC_HEADER_VERSION    1
+#define COMPACT_VERSION_SHIFT  6
+#define COMPACT_TYPE_SHIFT     4
+#define COMPACT_TYPE_MASK      0x03
+#define COMPACT_FOLLOW_FRAME   3
+#define COMPACT_ACK_REQUEST    0x08
+#define COMPACT_TIME           0x04
+#define COMPACT_MORE           0x02
+#define COMPACT_EXTENDED       0x01
+#define COMPACT_EXTENDED_FLAGS                                       \
+    (QMAC_FLAG_AGGREGATED | QMAC_FLAG_ACKS | QMAC_FLAG_FRAGMENT | \
+     QMAC_FLAG_ROUTED | QMAC_FLAG_CODED)
+#define COMPACT_CRC_INIT 0xFFFF
+// a data or ACK frame in the compact header without optional fields, with the
+// CRC. The 16-bit ID and the control byte make it 1 byte longer than
+// NORMAL_HEADER_SIZE, the legacy header stays the shorter one for frames
+// without flags.
+#define COMPACT_HEADER_SIZE 7
+// number of raw frames the receive interrupt can buffer
+#ifndef QMAC_RX_FRAMES
+#define QMAC_RX_FRAMES 4
+#endif
+// number of packets waiting to be sent or acknowledged
+#ifndef QMAC_SEND_QUEUE_SIZE
+#define QMAC_SEND_QUEUE_SIZE 16
+#endif
+// number of received packets waiting to be popped
+#ifndef QMAC_RECEPTION_QUEUE_SIZE
+#define QMAC_RECEPTION_QUEUE_SIZE 16
+#endif
+// number of fragments of the message being sent which are queued at once
+#ifndef QMAC_FRAGMENT_WINDOW
+#define QMAC_FRAGMENT_WINDOW 8
+#endif
+// number of messages which are reassembled at the same time, and the largest
+// message which can be reassembled without a fragment callback
+#ifndef QMAC_REASSEMBLY_SLOTS
+#define QMAC_REASSEMBLY_SLOTS 2
+#endif
+#ifndef QMAC_REASSEMBLY_SIZE
+#define QMAC_REASSEMBLY_SIZE 4096
+#endif
+// number of destinations a route is kept for, see QMACClass::setForwarding
+#ifndef QMAC_ROUTES
+#define QMAC_ROUTES 32
+#endif
+// ms after which a route which was not confirmed gives way to any other
+#ifndef QMAC_ROUTE_TIMEOUT
+#define QMAC_ROUTE_TIMEOUT 600000
+#endif
+// number of schedule offsets kept per neighbor to estimate the drift, see
+// QMACClass::setDriftCorrection
+#ifndef QMAC_DRIFT_SAMPLES
+#define QMAC_DRIFT_SAMPLES 8
+#endif
+// number of sources whose recent packet IDs are remembered to detect
+// retransmissions
+#ifndef QMAC_DEDUP_SOURCES
+#define QMAC_DEDUP_SOURCES 32
+#endif
+// number of nodes whose link statistics are kept
+#ifndef QMAC_MAX_NEIGHBORS
+#define QMAC_MAX_NEIGHBORS 32
+#endif
+// number of nodes whose schedule is considered during synchronization
+#ifndef QMAC_MAX_SYNC_RESPONSES
+#define QMAC_MAX_SYNC_RESPONSES 32
+#endif
+// number of intervals the duty cycle window is kept in, see
+// QMACClass::setDutyCycle
+#ifndef QMAC_DUTY_CYCLE_INTERVALS
+#define QMAC_DUTY_CYCLE_INTERVALS 60
+#endif
+// maximum number of slots a transmission is moved back when the channel is
+// busy, see QMACClass::setListenBeforeTalk
+#ifndef QMAC_LBT_MAX_BACKOFF
+#define QMAC_LBT_MAX_BACKOFF 4
+#endif
+// number of nodes the last payloads sent to and received from are kept for,
+// see QMACClass::setCompression
+#ifndef QMAC_CODEC_REFERENCES
+#define QMAC_CODEC_REFERENCES 4
+#endif
+// number of payloads received from a node a compressed payload can refer to
+#define CODEC_RECEIVED_PAYLOADS 2
+// number of bins of the histograms in QMACStats, and the ms below which the
+// first bin of the ACK round trip times and of the latencies counts
+#define QMAC_HISTOGRAM_BINS 8
+#define ACK_RTT_UNIT        32
+#define LATENCY_UNIT        4000
+// version and size of the binary statistics record, see QMACClass::dumpStats
+#define QMAC_STATS_VERSION 1
+#define QMAC_STATS_RECORD_SIZE (2 + 16 * 4 + 2 * (1 + QMAC_HISTOGRAM_BINS) * 4)
+// polynomial of the CRC at the end of every frame, the default one of the
+// CRC16 class of robtillaart/CRC which computed it before
+#define QMAC_CRC16_POLYNOMIAL 0x8001
+#define CRC_SIZE              2
+// the fields in front of the payload, with an ACK and a route field in the
+// compact header, which has an extended flags byte and 16-bit IDs in both
+#define MAX_HEADER_SIZE                                                  \
+    (COMPACT_HEADER_SIZE - CRC_SIZE + 1 + ACK_FIELD_HEADER_SIZE + 1 + 4 + \
+     ROUTE_FIELD_SIZE + 1)
+#define MAX_FRAME_SIZE              255
+#define SLOT_TIME                   100
+#define MIN_SYNC_LISTENING_DURATION 200
+// The channel is sensed at a random time within this many ms after the start
+// of a slot, so nodes which picked the same slot can detect each other
+#define LBT_JITTER  16
+#define CAD_TIMEOUT 10
+// time between a follow frame and the frame at the new data rate, so the
+// destination can switch in time
+#define FOLLOW_GAP 5
+// SNR penalty for a node whose packets sent at a faster data rate were not
+// acknowledged, and how much of it is forgiven after a successful period
+#define ADR_PENALTY_STEP  3
+#define ADR_PENALTY_DECAY 1
+// SNR in dB above the demodulation limit of the base data rate a neighbor
+// needs to be used as next hop
+#define ROUTE_LINK_MARGIN 3
+// offsets needed before the drift of a neighbor is estimated, and the age in
+// ms after which its estimate is not used anymore
+#define DRIFT_MIN_SAMPLES 3
+#define DRIFT_MAX_AGE     1800000
+// ms of sleep below which the SoC stays awake, see
+// QMACClass::setLowPowerSleep, and the mark of a valid retained state
+#define MIN_POWER_DOWN 20
+#define RETAINED_MAGIC 0x514D4143
+
+// Formats of the frame header, see QMACClass::setHeaderFormat
+typedef enum {
+    QMAC_HEADER_LEGACY,   // the baseline header, 8-bit packet IDs, no flags
+    QMAC_HEADER_COMPACT,  // versioned, with the frame type and 16-bit IDs
+} QMACHeaderFormat;
+
+// Kinds of frames, follow frames are data frames with QMAC_FLAG_FOLLOW
+typedef enum {
+    QMAC_DATA_FRAME,
+    QMAC_ACK_FRAME,
+    QMAC_SYNC_FRAME,
+} QMACFrameType;
 
 typedef struct QMACPacket {
     // Packet Headers:
     byte destination;
     byte source;
-    byte packetID;
-    // only in sync packets
-    uint16_t nextActiveTime;
+    // counted by the sender, the low byte is never 0 and is all the legacy
+    // header carries, 0 in sync packets
+    uint16_t packetID;
+    byte type;    // QMACFrameType
+    byte format;  // QMACHeaderFormat the frame was received in
+    // not in sync packets
+    uint16_t flags;
+    // only with QMAC_FLAG_ROUTED
+    byte finalDestination;
+    byte origin;
+    uint16_t originID;
+    uint8_t hops;
+    // only with QMAC_FLAG_ACKS, bit i of ackBitmap acknowledges ID ackBase + i,
+    // bit 0 is always set
+    uint16_t ackBase;
+    uint32_t ackBitmap;
+    // us, in sync packets and with QMAC_FLAG_TIME, within a cycle. Sync
+    // packets in the legacy header have whole ms.
+    uint32_t nextActiveTime;
+    // hops of the sender to the sink, only sent by forwarding nodes
+    uint8_t sinkHops;
     byte payloadLength;
     byte payload[PAYLOAD_SIZE];
-    // byte crc[2];
     uint16_t sendRetryCount;
 
-    bool isAck() const { return payloadLength == 0; }
-    bool isSyncPacket() const { return packetID == 0; }
+    bool isAck() const { return type == QMAC_ACK_FRAME; }
+    bool isSyncPacket() const { return type == QMAC_SYNC_FRAME; }
 
     String toString() const {
         String result = "destination: 0x" + String(destination, HEX) + "\n";
@@ -47,6 +269,18 @@ typedef struct QMACPacket {
             result += "nextWakeUpTime: " + String(nextActiveTime) + "\n";
             return result;
         }
+        result += "flags: 0x" + String(flags, HEX) + "\n";
+        if (flags & QMAC_FLAG_ACKS) {
+            result += "ackBase: 0x" + String(ackBase, HEX) + "\n";
+            result += "ackBitmap: 0x" + String(ackBitmap, HEX) + "\n";
+        }
+        if (flags & QMAC_FLAG_ROUTED) {
+            result += "finalDestination: 0x" + String(finalDestination, HEX) +
+                      "\n";
+            result += "origin: 0x" + String(origin, HEX) + "\n";
+            result += "originID: 0x" + String(originID, HEX) + "\n";
+            result += "hops: " + String(hops) + "\n";
+        }
         result += "payloadLength: 0x" + String(payloadLength, HEX) + "\n";
         if (!isAck()) {
             result += "payload: ";
@@ -59,6 +293,273 @@ typedef struct QMACPacket {
     }
 } Packet;
 
+// Serializes packets into the frames sent over the air and parses received
+// frames. A frame is written to the radio in one burst of the header, the
+// payload of the packet in place and the trailer, see
+// QMACPlatform::writeFrame.
+class QMACFrame {
+   public:
+    /**
+     * Write the fields of a packet in front of the payload into the header.
+     * A frame the legacy header has no room for is written in the compact
+     * one, see formatOf().
+     * @param p The packet, it has to outlive the frame.
+     * @param sinkHops true to add the hops to the sink to a sync packet.
+     * @param time true to set QMAC_FLAG_TIME in a data or ACK frame, the
+     * time field is added by seal().
+     * @param format The format of the header (default is
+     * QMAC_HEADER_LEGACY).
+     */
+    void encode(const Packet &p, bool sinkHops, bool time,
+                QMACHeaderFormat format = QMAC_HEADER_LEGACY);
+
+    /**
+     * Write the time field and the CRC into the trailer.
+     * @param time true for sync packets and with QMAC_FLAG_TIME.
+     * @param nextActiveTime The us from the start of the transmission until
+     * the next active period of the sender, a sync packet in the legacy
+     * header carries the ms up to 65535.
+     */
+    void seal(bool time, uint32_t nextActiveTime);
+
+    size_t length() const {
+        return headerLength + payloadLength + trailerLength;
+    }
+
+    /**
+     * Parse a received frame in either header format, the one it was sent
+     * in is set in the packet. The format is told by the control byte and
+     * the CRC seed, which takes up to 1 in 262144 legacy frames for a
+     * compact one. Every field is checked against the length of the frame,
+     * and the payload length against PAYLOAD_SIZE.
+     * @param frame The received bytes.
+     * @param length The number of received bytes.
+     * @param p The packet to fill in.
+     * @return false if the frame is truncated or its CRC is wrong.
+     */
+    static bool decode(const byte *frame, size_t length, Packet *p);
+
+    // the format the packet is sent in when format is asked for, the
+    // arguments are the ones of encode()
+    static QMACHeaderFormat formatOf(const Packet &p, bool sinkHops, bool time,
+                                     QMACHeaderFormat format);
+
+    // bytes of the frame on air with the CRC, the arguments are the ones of
+    // encode()
+    static size_t frameLength(const Packet &p, bool sinkHops, bool time,
+                              QMACHeaderFormat format);
+
+    // bytes of the bitmap in the ACK field, the base ID itself is implied
+    static byte ackBitmapSize(uint32_t ackBitmap);
+
+    // continues from initial, the CRC of the bytes in front of the data
+    static uint16_t crc(const byte *data, size_t length,
+                        uint16_t initial = 0) {
+        return CRC16Table<QMAC_CRC16_POLYNOMIAL>::compute(data, length,
+                                                          initial);
+    }
+
+    byte header[MAX_HEADER_SIZE];
+    byte headerLength = 0;
+    const byte *payload = nullptr;
+    byte payloadLength = 0;
+    byte trailer[TIME_FIELD_SIZE + CRC_SIZE];
+    byte trailerLength = 0;
+
+   private:
+    void encodeCompact(const Packet &p, bool sinkHops, bool time);
+    static bool decodeLegacy(const byte *frame, size_t length, Packet *p);
+    static bool decodeCompact(const byte *frame, size_t length, Packet *p);
+
+    QMACHeaderFormat format = QMAC_HEADER_LEGACY;
+};
+
+// States of the MAC, advanced by QMACClass::poll()
+typedef enum {
+    QMAC_SLEEP,        // waiting for the next active period
+    QMAC_SCHEDULE,     // assigning slots to the queued packets
+    QMAC_CAD,          // sensing the channel before sending in the current slot
+    QMAC_TX_SLOT,      // sending the packet of the current slot
+    QMAC_RX_WAIT,      // listening for packets and ACKs until the next slot
+    QMAC_SYNC_SEND,    // broadcasting a sync packet
+    QMAC_SYNC_LISTEN,  // collecting sync responses
+    QMAC_SYNC_PAUSE,   // radio asleep between two sync packets
+} QMACState;
+
+// What to do with a packet arriving at a full queue
+typedef enum {
+    QMAC_DROP_OLDEST,  // drop the oldest queued packet to make room
+    QMAC_DROP_NEWEST,  // drop the arriving packet
+    QMAC_REJECT,       // refuse the arriving packet, received packets are not
+                       // acknowledged so the sender retries
+} QMACOverflowPolicy;
+
+// Outcome of QMACClass::push()
+typedef enum {
+    QMAC_QUEUED,          // the packet was queued
+    QMAC_DROPPED_OLDEST,  // the packet was queued, the oldest one was dropped
+    QMAC_DROPPED_NEWEST,  // the queue is full, the packet was dropped
+    QMAC_REJECTED,        // the queue is full, the packet was not queued
+} QMACPushResult;
+
+// Priority class of a queued packet, more urgent classes are sent first
+typedef enum {
+    QMAC_PRIORITY_HIGH,    // e.g. alarms
+    QMAC_PRIORITY_NORMAL,  // default
+    QMAC_PRIORITY_LOW,     // e.g. bulk telemetry
+} QMACPriority;
+#define QMAC_NUM_PRIORITIES 3
+
+// Progress of the message passed to QMACClass::sendMessage()
+typedef enum {
+    QMAC_MESSAGE_IDLE,     // no message was sent yet
+    QMAC_MESSAGE_SENDING,  // fragments are waiting to be sent or acknowledged
+    QMAC_MESSAGE_SENT,     // all fragments were acknowledged
+    QMAC_MESSAGE_FAILED,   // a fragment was dropped, the rest was not sent
+} QMACMessageState;
+
+// Receives the fragments of messages as they arrive, instead of
+// reassembling them. offset is the position of the data in the message,
+// complete is set for the fragment which completes the message.
+typedef void (*QMACFragmentCallback)(byte source, byte messageID,
+                                     size_t offset, const byte *data,
+                                     size_t length, bool complete);
+
+// How received unicast packets are acknowledged
+typedef enum {
+    QMAC_ACK_IMMEDIATE,  // one ACK frame right after every received frame
+    QMAC_ACK_SELECTIVE,  // one ACK field for several frames of a node, sent
+                         // after a delay or along with a packet to the node
+} QMACAckMode;
+
+typedef struct {
+    uint32_t frames;       // ACK frames sent
+    uint32_t piggybacked;  // data frames sent with ACKs for their destination
+    float airtime;         // of the ACK frames, in ms
+} QMACAckStats;
+
+typedef struct {
+    uint8_t spreadingFactor;
+    long bandwidth;  // Hz
+} QMACDataRate;
+
+typedef struct {
+    uint32_t checks;     // channel activity detections before sending
+    uint32_t hits;       // of which found the channel busy
+    uint32_t deferrals;  // transmissions moved to a later slot
+    uint32_t postponed;  // transmissions moved to the next active period
+} QMACLbtStats;
+
+typedef struct {
+    uint32_t refused;          // data frames not sent because of the limit
+    uint32_t refusedPriority;  // ACK and sync frames not sent
+} QMACDutyCycleStats;
+
+typedef struct {
+    uint32_t sent;         // packets sent for the first time
+    uint32_t expired;      // packets dropped because their deadline passed
+    uint32_t meanLatency;  // ms from queueing to the first transmission
+    uint32_t maxLatency;   // ms
+} QMACClassStats;
+
+typedef struct {
+    uint32_t sent;      // messages whose fragments were all acknowledged
+    uint32_t failed;    // messages of which a fragment was dropped
+    uint32_t received;  // messages which were completely received
+    uint32_t timedOut;  // incomplete messages which were discarded
+} QMACMessageStats;
+
+typedef struct {
+    uint32_t cycles;       // synchronizations started
+    uint32_t skipped;      // periodic synchronizations the drift made obsolete
+    uint32_t corrections;  // schedule corrections from the drift estimates
+    uint32_t frames;       // sync packets sent
+    float airtime;         // of the sync packets, in ms
+} QMACSyncStats;
+
+typedef struct {
+    uint32_t periods;          // active periods
+    uint32_t shortened;        // active periods ended after the idle timeout
+    uint32_t extended;         // steps active periods were extended by
+    uint32_t radioOnTime;      // ms the radio was on in active periods
+    uint32_t lastRadioOnTime;  // ms, in the last active period
+} QMACActivityStats;
+
+typedef struct {
+    uint32_t forwarded;   // packets of other nodes queued to be forwarded
+    uint32_t duplicates;  // retransmissions of packets forwarded before
+    uint32_t hopLimit;    // packets dropped because of the hop limit
+    uint32_t noRoute;     // packets not acknowledged, no route was known
+    uint32_t disabled;    // packets not acknowledged, forwarding is disabled
+    uint32_t rejected;    // packets not acknowledged, the send queue was full
+} QMACRoutingStats;
+
+typedef struct {
+    size_t size;           // packets currently queued
+    size_t capacity;       // maximum number of queued packets
+    size_t highWaterMark;  // maximum number of packets queued at once
+    uint32_t drops;        // packets dropped or rejected because of overflow
+} QMACQueueStats;
+
+typedef struct {
+    uint32_t hits;    // received packets which were already received before
+    uint32_t misses;  // received packets which were new
+} QMACDedupStats;
+
+typedef struct {
+    uint32_t coded;         // data frames sent with a compressed payload
+    uint32_t delta;         // of which referred to the previous payload
+    uint32_t raw;           // data frames compression did not make shorter
+    uint32_t payloadBytes;  // of the data frames sent, before compression
+    uint32_t codedBytes;    // of the data frames sent, after compression
+    uint32_t decoded;       // compressed frames received
+    uint32_t failures;      // of which could not be decompressed
+    float airtimeSaved;     // ms
+} QMACCodecStats;
+
+// Bin i counts the values below unit << i, the last bin all larger ones
+typedef struct {
+    uint32_t unit;  // ms
+    uint32_t bins[QMAC_HISTOGRAM_BINS];
+} QMACHistogram;
+
+typedef struct {
+    // radio time since begin(), the four add up to the uptime
+    uint32_t uptime;     // ms
+    uint32_t rxTime;     // ms listening in active periods
+    uint32_t txTime;     // ms sending
+    uint32_t syncTime;   // ms listening for sync packets
+    uint32_t sleepTime;  // ms
+    // duty cycle window of the frequency
+    float airtime;        // ms sent within the window
+    float airtimeBudget;  // ms the window allows
+    uint32_t framesSent;      // data, ACK and sync frames
+    uint32_t framesReceived;  // frames decoded correctly
+    uint32_t crcErrors;       // frames received which could not be decoded
+    uint32_t duplicates;      // data packets which were received before
+    uint32_t retryDrops;      // packets dropped after the last retry
+    uint32_t expired;         // packets dropped because of their deadline
+    // schedule moves by synchronization or drift correction
+    uint32_t corrections;
+    int32_t lastCorrection;   // us, positive if the schedule moved later
+    uint32_t meanCorrection;  // us, of the absolute moves
+    QMACHistogram ackRtt;   // from sending a packet until its ACK
+    QMACHistogram latency;  // from queueing a packet until its ACK
+} QMACStats;
+
+// How QMACClass::dumpStats writes a statistics record
+typedef enum {
+    QMAC_STATS_CSV,     // one line of text, see QMACClass::statsCsvHeader
+    QMAC_STATS_BINARY,  // QMAC_STATS_RECORD_SIZE bytes, little-endian
+} QMACStatsFormat;
+
+// What the SoC does between active periods, see QMACClass::setLowPowerSleep
+typedef enum {
+    QMAC_STAY_AWAKE,   // the CPU keeps running, only the radio sleeps
+    QMAC_LIGHT_SLEEP,  // RAM and timers are kept
+    QMAC_DEEP_SLEEP,   // the program starts over, see QMACClass::begin
+} QMACSleepMode;
+
 class QMACClass {
    public:
     /**
@@ -66,7 +567,9 @@ class QMACClass {
      * It will try to synchronize with other devices and run until devices were
      * found. This will be run for a minimum of a cycle duration (=
      * sleepDuration + activeDuration). This function should ideally be called
-     * until it returns true.
+     * until it returns true. After a wake from deep sleep, the state retained
+     * by setLowPowerSleep() is restored instead and begin() returns true
+     * right away.
      * @param localAddress The local address of the device.
      * @return true if other nodes were reached, false otherwise.
      */
@@ -74,19 +577,69 @@ class QMACClass {
 
     /**
      * Run the QMAC protocol, handling packet transmission, synchronization and
-     * reception. Should be run frequently.
+     * reception. Should be run frequently. Blocks for the whole active period
+     * or synchronization, use poll() to interleave other work with the MAC.
+     * Between active periods, the SoC sleeps if setLowPowerSleep() is used.
      * @return true if devices are reachable, false otherwise.
      */
     bool run();
 
+    /**
+     * Advance the MAC state machine by one step without blocking. Should be
+     * called at least as often as the returned timeout demands. While
+     * listening without the receive interrupt, the radio has to be polled and
+     * 0 is returned.
+     * @return The time in milliseconds until the next deadline of the MAC.
+     */
+    uint32_t poll();
+
+    /**
+     * Get the current state of the MAC.
+     * @return The state advanced by poll().
+     */
+    QMACState getState();
+
     /**
      * Add a packet which should be sent in the next active time period.
+     * Packets are sent by priority, then by earliest deadline, then in the
+     * order they were queued.
      * @param payload The payload to be sent.
      * @param payloadSize Number of bytes set in the payload
      * @param destination The destination address of the packet.
+     * @param priority The priority class of the packet (default is
+     * QMAC_PRIORITY_NORMAL).
+     * @param ttl Milliseconds after which the packet is dropped instead of
+     * being sent or retried, 0 for no deadline (default).
+     * @return Whether the packet was queued, see setSendQueuePolicy().
      */
-    void push(byte payload[PAYLOAD_SIZE], byte payloadSize,
-              byte destination = 0xFF);
+    QMACPushResult push(const byte *payload, byte payloadSize,
+                        byte destination = 0xFF,
+                        QMACPriority priority = QMAC_PRIORITY_NORMAL,
+                        uint32_t ttl = 0);
+
+    /**
+     * Reserve a packet in the send queue, so the payload can be written in
+     * place instead of being copied by push(). Only one packet can be
+     * reserved at a time, reserving again returns the same buffer.
+     * @param destination The destination address of the packet.
+     * @param priority The priority class of the packet (default is
+     * QMAC_PRIORITY_NORMAL).
+     * @param ttl Milliseconds after which the packet is dropped, 0 for never
+     * (default), see push().
+     * @return A buffer of PAYLOAD_SIZE bytes for the payload, or nullptr if
+     * the send queue is full and the policy keeps the queued packets.
+     */
+    byte *reserve(byte destination = 0xFF,
+                  QMACPriority priority = QMAC_PRIORITY_NORMAL,
+                  uint32_t ttl = 0);
+
+    /**
+     * Queue the packet reserved with reserve().
+     * @param payloadSize Number of bytes written to the reserved buffer.
+     * @return QMAC_DROPPED_OLDEST if reserve() dropped a queued packet,
+     * QMAC_REJECTED if nothing was reserved, QMAC_QUEUED otherwise.
+     */
+    QMACPushResult commit(byte payloadSize);
 
     /**
      * Get the number of packets which were succesfully sent to this device.
@@ -100,6 +653,91 @@ class QMACClass {
      */
     Packet pop();
 
+    /**
+     * Remove a packet from the reception queue and copy it into the given
+     * packet. Only the used part of the payload is copied.
+     * @param p The packet to write to.
+     * @return false if the reception queue is empty.
+     */
+    bool popInto(Packet &p);
+
+    /**
+     * Get the packet at the front of the reception queue without copying it.
+     * The packet stays valid until release() is called.
+     * @return The packet at the front of the reception queue, or nullptr if
+     * the queue is empty.
+     */
+    const Packet *peek();
+
+    /**
+     * Remove the packet returned by peek() from the reception queue.
+     */
+    void release();
+
+    /**
+     * Send a message of up to MAX_MESSAGE_SIZE bytes, split into fragments
+     * which are acknowledged and retried separately. The message is not
+     * copied, it must stay unchanged while it is being sent. Only one message
+     * is sent at a time, at most QMAC_FRAGMENT_WINDOW of its fragments are
+     * queued at once.
+     * @param message The message to be sent.
+     * @param length The length of the message.
+     * @param destination The destination address of the message.
+     * @param priority The priority class of the fragments (default is
+     * QMAC_PRIORITY_NORMAL).
+     * @param ttl Milliseconds after which the message fails if it was not
+     * sent, 0 for no deadline (default).
+     * @return false if a message is still being sent or the message is too
+     * long, true otherwise.
+     */
+    bool sendMessage(const byte *message, size_t length,
+                     byte destination = 0xFF,
+                     QMACPriority priority = QMAC_PRIORITY_NORMAL,
+                     uint32_t ttl = 0);
+
+    /**
+     * Get the progress of the last message passed to sendMessage().
+     * @return The state of the message.
+     */
+    QMACMessageState messageState();
+
+    /**
+     * Get a completely received message without copying it. Messages of up
+     * to QMAC_REASSEMBLY_SIZE bytes are reassembled unless a fragment
+     * callback is set. The message stays valid until releaseMessage() is
+     * called.
+     * @param length Set to the length of the message.
+     * @param source Set to the address of the sender if not nullptr.
+     * @return The message, or nullptr if no message was received.
+     */
+    const byte *peekMessage(size_t *length, byte *source = nullptr);
+
+    /**
+     * Discard the message returned by peekMessage().
+     */
+    void releaseMessage();
+
+    /**
+     * Pass the fragments of received messages to a callback as they arrive
+     * instead of reassembling them, so messages of any size can be received.
+     * @param callback The function to call, nullptr to reassemble messages
+     * (default).
+     */
+    void setFragmentCallback(QMACFragmentCallback callback = nullptr);
+
+    /**
+     * Set how long an incomplete message is kept after its last fragment
+     * arrived.
+     * @param timeout The timeout in milliseconds (default is 300000).
+     */
+    void setReassemblyTimeout(uint32_t timeout = 300000);
+
+    /**
+     * Get how many messages were sent and received since begin().
+     * @return The message statistics.
+     */
+    QMACMessageStats messageStats();
+
     /**
      * Check if the device is currently sending or receiving packets.
      * @return true if active, false otherwise.
@@ -107,7 +745,10 @@ class QMACClass {
     boolean isActive();
 
     /**
-     * Set the duration where the LoRa module is inactive.
+     * Set the duration where the LoRa module is inactive. Sync packets in
+     * the legacy header carry the time within a cycle in 16 bits of ms, so
+     * with it a cycle of sleeping and active duration may take up to 65535
+     * ms.
      * @param duration The sleeping duration in milliseconds (default is 60000).
      */
     void setSleepingDuration(uint64_t duration = 60000);
@@ -145,32 +786,782 @@ class QMACClass {
      * Get the next active time based on the current timer and durations.
      * @return The next active time in milliseconds.
      */
-    uint16_t nextActiveTime();
+    uint32_t nextActiveTime();
+
+    /**
+     * Receive packets through the DIO0 RxDone interrupt instead of polling the
+     * radio. While waiting for the next slot or packet the CPU is blocked.
+     * Must be called before begin().
+     * @param enabled true to use the interrupt (default), false to poll.
+     */
+    void setInterruptReceive(bool enabled = true);
+
+    /**
+     * Put the SoC to sleep in run() between active periods, woken by a timer
+     * the wake margin before the next one. In deep sleep the program starts
+     * over: the schedule, the address, the packet ID counters, the duty
+     * cycle budget, the recently received IDs and the queued packets are
+     * kept in memory retained by QMACPlatform, as far as they fit, and
+     * begin() restores them without synchronizing. Drift estimates and link
+     * statistics are lost. While a message is sent or received packets are
+     * waiting to be popped, light sleep is used instead. Must be called
+     * before begin().
+     * @param mode What the SoC does between active periods (default is
+     * QMAC_LIGHT_SLEEP).
+     * @param wakeMargin The milliseconds the SoC wakes up before the next
+     * active period, e.g. to boot after deep sleep (default is 10).
+     */
+    void setLowPowerSleep(QMACSleepMode mode = QMAC_LIGHT_SLEEP,
+                          uint32_t wakeMargin = 10);
+
+    /**
+     * Get the time the CPU was busy during the last active period or
+     * synchronization, i.e. without the time spent waiting for radio events.
+     * @return The busy time in microseconds.
+     */
+    uint64_t lastCycleBusyTime();
+
+    /**
+     * Get the time the CPU was busy in active periods and synchronizations
+     * since begin().
+     * @return The busy time in microseconds.
+     */
+    uint64_t busyTime();
+
+    /**
+     * Set what push() does when QMAC_SEND_QUEUE_SIZE packets are waiting to be
+     * sent or acknowledged. QMAC_DROP_OLDEST drops the oldest packet of the
+     * lowest priority class, but never one more urgent than the new packet.
+     * @param policy The overflow policy (default is QMAC_REJECT).
+     */
+    void setSendQueuePolicy(QMACOverflowPolicy policy = QMAC_REJECT);
+
+    /**
+     * Set what happens to packets received while QMAC_RECEPTION_QUEUE_SIZE
+     * packets are waiting to be popped.
+     * @param policy The overflow policy (default is QMAC_REJECT).
+     */
+    void setReceptionQueuePolicy(QMACOverflowPolicy policy = QMAC_REJECT);
+
+    /**
+     * Get the fill level and overflow counters of the send queue, including
+     * packets waiting for an ACK.
+     * @return The send queue statistics.
+     */
+    QMACQueueStats sendQueueStats();
+
+    /**
+     * Get the fill level and overflow counters of the reception queue.
+     * @return The reception queue statistics.
+     */
+    QMACQueueStats receptionQueueStats();
+
+    /**
+     * Get how many received data packets were recognized as duplicates, e.g.
+     * retransmissions after a lost ACK.
+     * @return The duplicate detection statistics.
+     */
+    QMACDedupStats dedupStats();
+
+    /**
+     * Get the number of packets sent to a node in the current active period
+     * which are waiting for an ACK.
+     * @param destination The address of the node.
+     * @return The number of outstanding packets.
+     */
+    uint8_t outstandingPackets(byte destination);
+
+    /**
+     * Get the smoothed time from starting to send a packet to a node until
+     * its ACK is received.
+     * @param destination The address of the node.
+     * @return The round trip time in microseconds, 0 if no ACK was received
+     * from the node yet.
+     */
+    uint32_t roundTripTime(byte destination);
+
+    /**
+     * Send packets for the same destination which are queued at the same time
+     * in one frame, to save the airtime of the preamble and headers.
+     * Disabled by default.
+     * @param enabled true to aggregate packets (default), false otherwise.
+     */
+    void setAggregation(bool enabled = true);
+
+    /**
+     * Get the airtime saved by aggregating packets during the last active
+     * period.
+     * @return The saved airtime in milliseconds.
+     */
+    float lastCycleAirtimeSaved();
+
+    /**
+     * Get the airtime saved by aggregating packets since begin().
+     * @return The saved airtime in milliseconds.
+     */
+    float airtimeSaved();
+
+    /**
+     * Set how received packets are acknowledged. With selective ACKs, the IDs
+     * received from a node are collected and acknowledged together in one
+     * frame after the ACK delay, or in the next packet sent to that node.
+     * This saves ACK frames if nodes send several frames to each other in one
+     * active period, but a sender misses the ACKs if its active period ends
+     * earlier than expected. Frames of both modes are understood regardless
+     * of the setting.
+     * @param mode The ACK mode (default is QMAC_ACK_IMMEDIATE).
+     */
+    void setAckMode(QMACAckMode mode = QMAC_ACK_IMMEDIATE);
+
+    /**
+     * Set how long selective ACKs for a node are collected before they are
+     * sent on their own. The delay is rounded down to whole slots and cut
+     * short at the end of the active period.
+     * @param delay The delay in milliseconds (default is 1000).
+     */
+    void setAckDelay(uint32_t delay = 1000);
+
+    /**
+     * Get how many ACK frames were sent since begin() and how many data
+     * frames carried ACKs instead.
+     * @return The ACK statistics.
+     */
+    QMACAckStats ackStats();
+
+    /**
+     * Sense the channel with Channel Activity Detection before sending in a
+     * slot. If another transmission is detected, the slot is moved back by a
+     * random number of slots up to QMAC_LBT_MAX_BACKOFF, or to the next active
+     * period if it would end before. Requires the receive interrupt, see
+     * setInterruptReceive(). Must be called before begin().
+     * @param enabled true to listen before talk (default), false otherwise.
+     */
+    void setListenBeforeTalk(bool enabled = true);
+
+    /**
+     * Get how often the channel was sensed before sending and found busy.
+     * @return The listen before talk statistics.
+     */
+    QMACLbtStats lbtStats();
+
+    /**
+     * Set the data rate all nodes listen on. It is used for broadcasts, sync
+     * packets and ACKs, and for packets whenever no faster data rate is
+     * chosen. The radio is configured in begin().
+     * @param spreadingFactor The spreading factor, 7 to 12 (default is 7).
+     * @param bandwidth The bandwidth in Hz (default is 125E3).
+     */
+    void setBaseDataRate(uint8_t spreadingFactor = 7, long bandwidth = 125E3);
+
+    /**
+     * Send unicast frames at the fastest data rate the SNR of the link to the
+     * destination allows, with at most the base spreading factor. The
+     * destination is told to switch by a follow frame at the base data rate,
+     * so a faster data rate is only used if it saves airtime including that
+     * frame. Packets which were not acknowledged at a faster data rate make
+     * the choice more careful for that destination.
+     * @param enabled true to adapt the data rate (default), false to always
+     * use the base data rate.
+     * @param margin The SNR in dB required above the demodulation limit
+     * (default is 5).
+     * @param maxBandwidth The widest bandwidth in Hz to use, at most 4 times
+     * the base bandwidth, 0 for the base bandwidth only (default).
+     */
+    void setAdaptiveDataRate(bool enabled = true, float margin = 5,
+                             long maxBandwidth = 0);
+
+    /**
+     * Get the data rate a full frame to a node would be sent with.
+     * @param destination The address of the node.
+     * @return The data rate.
+     */
+    QMACDataRate dataRate(byte destination);
+
+    /**
+     * Get the smoothed SNR of the frames received from a node.
+     * @param address The address of the node.
+     * @return The SNR in dB for the base bandwidth, NAN if no frame was
+     * received from the node.
+     */
+    float linkSnr(byte address);
+
+    /**
+     * Get the smoothed RSSI of the frames received from a node.
+     * @param address The address of the node.
+     * @return The RSSI in dBm, 0 if no frame was received from the node.
+     */
+    int linkRssi(byte address);
+
+    /**
+     * Set the frequency the radio was started with. It selects the duty
+     * cycle limit of the sub-band: 1% for 863-868.6 and 869.7-870 MHz, 0.1%
+     * for 868.7-869.2 MHz, 10% for 869.4-869.65 MHz and 1% elsewhere.
+     * @param frequency The frequency in Hz (default is 868E6).
+     */
+    void setFrequency(long frequency = 868E6);
+
+    /**
+     * Set how the duty cycle is enforced. A sub-band may use its duty cycle of
+     * every sliding window, and at most the airtime earned in the burst time
+     * at once. ACK and sync frames may use a reserved share of that airtime,
+     * data frames only what is left over. Must be called before begin().
+     * @param window The sliding window in seconds (default is 3600).
+     * @param burst The burst time in seconds (default is 360).
+     * @param reserve The share reserved for ACK and sync frames (default is
+     * 0.2).
+     */
+    void setDutyCycle(uint32_t window = 3600, uint32_t burst = 360,
+                      float reserve = 0.2);
+
+    /**
+     * Get when a data frame could be sent according to the duty cycle.
+     * @param payloadLength The payload size of the frame.
+     * @return The time in milliseconds until it may be sent, 0 if now,
+     * UINT32_MAX if it never fits the limits.
+     */
+    uint32_t sendDelay(byte payloadLength);
+
+    /**
+     * Get how many frames the duty cycle limit kept from being sent.
+     * @return The duty cycle statistics.
+     */
+    QMACDutyCycleStats dutyCycleStats();
+
+    /**
+     * Get how long the packets of a priority class were queued before they
+     * were sent, and how many of them expired.
+     * @param priority The priority class.
+     * @return The statistics of the class since begin().
+     */
+    QMACClassStats classStats(QMACPriority priority);
+
+    /**
+     * Forward packets over several hops. Routes are learned from the frames
+     * of neighbors, from the origin of forwarded frames and, towards the sink,
+     * from the hops to the sink which forwarding nodes add to their sync
+     * packets. Nodes not forwarding drop those sync packets, so all nodes of
+     * a network should forward. A packet for a node which is reached through
+     * a neighbor is sent to that neighbor, every hop acknowledges it and
+     * queues it for its next active period. A hop which has no route or does
+     * not forward does not acknowledge the packet, so the previous hop
+     * retries and reports it as failed. Packets are not acknowledged end to
+     * end.
+     * @param enabled true to forward packets (default), false otherwise.
+     * @param sink The address of the gateway the network sends to, BCADDR if
+     * there is none (default).
+     * @param maxHops The hops after which a packet is dropped (default is 4).
+     */
+    void setForwarding(bool enabled = true, byte sink = BCADDR,
+                       uint8_t maxHops = 4);
+
+    /**
+     * Get the neighbor packets for a node are sent to.
+     * @param destination The address of the node.
+     * @param hops Set to the hops to the node if not nullptr.
+     * @return The address of the neighbor, destination itself if there is no
+     * route through another node.
+     */
+    byte nextHop(byte destination, uint8_t *hops = nullptr);
+
+    /**
+     * Get how many packets of other nodes were forwarded or dropped.
+     * @return The routing statistics since begin().
+     */
+    QMACRoutingStats routingStats();
+
+    /**
+     * Estimate the drift of every neighbor's schedule and follow it instead
+     * of synchronizing periodically. All frames carry the time until the
+     * next active period of their sender then, which costs 4 bytes, and a
+     * line is fitted to the offsets of the last QMAC_DRIFT_SAMPLES of them.
+     * At the end of every active period the schedule is moved halfway
+     * towards the offset the neighbors are predicted to have, so nodes which
+     * all do so converge. The periodic synchronization only runs if the
+     * predicted error of an estimate exceeds the guard time. Nodes without
+     * drift correction do not understand these frames, so all nodes of a
+     * network should enable it.
+     * @param enabled true to correct the drift (default), false otherwise.
+     * @param guardTime The predicted error in milliseconds which is tolerated
+     * without synchronizing (default is 50).
+     */
+    void setDriftCorrection(bool enabled = true, uint32_t guardTime = 50);
+
+    /**
+     * Get how fast the schedule of a neighbor drifts against the own one.
+     * @param address The address of the neighbor.
+     * @return The drift in ppm, positive if the neighbor is late more and
+     * more, NAN if there are not enough offsets of the neighbor.
+     */
+    float clockDrift(byte address);
+
+    /**
+     * Get how often the MAC synchronized and corrected its schedule.
+     * @return The synchronization statistics since begin().
+     */
+    QMACSyncStats syncStats();
+
+    /**
+     * Adapt the active period to the traffic, as T-MAC does. Every packet
+     * contends for a slot within the idle timeout after the previous one,
+     * and the radio sleeps as soon as the own slots are over and nothing
+     * was sent or received for the idle timeout. A node with more packets
+     * queued sets QMAC_FLAG_MORE, its receivers then stay awake for another
+     * idle timeout. When packets are left over at the end of the period,
+     * the sender and the receivers extend it to one step from now, at most
+     * maxSteps times per period. The extension is taken from the following
+     * sleep, so the schedule stays the same. All nodes of a network should
+     * use the same setting.
+     * @param enabled true to adapt the active period (default), false to
+     * always stay active for the active duration.
+     * @param idleTimeout The milliseconds without activity after which the
+     * radio sleeps (default is 500).
+     * @param step The milliseconds an extension lasts (default is 1000).
+     * @param maxSteps The extensions per active period, limited so they fit
+     * into the sleep duration (default is 4).
+     */
+    void setAdaptiveActivePeriod(bool enabled = true,
+                                 uint32_t idleTimeout = 500,
+                                 uint32_t step = 1000, uint8_t maxSteps = 4);
+
+    /**
+     * Get how long the radio was on in the active periods and how often they
+     * were shortened or extended.
+     * @return The activity statistics since begin().
+     */
+    QMACActivityStats activityStats();
+
+    /**
+     * Compress the payloads of data frames to save airtime. The payload is
+     * passed through a difference to the previous payload acknowledged by
+     * the destination, a varint packing of its 32-bit words and an LZ
+     * compressor, and the combination which makes it the shortest is sent
+     * with QMAC_FLAG_CODED. Payloads no combination makes shorter are sent as
+     * they are. Only the first transmission of a packet to a node without
+     * outstanding packets refers to the previous payload, which the node
+     * keeps along with the one before. The payloads are kept for
+     * QMAC_CODEC_REFERENCES nodes and not in deep sleep. Compressed frames
+     * are understood regardless of the setting, but a node without it
+     * enabled does not keep the payloads it received, so the frames which
+     * refer to them are retransmitted without.
+     * @param enabled true to compress payloads (default), false otherwise.
+     */
+    void setCompression(bool enabled = true);
+
+    /**
+     * Get how many frames were sent compressed and how much airtime that
+     * saved.
+     * @return The compression statistics since begin().
+     */
+    QMACCodecStats codecStats();
+
+    /**
+     * Set the header format of the frames sent. The legacy header, which is
+     * used until this is called, is the one of the baseline QMAC, so its
+     * nodes receive the frames. It has no flags, so a frame which needs any,
+     * e.g. with aggregation, fragments, compression, forwarding, selective
+     * ACKs or drift correction enabled, is sent in the compact header
+     * anyway. The compact header is versioned, carries the frame type
+     * explicitly and 16-bit packet IDs, so a node which missed the last few
+     * hundred packets of a sender does not take a new one for a
+     * retransmission. It is 1 byte longer than the legacy header, 2 or 3
+     * with optional fields. Both formats are received regardless of the
+     * setting, so a fleet is switched once every node runs a version which
+     * receives the compact header.
+     * @param format The header format (default is QMAC_HEADER_COMPACT).
+     */
+    void setHeaderFormat(QMACHeaderFormat format = QMAC_HEADER_COMPACT);
+
+    /**
+     * Get a snapshot of the statistics of the MAC, such as how long the
+     * radio was in which state, the frames sent and received, and the ACK
+     * round trip times. They are collected in any build.
+     * @return The statistics since begin().
+     */
+    QMACStats stats();
+
+    /**
+     * Write a snapshot of the statistics into a buffer, e.g. to send it over
+     * the serial port. The binary record starts with QMAC_STATS_VERSION and
+     * a reserved byte, followed by the fields of QMACStats in their order as
+     * 32 bit integers, the airtimes rounded to ms, and the unit and the bins
+     * of each histogram. The CSV line ends with a newline, it is not null
+     * terminated.
+     * @param buffer The buffer to write into.
+     * @param size The size of the buffer.
+     * @param format The format of the record (default is QMAC_STATS_CSV).
+     * @return The bytes written, 0 if the buffer is too small.
+     */
+    size_t dumpStats(byte *buffer, size_t size,
+                     QMACStatsFormat format = QMAC_STATS_CSV);
+
+    /**
+     * Get the names of the columns of the CSV records written by dumpStats(),
+     * terminated by a newline.
+     * @return The header line.
+     */
+    static const char *statsCsvHeader();
 
     byte localAddress;
 
+    // Instance receiving the radio interrupts, there is only one radio
+    static QMACClass *receiver;
+
    private:
-    bool synchronize();
-    void updateTimer(uint64_t timeUntilActive);
-    bool sendAck(Packet p);
+    // host benchmarks of the steps run() takes per frame, see bench/
+    friend struct QMACBench;
+
+    typedef struct {
+        byte length;
+        int16_t rssi;
+        float snr;
+        int64_t time;  // us, of the RxDone interrupt
+        byte data[MAX_FRAME_SIZE];
+    } RawFrame;
+    typedef struct {
+        byte address;
+        uint32_t nextActiveTime;  // us
+        int64_t sent;             // us, when the response started
+    } SyncResponse;
+    typedef struct {
+        uint8_t outstanding;     // packets waiting for an ACK
+        uint16_t periodSent;     // packets sent in the current active period
+        uint16_t periodAcked;    // of which an ACK was received
+        uint32_t roundTripTime;  // smoothed, in us, 0 before the first ACK
+        // selective ACK waiting to be sent to the node, none if ackBitmap is 0
+        uint16_t ackBase;
+        uint32_t ackBitmap;
+        int64_t ackDue;  // ms
+        // link quality of the frames received from the node
+        uint8_t linkSamples;
+        float snr;  // dB, smoothed, for the base bandwidth
+        float rssi;  // dBm, smoothed
+        float adrPenalty;  // dB
+        bool adaptiveSent;  // a faster data rate was used in this period
+        // offsets of the node's schedule against the own one without the
+        // drift corrections, oldest first from nextOffset
+        uint8_t offsets;
+        uint8_t nextOffset;
+        int64_t offsetTime[QMAC_DRIFT_SAMPLES];  // ms
+        float offset[QMAC_DRIFT_SAMPLES];        // ms
+        // line fitted to the offsets
+        float driftOffset;    // ms, at the time of the newest offset
+        float driftRate;      // ms per ms
+        float driftResidual;  // ms, RMS
+    } Neighbor;
+    typedef struct {
+        int64_t sentTime;  // us
+        bool awaitingAck;
+        uint16_t frameID;     // ID of the frame the packet was sent in
+        uint8_t nextInFrame;  // slot of the next packet in the frame, or
+                              // NO_SLOT
+        // queueing
+        uint8_t priority;
+        int64_t queuedTime;  // ms
+        int64_t deadline;    // ms, INT64_MAX if none
+        bool fragment;       // of the outgoing message
+    } InFlight;
+    // State kept in deep sleep, followed by the queued packets
+    typedef struct {
+        uint32_t magic;      // RETAINED_MAGIC while the state is valid
+        int64_t savedAt;     // us, esp_timer time when it was saved
+        int64_t savedClock;  // us, QMACPlatform::retainedTime() then
+        int64_t nextActive;  // us from savedAt until the next active period
+        byte localAddress;
+        uint16_t msgCount;
+        byte messageCount;
+        uint8_t periodsSinceSync;
+        uint8_t numPackets;
+        DutyCycleRegulator<QMAC_DUTY_CYCLE_INTERVALS> dutyCycle;
+        DuplicateFilter<QMAC_DEDUP_SOURCES> receivedPackets;
+    } Retained;
+    // followed by the packet up to the end of its payload
+    typedef struct {
+        uint8_t priority;
+        bool sent;
+        uint16_t sendRetryCount;
+        int64_t queuedTime;  // ms
+        int64_t deadline;    // ms
+    } RetainedPacket;
+    // QMAC_DUTY_CYCLE_INTERVALS and QMAC_DEDUP_SOURCES take most of the
+    // retained memory, the rest holds the queued packets, 4 to 5 of full
+    // length with the defaults. Raising either macro retains fewer.
+    static_assert(sizeof(Retained) + sizeof(RetainedPacket) +
+                          offsetof(Packet, payload) <=
+                      QMAC_RETAINED_MEMORY,
+                  "QMAC_RETAINED_MEMORY does not hold the retained state and "
+                  "a packet, raise it or lower QMAC_DUTY_CYCLE_INTERVALS or "
+                  "QMAC_DEDUP_SOURCES");
+    typedef struct {
+        byte nextHop;
+        uint8_t hops;
+        int64_t updated;  // ms, when the route was last confirmed
+    } Route;
+    typedef struct {
+        const byte *data;  // nullptr if no message is being sent
+        size_t length;
+        byte destination;
+        byte messageID;
+        uint8_t count;      // fragments
+        uint8_t next;       // index of the next fragment to queue
+        uint8_t queued;     // fragments in the send pool
+        uint8_t delivered;  // fragments acknowledged, or sent if broadcast
+        bool failed;
+        QMACPriority priority;
+        int64_t deadline;  // ms
+    } OutgoingMessage;
+    typedef struct {
+        bool used;
+        bool complete;
+        byte source;
+        byte messageID;
+        uint8_t count;     // fragments
+        uint8_t received;  // distinct fragments
+        uint32_t receivedFragments[8];  // bitmap by index
+        size_t length;     // known once the last fragment arrived
+        int64_t updated;   // ms, when the last fragment arrived
+        byte data[QMAC_REASSEMBLY_SIZE];
+    } Reassembly;
+    typedef struct {
+        // payload of the last frame of one packet the node acknowledged
+        byte sentID;
+        byte sentLength;  // 0 if none
+        byte sent[PAYLOAD_SIZE];
+        // payloads of the last frames received from the node, by ID
+        uint8_t newest;
+        byte receivedID[CODEC_RECEIVED_PAYLOADS];
+        byte receivedLength[CODEC_RECEIVED_PAYLOADS];  // 0 if none
+        byte received[CODEC_RECEIVED_PAYLOADS][PAYLOAD_SIZE];
+    } CodecReference;
+    bool runUntilSleep();
+    uint32_t sleeping();
+    uint32_t scheduling();
+    uint32_t sensingChannel();
+    void deferSlot();
+    uint32_t sendingSlot();
+    uint32_t listening();
+    void handlePacket(Packet &p);
+    bool enqueueReceived(const Packet &p);
+    bool enqueueRecords(const Packet &frame);
+    bool reassemble(const Packet &p);
+    Reassembly *findReassembly(byte source, byte messageID, uint8_t count);
+    void expireReassemblies();
+    void queueFragments();
+    bool forward(const Packet &p);
+    void route(Packet &p);
+    const Route *findRoute(byte destination);
+    void learnRoute(byte destination, byte via, uint8_t hops);
+    void learnRoutes(const Packet &p);
+    uint8_t sinkHops();
+    void sampleOffset(byte source, uint32_t nextActiveTime, int64_t sent);
+    void fitDrift(Neighbor &n);
+    bool driftPredicted();
+    void correctDrift();
+    int allocateReceptionSlot(bool *rejected);
+    Packet &aggregate(uint8_t index);
+    Packet &receiveBuffer();
+    int allocateSendSlot(QMACPushResult *result, QMACPriority priority);
+    void enqueueSendSlot(uint8_t index, byte payloadSize);
+    bool moreUrgent(uint8_t a, uint8_t b);
+    void queueInOrder(uint8_t index);
+    bool dropIfExpired(uint8_t index, int64_t now);
+    void dropExpired();
+    bool dropOldestUnsent(QMACPriority priority);
+    void releaseSendSlot(uint8_t index, bool delivered = false);
+    void acknowledge(byte source, uint16_t id, QMACHeaderFormat format);
+    void queueAck(byte source, uint16_t id);
+    bool attachAcks(Packet &frame);
+    void sendDueAcks();
+    bool sendSelectiveAck(byte destination, Neighbor &n);
+    void stopWaitingForAck(uint8_t index);
+    QMACDataRate selectDataRate(byte destination, size_t length);
+    bool sendAtDataRate(const Packet &frame, QMACDataRate rate);
+    void follow(const Packet &p);
+    void setRadioDataRate(QMACDataRate rate);
+    void trackLink(byte source, int rssi, float snr);
+    const Packet &compress(const Packet &frame);
+    bool decompress(Packet &p);
+    void keepReceivedPayload(const Packet &p);
+    float getAirTime(const Packet &p);
+    int periodSlots();
+    void assignSlots(int first);
+    bool backlogged();
+    bool reserveStep();
+    void noteActivity();
+    bool idle();
+    void sleepEarly();
+    void accountTime(int64_t now);
+    void finishActivePeriod();
+    void powerDown();
+    bool retainState(int64_t now);
+    bool restoreState();
+    void startSync(bool periodic);
+    uint32_t sendingSync();
+    uint32_t listeningSync();
+    uint32_t pausingSync();
+    void finishSync();
+    int64_t nextActiveMicros(int64_t at);
+    int64_t maxSilence();
+    void updateTimer(int64_t timeUntilActive);
+    bool sendAck(byte destination, uint16_t id);
     bool sendSyncPacket(byte destination);
-    bool send(Packet p);
+    bool send(const Packet &p);
     bool receive(Packet *p);
+    static void onReceiveISR(int packetSize);
+    static void onCadDoneISR(boolean detected);
     static void timerCallback(void *arg);
-    esp_timer_handle_t timer_handle;
-    List<Packet> receptionQueue;
-    List<Packet> sendQueue;
-    List<Packet> resendQueue;
-    double availableAirtime;
-    double availableAirtimePerCycle;
+    esp_timer_handle_t timer_handle = nullptr;
+    // Packets are stored in fixed pools, queues hold indices into the pools
+    Pool<Packet, QMAC_SEND_QUEUE_SIZE> sendPool;
+    Pool<Packet, QMAC_RECEPTION_QUEUE_SIZE> receptionPool;
+    RingBuffer<uint8_t, QMAC_RECEPTION_QUEUE_SIZE> receptionQueue;
+    RingBuffer<uint8_t, QMAC_SEND_QUEUE_SIZE> sendQueue;
+    // packets sent in the current active period which are waiting for an ACK
+    // or failed to be sent
+    IndexList<QMAC_SEND_QUEUE_SIZE> resendQueue;
+    // in-flight table, the packets in the send pool are found by their ID
+    // which is unique among them. ACKs are matched in O(1)
+    InFlight inFlight[QMAC_SEND_QUEUE_SIZE] = {};
+    // Send pool slot + 1 of the packet whose ID ends with the index, 0 if
+    // none. Keyed by the ID alone rather than by destination and ID: all
+    // packets of the node take their ID from msgCount, so the IDs form one
+    // space for all destinations, and enqueueSendSlot() skips low bytes
+    // still in use, as the legacy header only carries those. This limits
+    // the send queue to 255 packets, which the Pool enforces. An ACK has to
+    // come from the destination of the packet, acknowledge() checks that.
+    uint8_t sendSlotOfID[256] = {};
+    NeighborTable<Neighbor, QMAC_MAX_NEIGHBORS> neighbors;
+    // aggregation
+    static const uint8_t NO_SLOT = 0xFF;
+    bool aggregation = false;
+    Packet aggregateFrame;
+    float cycleAirtimeSaved = 0;
+    float lastAirtimeSaved = 0;
+    float totalAirtimeSaved = 0;
+    // selective ACKs
+    QMACAckMode ackMode = QMAC_ACK_IMMEDIATE;
+    uint32_t ackDelay = 1000;
+    int64_t nextAckDue = INT64_MAX;  // ms, earliest ackDue of all neighbors
+    QMACAckStats acks = {};
+    QMACOverflowPolicy sendQueuePolicy = QMAC_REJECT;
+    QMACOverflowPolicy receptionQueuePolicy = QMAC_REJECT;
+    uint32_t sendQueueDrops = 0;
+    uint32_t receptionQueueDrops = 0;
+    // priority classes
+    QMACClassStats classes[QMAC_NUM_PRIORITIES] = {};
+    uint64_t classLatencySum[QMAC_NUM_PRIORITIES] = {};
+    // fragmentation
+    OutgoingMessage outgoing = {};
+    QMACMessageState outgoingState = QMAC_MESSAGE_IDLE;
+    byte messageCount = 0;
+    Reassembly reassemblies[QMAC_REASSEMBLY_SLOTS] = {};
+    QMACFragmentCallback fragmentCallback = nullptr;
+    uint32_t reassemblyTimeout = 300000;
+    QMACMessageStats messages = {};
+    // forwarding
+    bool forwarding = false;
+    byte sink = BCADDR;
+    uint8_t maxHops = 4;
+    NeighborTable<Route, QMAC_ROUTES> routes;
+    // origin and origin ID of the packets forwarded
+    DuplicateFilter<QMAC_DEDUP_SOURCES> forwardedPackets;
+    QMACRoutingStats routing = {};
+    // drift correction
+    bool driftCorrection = false;
+    uint32_t guardTime = 50;
+    float scheduleShift = 0;  // ms, all corrections so far
+    int64_t scheduleMoved = 0;  // ms, when the last correction was made
+    QMACSyncStats syncs = {};
+    // adaptive active period
+    bool adaptiveActivePeriod = false;
+    uint32_t idleTimeout = 500;
+    uint32_t extensionStep = 1000;
+    uint8_t maxExtensions = 4;
+    uint8_t extensions = 0;  // in the current active period
+    // us the current active period was extended by, the following sleep is
+    // shorter by as much
+    int64_t extension = 0;
+    int64_t lastActivity = 0;  // ms, of the last frame sent or received
+    QMACActivityStats activity = {};
+    // compression
+    bool compression = false;
+    PayloadCodec<PAYLOAD_SIZE> codec;
+    NeighborTable<CodecReference, QMAC_CODEC_REFERENCES> codecReferences;
+    Packet codedFrame;
+    QMACCodecStats codecCounters = {};
+    QMACHeaderFormat headerFormat = QMAC_HEADER_LEGACY;
+    // statistics, see stats()
+    QMACStats counters = {};
+    int64_t accountedTime = 0;  // us, up to which the radio time is counted
+    int64_t txTime = 0;         // us, sending
+    int64_t txAccounted = 0;    // us, of txTime already taken from a state
+    uint64_t rxTime = 0;        // us
+    uint64_t syncTime = 0;      // us
+    uint64_t sleepTime = 0;     // us
+    uint64_t correctionSum = 0;  // us, of the absolute moves
+    // slot reserved by reserve()
+    int reservedSlot = -1;
+    QMACPushResult reservedResult = QMAC_QUEUED;
+    // frames are decoded into a free reception slot, so new data packets are
+    // queued without copying. rxPacket is used when the reception pool is full
+    int rxSlot = -1;
+    Packet rxPacket;
+    DuplicateFilter<QMAC_DEDUP_SOURCES> receivedPackets;
+    QMACDedupStats dedup = {};
+    DutyCycleRegulator<QMAC_DUTY_CYCLE_INTERVALS> dutyCycle;
+    long frequency = 868E6;
+    QMACDutyCycleStats dutyCycleRefusals = {};
     uint64_t sleepDuration = 60000;
     uint64_t activeDuration = 5000;
-    byte msgCount = 1;
+    uint16_t msgCount = 1;
     uint8_t periodsUntilSync = 50;
     uint8_t periodsSinceSync = 0;
     uint16_t maxPacketResendTries = 3;
     bool active = true;
     float unackedPacketThreshold = 0.8;
+    bool interruptReceive = false;
+    QMACSleepMode sleepMode = QMAC_STAY_AWAKE;
+    uint32_t wakeMargin = 10;
+    RawFrame rxFrames[QMAC_RX_FRAMES];
+    volatile uint8_t rxHead = 0;
+    volatile uint8_t rxTail = 0;
+    // us, when the last received frame started, from its RxDone time
+    int64_t frameStart = 0;
+    // us from the time stamp of a frame to the start of its transmission,
+    // measured at TxDone
+    uint32_t txStartDelay = 0;
+    QMACState state = QMAC_SLEEP;
+    bool cycleResult = true;
+    uint64_t cycleBusyTime = 0;
+    // active period
+    int activeSlots[QMAC_SEND_QUEUE_SIZE];
+    size_t numPacketsReady = 0;
+    size_t slotIndex = 0;
+    int64_t activeStartTime = 0;
+    bool receivedSync = false;
+    // listen before talk
+    bool listenBeforeTalk = false;
+    uint8_t slotJitter = 0;  // ms after the start of the slot to sense at
+    int64_t cadStartTime = 0;
+    volatile bool cadDone = false;
+    volatile bool cadDetected = false;
+    QMACLbtStats lbt = {};
+    // adaptive data rate
+    QMACDataRate baseRate = {7, 125000};
+    QMACDataRate radioRate = {7, 125000};  // the radio is configured with
+    int64_t rateUntil = 0;  // ms, when to return to the base data rate, 0 if
+                            // the radio is at the base data rate
+    bool adaptiveDataRate = false;
+    float adrMargin = 5;
+    long adrMaxBandwidth = 0;
+    // synchronization
+    bool periodicSync = false;
+    uint64_t syncStartTime = 0;
+    uint64_t syncPeriod = 0;
+    int64_t syncListeningTime = 0;
+    int64_t syncPauseEnd = 0;
+    RingBuffer<SyncResponse, QMAC_MAX_SYNC_RESPONSES> syncResponses;
+    uint64_t lastBusyTime = 0;
+    uint64_t totalBusyTime = 0;
 };
 
 extern QMACClass QMAC;
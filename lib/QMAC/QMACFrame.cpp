@@ -0,0 +1,261 @@
+#include <QMAC.h>
+
+byte QMACFrame::ackBitmapSize(uint32_t ackBitmap) {
+    byte size = 0;
+    for (uint32_t rest = ackBitmap >> 1; rest; rest >>= 8) size++;
+    return size;
+}
+
+QMACHeaderFormat QMACFrame::formatOf(const Packet &p, bool sinkHops,
+                                     bool time, QMACHeaderFormat format) {
+    if (format == QMAC_HEADER_COMPACT) return format;
+    // The legacy header has no room for flags or the hops to the sink, and
+    // tells ACKs from data frames by the payload length
+    bool fits = p.isSyncPacket()
+                    ? !sinkHops
+                    : !time && !(p.flags & ~QMAC_FLAG_ACK_REQUEST) &&
+                          p.isAck() == !p.payloadLength;
+    return fits ? QMAC_HEADER_LEGACY : QMAC_HEADER_COMPACT;
+}
+
+size_t QMACFrame::frameLength(const Packet &p, bool sinkHops, bool time,
+                              QMACHeaderFormat format) {
+    bool legacy =
+        formatOf(p, sinkHops, time, format) == QMAC_HEADER_LEGACY;
+    if (p.isSyncPacket()) {
+        // the compact header without the packet ID
+        return legacy ? SYNC_PACKET_SIZE
+                      : COMPACT_HEADER_SIZE - 2 + sinkHops + TIME_FIELD_SIZE;
+    }
+    if (legacy) return NORMAL_HEADER_SIZE + p.payloadLength;
+    size_t length = COMPACT_HEADER_SIZE + p.payloadLength;
+    if (p.flags & COMPACT_EXTENDED_FLAGS) length++;
+    if (p.flags & QMAC_FLAG_ACKS) {
+        length += ACK_FIELD_HEADER_SIZE + 1 + ackBitmapSize(p.ackBitmap);
+    }
+    if (p.flags & QMAC_FLAG_ROUTED) length += ROUTE_FIELD_SIZE + 1;
+    if (time) length += TIME_FIELD_SIZE;
+    return length;
+}
+
+void QMACFrame::encode(const Packet &p, bool sinkHops, bool time,
+                       QMACHeaderFormat format) {
+    this->format = formatOf(p, sinkHops, time, format);
+    payload = p.payload;
+    payloadLength = 0;
+    trailerLength = 0;
+    if (this->format == QMAC_HEADER_COMPACT) {
+        encodeCompact(p, sinkHops, time);
+        return;
+    }
+    byte *h = header;
+    *h++ = p.destination;
+    *h++ = p.source;
+    *h++ = p.packetID;
+    // sync packets have the time field instead of the payload length
+    if (!p.isSyncPacket()) {
+        *h++ = p.payloadLength;
+        payloadLength = p.payloadLength;
+    }
+    headerLength = h - header;
+}
+
+void QMACFrame::encodeCompact(const Packet &p, bool sinkHops, bool time) {
+    byte *h = header;
+    *h++ = p.destination;
+    *h++ = p.source;
+    byte control = QMAC_HEADER_VERSION << COMPACT_VERSION_SHIFT;
+    if (p.isSyncPacket()) {
+        *h++ = control | QMAC_SYNC_FRAME << COMPACT_TYPE_SHIFT;
+        if (sinkHops) *h++ = p.sinkHops;
+        headerLength = h - header;
+        return;
+    }
+    byte type = p.flags & QMAC_FLAG_FOLLOW ? COMPACT_FOLLOW_FRAME : p.type;
+    control |= type << COMPACT_TYPE_SHIFT;
+    // everything but broadcasts and follow frames is acknowledged
+    if (type == QMAC_DATA_FRAME && p.destination != BCADDR) {
+        control |= COMPACT_ACK_REQUEST;
+    }
+    if (time) control |= COMPACT_TIME;
+    if (p.flags & QMAC_FLAG_MORE) control |= COMPACT_MORE;
+    byte extended = p.flags & COMPACT_EXTENDED_FLAGS;
+    if (extended) control |= COMPACT_EXTENDED;
+    *h++ = control;
+    *h++ = p.packetID;
+    *h++ = p.packetID >> 8;
+    if (extended) *h++ = extended;
+    if (p.flags & QMAC_FLAG_ACKS) {
+        byte size = ackBitmapSize(p.ackBitmap);
+        *h++ = p.ackBase;
+        *h++ = p.ackBase >> 8;
+        *h++ = size;
+        for (byte j = 0; j < size; j++) *h++ = p.ackBitmap >> (1 + 8 * j);
+    }
+    if (p.flags & QMAC_FLAG_ROUTED) {
+        *h++ = p.finalDestination;
+        *h++ = p.origin;
+        *h++ = p.originID;
+        *h++ = p.originID >> 8;
+        *h++ = p.hops;
+    }
+    headerLength = h - header;
+    payloadLength = p.payloadLength;
+}
+
+void QMACFrame::seal(bool time, uint32_t nextActiveTime) {
+    byte *t = trailer;
+    if (time && format == QMAC_HEADER_LEGACY) {
+        // only sync packets, in ms
+        uint32_t ms = (nextActiveTime + 500) / 1000;
+        ms = ms < 0xFFFF ? ms : 0xFFFF;
+        *t++ = ms & 0xff;
+        *t++ = ms >> 8;
+    } else if (time) {
+        for (int i = 0; i < 4; i++) *t++ = nextActiveTime >> 8 * i;
+    }
+    // the CRC covers everything in front of it
+    uint16_t checksum = crc(header, headerLength,
+                            format == QMAC_HEADER_COMPACT ? COMPACT_CRC_INIT
+                                                          : 0);
+    checksum = crc(payload, payloadLength, checksum);
+    checksum = crc(trailer, t - trailer, checksum);
+    *t++ = checksum & 0xff;
+    *t++ = checksum >> 8;
+    trailerLength = t - trailer;
+}
+
+bool QMACFrame::decode(const byte *frame, size_t length, Packet *p) {
+    // The version bits of the compact header are part of the packet ID in
+    // the legacy one, so a quarter of the legacy frames is tried as compact
+    // first. decodeCompact() rejects control bytes its encoder never writes,
+    // what passes is told apart by the CRC seed alone, so up to 1 in 65536
+    // of them, 1 in 262144 legacy frames, decodes as a different compact
+    // frame. Compact frames failing their CRC are tried as legacy frames,
+    // with the same odds. The CRC is a check, not a format field.
+    if (length >= 3 &&
+        frame[2] >> COMPACT_VERSION_SHIFT == QMAC_HEADER_VERSION &&
+        decodeCompact(frame, length, p))
+        return true;
+    return decodeLegacy(frame, length, p);
+}
+
+bool QMACFrame::decodeLegacy(const byte *frame, size_t length, Packet *p) {
+    // Parses the received data as a packet:
+    if (length < NORMAL_HEADER_SIZE) return false;
+    size_t i = 0;
+    p->format = QMAC_HEADER_LEGACY;
+    p->destination = frame[i++];
+    p->source = frame[i++];
+    p->packetID = frame[i++];
+    p->flags = 0;
+    // ID 0 identifies sync packets, a payload length of 0 ACKs
+    if (!p->packetID) {
+        if (length != SYNC_PACKET_SIZE) return false;
+        p->type = QMAC_SYNC_FRAME;
+        p->payloadLength = 0;
+        p->sinkHops = NO_ROUTE;
+        p->nextActiveTime = (frame[i] | frame[i + 1] << 8) * 1000;
+        i += LEGACY_TIME_FIELD_SIZE;
+    } else {
+        p->payloadLength = frame[i++];
+        if (p->payloadLength > PAYLOAD_SIZE ||
+            length != i + p->payloadLength + CRC_SIZE)
+            return false;
+        p->type = p->payloadLength ? QMAC_DATA_FRAME : QMAC_ACK_FRAME;
+        if (p->type == QMAC_DATA_FRAME && p->destination != BCADDR)
+            p->flags |= QMAC_FLAG_ACK_REQUEST;
+        memcpy(p->payload, frame + i, p->payloadLength);
+        i += p->payloadLength;
+    }
+    // the CRC covers everything in front of it
+    return crc(frame, i) == (frame[i] | frame[i + 1] << 8);
+}
+
+bool QMACFrame::decodeCompact(const byte *frame, size_t length, Packet *p) {
+    size_t i = 0;
+    p->format = QMAC_HEADER_COMPACT;
+    p->destination = frame[i++];
+    p->source = frame[i++];
+    byte control = frame[i++];
+    byte type = control >> COMPACT_TYPE_SHIFT & COMPACT_TYPE_MASK;
+    p->flags = 0;
+    size_t payloadStart = i;
+    // Sync packets have no flags, the ACK request follows from the type and
+    // the destination, other control bytes are legacy IDs or corrupted
+    if (type == QMAC_SYNC_FRAME) {
+        if (control & ((1 << COMPACT_TYPE_SHIFT) - 1)) return false;
+        p->type = QMAC_SYNC_FRAME;
+        p->packetID = 0;
+        p->payloadLength = 0;
+        // the hops to the sink are the only optional field
+        size_t rest = length - i;
+        if (rest != TIME_FIELD_SIZE + CRC_SIZE &&
+            rest != 1 + TIME_FIELD_SIZE + CRC_SIZE)
+            return false;
+        p->sinkHops =
+            rest > TIME_FIELD_SIZE + CRC_SIZE ? frame[i++] : NO_ROUTE;
+    } else {
+        if (length < i + 2 + CRC_SIZE) return false;
+        bool ackRequest = type == QMAC_DATA_FRAME && p->destination != BCADDR;
+        if (!(control & COMPACT_ACK_REQUEST) != !ackRequest) return false;
+        p->type = type == QMAC_ACK_FRAME ? QMAC_ACK_FRAME : QMAC_DATA_FRAME;
+        p->packetID = frame[i] | frame[i + 1] << 8;
+        i += 2;
+        if (type == COMPACT_FOLLOW_FRAME) p->flags |= QMAC_FLAG_FOLLOW;
+        if (control & COMPACT_ACK_REQUEST) p->flags |= QMAC_FLAG_ACK_REQUEST;
+        if (control & COMPACT_TIME) p->flags |= QMAC_FLAG_TIME;
+        if (control & COMPACT_MORE) p->flags |= QMAC_FLAG_MORE;
+        if (control & COMPACT_EXTENDED) {
+            if (length < i + 1 + CRC_SIZE || !frame[i] ||
+                (frame[i] & ~COMPACT_EXTENDED_FLAGS))
+                return false;
+            p->flags |= frame[i++];
+        }
+        if (p->flags & QMAC_FLAG_ACKS) {
+            const byte *a = frame + i;
+            if (length < i + ACK_FIELD_HEADER_SIZE + 1 || a[2] > 4 ||
+                length < i + ACK_FIELD_HEADER_SIZE + 1 + a[2])
+                return false;
+            p->ackBase = a[0] | a[1] << 8;
+            p->ackBitmap = 1;
+            for (byte j = 0; j < a[2]; j++) {
+                p->ackBitmap |= (uint32_t)a[ACK_FIELD_HEADER_SIZE + 1 + j]
+                                << (1 + 8 * j);
+            }
+            i += ACK_FIELD_HEADER_SIZE + 1 + a[2];
+        }
+        if (p->flags & QMAC_FLAG_ROUTED) {
+            if (length < i + ROUTE_FIELD_SIZE + 1) return false;
+            p->finalDestination = frame[i];
+            p->origin = frame[i + 1];
+            p->originID = frame[i + 2] | frame[i + 3] << 8;
+            p->hops = frame[i + 4];
+            i += ROUTE_FIELD_SIZE + 1;
+        }
+        // the payload is what is left in front of the time field and the
+        // CRC, ACK frames have none
+        size_t trailer =
+            (p->flags & QMAC_FLAG_TIME ? TIME_FIELD_SIZE : 0) + CRC_SIZE;
+        if (length < i + trailer) return false;
+        size_t payloadLength = length - i - trailer;
+        if (payloadLength > PAYLOAD_SIZE ||
+            (p->type == QMAC_ACK_FRAME && payloadLength))
+            return false;
+        p->payloadLength = payloadLength;
+        payloadStart = i;
+        i += payloadLength;
+    }
+    if (p->isSyncPacket() || (p->flags & QMAC_FLAG_TIME)) {
+        p->nextActiveTime = frame[i] | frame[i + 1] << 8 |
+                            (uint32_t)frame[i + 2] << 16 |
+                            (uint32_t)frame[i + 3] << 24;
+        i += TIME_FIELD_SIZE;
+    }
+    // checked before the payload is copied, as legacy frames with the
+    // version bits set are tried first
+    if (crc(frame, i, COMPACT_CRC_INIT) != (frame[i] | frame[i + 1] << 8))
+        return false;
+    memcpy(p->payload, frame + payloadStart, p->payloadLength);
+    return true;
+}
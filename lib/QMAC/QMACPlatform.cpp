@@ -0,0 +1,89 @@
+#ifdef ESP_PLATFORM
+
+#include <QMACPlatform.h>
+#include <SPI.h>
+#include <esp_sleep.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <sys/time.h>
+
+// SX127x registers, the address has the top bit set for writing
+#define REG_FIFO           0x00
+#define REG_PAYLOAD_LENGTH 0x22
+#define SPI_WRITE          0x80
+
+static TaskHandle_t macTask = nullptr;
+// RTC slow memory, initialized at power on only
+RTC_DATA_ATTR static uint64_t retained[(QMAC_RETAINED_MEMORY + 7) / 8];
+
+void QMACPlatform::begin() { macTask = xTaskGetCurrentTaskHandle(); }
+
+void QMACPlatform::waitForEvent(uint32_t timeout) {
+    // The idle task runs while we are blocked, which lets the CPU clock gate
+    // or enter automatic light sleep if power management is enabled
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeout));
+}
+
+void IRAM_ATTR QMACPlatform::notifyFromISR() {
+    if (!macTask) return;
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(macTask, &woken);
+    if (woken) portYIELD_FROM_ISR();
+}
+
+void QMACPlatform::notify() {
+    if (macTask) xTaskNotifyGive(macTask);
+}
+
+void QMACPlatform::lightSleep(uint64_t duration) {
+    esp_sleep_enable_timer_wakeup(duration);
+    esp_light_sleep_start();
+}
+
+void QMACPlatform::deepSleep(uint64_t duration) {
+    esp_sleep_enable_timer_wakeup(duration);
+    esp_deep_sleep_start();
+}
+
+void *QMACPlatform::retainedMemory() { return retained; }
+
+int64_t QMACPlatform::retainedTime() {
+    // the time of day is kept by the RTC in deep sleep
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+void QMACPlatform::writeFrame(const uint8_t *header, size_t headerLength,
+                              const uint8_t *payload, size_t payloadLength,
+                              const uint8_t *trailer, size_t trailerLength) {
+    // LoRa.write() takes one transaction per byte. The FIFO address
+    // advances as long as the chip is selected.
+    SPI.beginTransaction(
+        SPISettings(QMAC_RADIO_SPI_FREQUENCY, MSBFIRST, SPI_MODE0));
+    digitalWrite(QMAC_RADIO_SS, LOW);
+    SPI.transfer(REG_FIFO | SPI_WRITE);
+    SPI.writeBytes(header, headerLength);
+    if (payloadLength) SPI.writeBytes(payload, payloadLength);
+    SPI.writeBytes(trailer, trailerLength);
+    digitalWrite(QMAC_RADIO_SS, HIGH);
+    digitalWrite(QMAC_RADIO_SS, LOW);
+    SPI.transfer(REG_PAYLOAD_LENGTH | SPI_WRITE);
+    SPI.transfer(headerLength + payloadLength + trailerLength);
+    digitalWrite(QMAC_RADIO_SS, HIGH);
+    SPI.endTransaction();
+}
+
+void QMACPlatform::readFrame(uint8_t *frame, size_t length) {
+    // the FIFO address pointer was set to the start of the frame by the
+    // LoRa library
+    SPI.beginTransaction(
+        SPISettings(QMAC_RADIO_SPI_FREQUENCY, MSBFIRST, SPI_MODE0));
+    digitalWrite(QMAC_RADIO_SS, LOW);
+    SPI.transfer(REG_FIFO);
+    SPI.transferBytes(nullptr, frame, length);
+    digitalWrite(QMAC_RADIO_SS, HIGH);
+    SPI.endTransaction();
+}
+
+#endif
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <Arduino.h>
+
+// bytes of memory which are kept in deep sleep, see
+// QMACClass::setLowPowerSleep
+#ifndef QMAC_RETAINED_MEMORY
+#define QMAC_RETAINED_MEMORY 4096
+#endif
+// chip select pin and SPI clock of the SX127x, as passed to LoRa.setPins(),
+// for the burst access to its FIFO
+#ifndef QMAC_RADIO_SS
+#define QMAC_RADIO_SS 18
+#endif
+#ifndef QMAC_RADIO_SPI_FREQUENCY
+#define QMAC_RADIO_SPI_FREQUENCY 8000000
+#endif
+
+// Hooks QMAC uses to block the CPU while it waits for radio or timer events.
+// Implemented for the ESP32 in QMACPlatform.cpp; the host simulation provides
+// its own implementation on top of virtual time.
+class QMACPlatform {
+   public:
+    /**
+     * Register the calling task as the one running the MAC.
+     */
+    static void begin();
+
+    /**
+     * Block the MAC task until notified or until the timeout expires.
+     * @param timeout The maximum waiting time in milliseconds.
+     */
+    static void waitForEvent(uint32_t timeout);
+
+    /**
+     * Wake up the MAC task from an interrupt service routine.
+     */
+    static void notifyFromISR();
+
+    /**
+     * Wake up the MAC task from another task, e.g. a timer callback.
+     */
+    static void notify();
+
+    /**
+     * Put the SoC into light sleep, RAM and timers are kept. Other wake up
+     * sources are not enabled, the radio is asleep.
+     * @param duration The sleeping time in microseconds.
+     */
+    static void lightSleep(uint64_t duration);
+
+    /**
+     * Put the SoC into deep sleep. Does not return, the program starts over
+     * when the duration is over.
+     * @param duration The sleeping time in microseconds.
+     */
+    static void deepSleep(uint64_t duration);
+
+    /**
+     * Get the memory which is kept in deep sleep.
+     * @return QMAC_RETAINED_MEMORY bytes, aligned to 8 bytes.
+     */
+    static void *retainedMemory();
+
+    /**
+     * Get the time of a clock which keeps running in deep sleep, unlike
+     * esp_timer.
+     * @return The time in microseconds.
+     */
+    static int64_t retainedTime();
+
+    /**
+     * Write a frame into the FIFO of the radio in one SPI transaction and set
+     * the payload length. The three parts are written back to back, so the
+     * payload is not copied. Called between LoRa.beginPacket() and
+     * LoRa.endPacket(), instead of LoRa.write().
+     * @param header The fields in front of the payload.
+     * @param headerLength The length of the header.
+     * @param payload The payload.
+     * @param payloadLength The length of the payload.
+     * @param trailer The fields after the payload.
+     * @param trailerLength The length of the trailer.
+     */
+    static void writeFrame(const uint8_t *header, size_t headerLength,
+                           const uint8_t *payload, size_t payloadLength,
+                           const uint8_t *trailer, size_t trailerLength);
+
+    /**
+     * Read a received frame from the FIFO of the radio in one SPI
+     * transaction. Called after LoRa.parsePacket() or in the receive
+     * callback, instead of LoRa.read().
+     * @param frame The buffer for the frame.
+     * @param length The length of the frame.
+     */
+    static void readFrame(uint8_t *frame, size_t length);
+};
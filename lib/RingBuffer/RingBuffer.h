@@ -0,0 +1,180 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed-capacity FIFO queue. Items live inside the object, so it never
+// allocates and enqueueing and dequeueing at either end is O(1).
+template <typename T, size_t N>
+class RingBuffer {
+   public:
+    // returns false if the buffer is full
+    bool push(const T &item) {
+        if (count == N) return false;
+        items[(head + count) % N] = item;
+        count++;
+        if (count > highWater) highWater = count;
+        return true;
+    }
+
+    // returns false if the buffer is empty
+    bool pop(T *item = nullptr) {
+        if (count == 0) return false;
+        if (item) *item = items[head];
+        head = (head + 1) % N;
+        count--;
+        return true;
+    }
+
+    T &front() { return items[head]; }
+
+    // i-th oldest item
+    T &operator[](size_t i) { return items[(head + i) % N]; }
+    const T &operator[](size_t i) const { return items[(head + i) % N]; }
+
+    // inserts the item before the i-th oldest one, shifting the newer ones.
+    // Returns false if the buffer is full
+    bool insert(size_t i, const T &item) {
+        if (count == N) return false;
+        count++;
+        for (size_t j = count - 1; j > i; j--) (*this)[j] = (*this)[j - 1];
+        (*this)[i] = item;
+        if (count > highWater) highWater = count;
+        return true;
+    }
+
+    // removes the i-th oldest item, shifting the newer ones
+    void remove(size_t i) {
+        for (; i + 1 < count; i++) (*this)[i] = (*this)[i + 1];
+        count--;
+    }
+
+    void clear() {
+        head = 0;
+        count = 0;
+    }
+
+    size_t size() const { return count; }
+    bool isEmpty() const { return count == 0; }
+    bool isFull() const { return count == N; }
+    size_t capacity() const { return N; }
+    // largest number of items that were in the buffer at the same time
+    size_t highWaterMark() const { return highWater; }
+
+   private:
+    T items[N];
+    size_t head = 0;
+    size_t count = 0;
+    size_t highWater = 0;
+};
+
+// Fixed set of N slots handed out by index, so queues can hold one byte
+// indices instead of copies of large items.
+template <typename T, size_t N>
+class Pool {
+    static_assert(N <= 255, "Pool indices are stored in a byte");
+
+   public:
+    Pool() {
+        for (size_t i = 0; i < N; i++) freeSlots.push(i);
+    }
+
+    // returns the index of a free slot or -1 if all slots are used
+    int allocate() {
+        uint8_t index;
+        if (!freeSlots.pop(&index)) return -1;
+        if (used() > highWater) highWater = used();
+        return index;
+    }
+
+    void release(uint8_t index) { freeSlots.push(index); }
+
+    T &operator[](uint8_t index) { return slots[index]; }
+
+    size_t used() const { return N - freeSlots.size(); }
+    bool isFull() const { return freeSlots.isEmpty(); }
+    // largest number of slots that were used at the same time
+    size_t highWaterMark() const { return highWater; }
+
+   private:
+    T slots[N];
+    RingBuffer<uint8_t, N> freeSlots;
+    size_t highWater = 0;
+};
+
+// Doubly linked FIFO of distinct indices below N, e.g. of Pool slots. Unlike
+// RingBuffer, any index can be removed in O(1).
+template <size_t N>
+class IndexList {
+    static_assert(N < 255, "indices are stored in a byte");
+
+   public:
+    IndexList() { clear(); }
+
+    // the index must not be in the list
+    void push(uint8_t index) {
+        prev[index] = tail;
+        next[index] = NONE;
+        if (tail == NONE) {
+            head = index;
+        } else {
+            next[tail] = index;
+        }
+        tail = index;
+        linked[index] = true;
+        count++;
+    }
+
+    // returns false if the list is empty
+    bool peek(uint8_t *index) const {
+        if (head == NONE) return false;
+        *index = head;
+        return true;
+    }
+
+    // returns false if the list is empty
+    bool pop(uint8_t *index) {
+        if (head == NONE) return false;
+        *index = head;
+        remove(head);
+        return true;
+    }
+
+    // returns false if the index is not in the list
+    bool remove(uint8_t index) {
+        if (!contains(index)) return false;
+        if (prev[index] == NONE) {
+            head = next[index];
+        } else {
+            next[prev[index]] = next[index];
+        }
+        if (next[index] == NONE) {
+            tail = prev[index];
+        } else {
+            prev[next[index]] = prev[index];
+        }
+        linked[index] = false;
+        count--;
+        return true;
+    }
+
+    bool contains(uint8_t index) const { return index < N && linked[index]; }
+
+    void clear() {
+        for (size_t i = 0; i < N; i++) linked[i] = false;
+        head = NONE;
+        tail = NONE;
+        count = 0;
+    }
+
+    size_t size() const { return count; }
+    bool isEmpty() const { return count == 0; }
+
+   private:
+    static const uint8_t NONE = 0xFF;
+    uint8_t prev[N];
+    uint8_t next[N];
+    bool linked[N];
+    uint8_t head;
+    uint8_t tail;
+    size_t count;
+};
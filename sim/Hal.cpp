@@ -0,0 +1,240 @@
+// Arduino, arduino-LoRa and esp_timer bindings for the simulator. Every call
+// acts on the node whose coroutine is currently running.
+
+#include <Arduino.h>
+#include <LoRa.h>
+#include <QMACPlatform.h>
+#include <esp_timer.h>
+
+#include <algorithm>
+#include <limits>
+
+#include "Simulator.h"
+
+using sim::Radio;
+using sim::simulator;
+
+HardwareSerial Serial;
+LoRaClass LoRa;
+
+unsigned long millis() { return simulator->current().localTime() / 1000; }
+
+unsigned long micros() { return simulator->current().localTime(); }
+
+void delay(unsigned long ms) { simulator->sleep((int64_t)ms * 1000); }
+
+void delayMicroseconds(unsigned int us) { simulator->sleep(us); }
+
+void yield() {}
+
+long random(long max) {
+    return max <= 0 ? 0 : (long)simulator->randomInt(max);
+}
+
+long random(long min, long max) {
+    return min >= max ? min : min + random(max - min);
+}
+
+// The simulator owns the random sequence so runs are reproducible
+void randomSeed(unsigned long) {}
+
+int LoRaClass::begin(long frequency) {
+    setFrequency(frequency);
+    idle();
+    return 1;
+}
+
+void LoRaClass::end() { sleep(); }
+
+int LoRaClass::beginPacket(int) {
+    Radio &r = simulator->current().radio;
+    if (r.mode == Radio::TX) return 0;
+    idle();
+    r.txBuf.clear();
+    return 1;
+}
+
+int LoRaClass::endPacket(bool async) {
+    simulator->transmit(async);
+    return 1;
+}
+
+int LoRaClass::parsePacket(int) { return simulator->poll(); }
+
+int LoRaClass::packetRssi() { return simulator->current().radio.rssi; }
+
+float LoRaClass::packetSnr() { return simulator->current().radio.snr; }
+
+long LoRaClass::packetFrequencyError() { return 0; }
+
+size_t LoRaClass::write(uint8_t byte) { return write(&byte, 1); }
+
+size_t LoRaClass::write(const uint8_t *buffer, size_t size) {
+    std::vector<uint8_t> &tx = simulator->current().radio.txBuf;
+    size = std::min(size, 255 - tx.size());
+    tx.insert(tx.end(), buffer, buffer + size);
+    return size;
+}
+
+int LoRaClass::available() {
+    Radio &r = simulator->current().radio;
+    return r.rxBuf.size() - r.rxIndex;
+}
+
+int LoRaClass::read() {
+    Radio &r = simulator->current().radio;
+    return r.rxIndex < r.rxBuf.size() ? r.rxBuf[r.rxIndex++] : -1;
+}
+
+int LoRaClass::peek() {
+    Radio &r = simulator->current().radio;
+    return r.rxIndex < r.rxBuf.size() ? r.rxBuf[r.rxIndex] : -1;
+}
+
+size_t LoRaClass::readBytes(uint8_t *buffer, size_t length) {
+    size_t n = 0;
+    int c;
+    while (n < length && (c = read()) >= 0) buffer[n++] = c;
+    return n;
+}
+
+void LoRaClass::onReceive(void (*callback)(int)) {
+    simulator->current().radio.onReceive = callback;
+}
+
+void LoRaClass::onTxDone(void (*callback)()) {
+    simulator->current().radio.onTxDone = callback;
+}
+
+void LoRaClass::receive(int) { simulator->startReceive(true); }
+
+void LoRaClass::onCadDone(void (*callback)(boolean)) {
+    simulator->current().radio.onCadDone = callback;
+}
+
+void LoRaClass::channelActivityDetection() {
+    simulator->channelActivityDetection();
+}
+
+void LoRaClass::idle() { simulator->setMode(Radio::STANDBY); }
+
+void LoRaClass::sleep() { simulator->setMode(Radio::SLEEP); }
+
+void LoRaClass::setTxPower(int level, int) {
+    simulator->current().radio.txPower = level;
+}
+
+void LoRaClass::setFrequency(long frequency) {
+    simulator->current().radio.frequency = frequency;
+}
+
+void LoRaClass::setSpreadingFactor(int sf) {
+    simulator->current().radio.sf = std::min(std::max(sf, 6), 12);
+}
+
+void LoRaClass::setSignalBandwidth(long sbw) {
+    simulator->current().radio.bw = sbw;
+}
+
+void LoRaClass::setCodingRate4(int) {}
+
+void LoRaClass::setPreambleLength(long) {}
+
+void LoRaClass::setSyncWord(int) {}
+
+void LoRaClass::enableCrc() {}
+
+void LoRaClass::disableCrc() {}
+
+void LoRaClass::setPins(int, int, int) {}
+
+void QMACPlatform::begin() {}
+
+void QMACPlatform::waitForEvent(uint32_t timeout) {
+    simulator->sleep((int64_t)timeout * 1000, true);
+}
+
+// Interrupts and timer callbacks already end the wait in the simulator
+void QMACPlatform::notifyFromISR() {}
+
+void QMACPlatform::notify() {}
+
+void QMACPlatform::lightSleep(uint64_t duration) {
+    simulator->current().socSleep += duration;
+    simulator->sleep(duration);
+}
+
+void QMACPlatform::deepSleep(uint64_t duration) {
+    // the timers are gone with the program, only the retained memory and the
+    // clock keep going
+    sim::Node &n = simulator->current();
+    for (esp_timer *t : n.timers) delete t;
+    n.timers.clear();
+    n.socSleep += duration;
+    n.reboots++;
+    simulator->sleep(duration);
+    throw sim::Reboot();
+}
+
+void *QMACPlatform::retainedMemory() {
+    std::vector<uint64_t> &memory = simulator->current().retained;
+    memory.resize((QMAC_RETAINED_MEMORY + 7) / 8);
+    return memory.data();
+}
+
+int64_t QMACPlatform::retainedTime() {
+    return simulator->current().localTime();
+}
+
+void QMACPlatform::writeFrame(const uint8_t *header, size_t headerLength,
+                              const uint8_t *payload, size_t payloadLength,
+                              const uint8_t *trailer, size_t trailerLength) {
+    LoRa.write(header, headerLength);
+    LoRa.write(payload, payloadLength);
+    LoRa.write(trailer, trailerLength);
+}
+
+void QMACPlatform::readFrame(uint8_t *frame, size_t length) {
+    LoRa.readBytes(frame, length);
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args,
+                           esp_timer_handle_t *out_handle) {
+    sim::Node &n = simulator->current();
+    esp_timer *t = new esp_timer{n.id, create_args->callback, create_args->arg,
+                                 false, 0};
+    n.timers.push_back(t);
+    *out_handle = t;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    if (timer->armed) return ESP_ERR_INVALID_STATE;
+    timer->armed = true;
+    timer->alarm = simulator->node(timer->node).localTime() + timeout_us;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    if (!timer->armed) return ESP_ERR_INVALID_STATE;
+    timer->armed = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    std::vector<esp_timer *> &timers = simulator->node(timer->node).timers;
+    timers.erase(std::remove(timers.begin(), timers.end(), timer),
+                 timers.end());
+    delete timer;
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_time() { return simulator->current().localTime(); }
+
+int64_t esp_timer_get_next_alarm() {
+    int64_t next = std::numeric_limits<int64_t>::max();
+    for (const esp_timer *t : simulator->current().timers) {
+        if (t->armed) next = std::min(next, t->alarm);
+    }
+    return next;
+}
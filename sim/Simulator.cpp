@@ -0,0 +1,424 @@
+#include "Simulator.h"
+
+#include <LoRaAirtime.h>
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace sim {
+
+Simulator *simulator = nullptr;
+
+static const size_t STACK_SIZE = 256 * 1024;
+static const int64_t NEVER = std::numeric_limits<int64_t>::max();
+// Longest possible LoRa frame (SF12, BW 125 kHz, 255 bytes) is below this
+static const int64_t MAX_AIRTIME = 10000000;
+// Symbols a channel activity detection takes, and preamble symbols including
+// the sync word, which is the part of a frame it can detect
+static const double CAD_SYMBOLS = 2;
+static const double PREAMBLE_SYMBOLS = 8 + 4.25;
+
+int64_t Node::localTime() const {
+    return offset + llround(now * (1.0 + drift));
+}
+
+int64_t Node::toGlobal(int64_t local) const {
+    return (int64_t)ceil((local - offset) / (1.0 + drift));
+}
+
+// Sensitivity of the SX127x at 125 kHz bandwidth, indexed by spreading factor
+static double sensitivity(int sf, long bw) {
+    static const double table[] = {-118, -123, -126, -129, -132, -134.5, -137};
+    int idx = std::min(std::max(sf, 6), 12) - 6;
+    return table[idx] + 10 * log10(bw / 125000.0);
+}
+
+static double noiseFloor(long bw) { return -174 + 10 * log10(bw) + 6; }
+
+// in us
+static double symbolTime(int sf, long bw) { return (1 << sf) * 1e6 / bw; }
+
+Simulator::Simulator(uint64_t seed, ChannelConfig config)
+    : cfg(config), rng(seed * 0x9E3779B97F4A7C15ull + 1) {
+    simulator = this;
+}
+
+Simulator::~Simulator() {
+    for (Node *n : nodes) {
+        for (esp_timer *t : n->timers) delete t;
+        delete n;
+    }
+    if (simulator == this) simulator = nullptr;
+}
+
+Node &Simulator::addNode(double x, double y, double drift, int64_t offset,
+                         int64_t start, std::function<void(Node &)> entry) {
+    Node *n = new Node();
+    n->id = nodes.size();
+    n->x = x;
+    n->y = y;
+    n->drift = drift;
+    n->offset = offset;
+    n->now = start;
+    n->wake = start;
+    n->entry = entry;
+    n->stack.resize(STACK_SIZE);
+    getcontext(&n->context);
+    n->context.uc_stack.ss_sp = n->stack.data();
+    n->context.uc_stack.ss_size = n->stack.size();
+    n->context.uc_link = nullptr;
+    makecontext(&n->context, &Simulator::trampoline, 0);
+    nodes.push_back(n);
+    return *n;
+}
+
+void Simulator::isolate(void *variable, size_t size) {
+    isolated.push_back({static_cast<uint8_t *>(variable), size});
+    isolatedSize += size;
+}
+
+void Simulator::trampoline() {
+    Node &n = simulator->current();
+    n.entry(n);
+    n.finished = true;
+    swapcontext(&n.context, &simulator->scheduler);
+}
+
+double Simulator::random() {
+    return randomInt(1ull << 53) / (double)(1ull << 53);
+}
+
+uint64_t Simulator::randomInt(uint64_t bound) {
+    // splitmix64
+    uint64_t z = (rng += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z = z ^ (z >> 31);
+    return bound ? z % bound : z;
+}
+
+double Simulator::rssi(const Frame &frame, int to) const {
+    return frame.txPower - pathLoss[frame.src][to];
+}
+
+void Simulator::run(int64_t until) {
+    this->until = until;
+    if (pathLoss.size() != nodes.size()) {
+        size_t n = nodes.size();
+        pathLoss.assign(n, std::vector<double>(n, 0));
+        for (size_t a = 0; a < n; a++) {
+            for (size_t b = a + 1; b < n; b++) {
+                double d = hypot(nodes[a]->x - nodes[b]->x,
+                                 nodes[a]->y - nodes[b]->y);
+                d = std::max(d, 1.0);
+                double loss = cfg.referenceLoss +
+                              10 * cfg.pathLossExponent *
+                                  log10(d / cfg.referenceDistance);
+                if (cfg.shadowing > 0) {
+                    // Box-Muller, drawn once per link so links are stable
+                    double u1 = std::max(random(), 1e-12), u2 = random();
+                    loss += cfg.shadowing * sqrt(-2 * log(u1)) *
+                            cos(2 * M_PI * u2);
+                }
+                pathLoss[a][b] = pathLoss[b][a] = loss;
+            }
+        }
+    }
+
+    queue.clear();
+    for (Node *n : nodes) {
+        if (!n->finished) queue.insert({n->wake, n->id});
+    }
+    while (!queue.empty()) {
+        auto next = *queue.begin();
+        if (next.first > until) break;
+        queue.erase(queue.begin());
+        running = next.second;
+        Node &n = *nodes[running];
+        n.now = std::max(n.now, next.first);
+        n.isolated.resize(isolatedSize);
+        size_t offset = 0;
+        for (auto &v : isolated) {
+            memcpy(v.first, n.isolated.data() + offset, v.second);
+            offset += v.second;
+        }
+        swapcontext(&scheduler, &n.context);
+        offset = 0;
+        for (auto &v : isolated) {
+            memcpy(n.isolated.data() + offset, v.first, v.second);
+            offset += v.second;
+        }
+        if (!n.finished) queue.insert({n.wake, n.id});
+        if (channel.size() > 64) prune();
+    }
+    running = -1;
+}
+
+void Simulator::prune() {
+    int64_t oldest = queue.empty() ? NEVER : queue.begin()->first;
+    while (!channel.empty() && channel.front().end + MAX_AIRTIME < oldest) {
+        channel.pop_front();
+    }
+}
+
+void Simulator::yieldUntil(int64_t wake) {
+    Node &n = current();
+    n.wake = wake;
+    if (wake <= until && (queue.empty() || wake <= queue.begin()->first)) {
+        n.now = wake;
+        return;
+    }
+    swapcontext(&n.context, &scheduler);
+}
+
+int64_t Simulator::nextEvent(const Node &n) {
+    int64_t next = NEVER;
+    for (const esp_timer *t : n.timers) {
+        if (t->armed) next = std::min(next, n.toGlobal(t->alarm));
+    }
+    const Radio &r = n.radio;
+    if (r.mode == Radio::TX) next = std::min(next, r.txEnd);
+    if (r.mode == Radio::CAD) next = std::min(next, r.cadEnd);
+    if (r.mode == Radio::RX && r.continuous && r.onReceive) {
+        for (auto it = firstStartingAt(r.rxSince); it != channel.end();
+             ++it) {
+            const Frame &f = *it;
+            if (f.src == n.id || f.end <= n.now) continue;
+            if (f.sf != r.sf || f.frequency != r.frequency) continue;
+            next = std::min(next, f.end);
+        }
+    }
+    return next;
+}
+
+void Simulator::sleep(int64_t duration, bool untilEvent) {
+    Node &n = current();
+    sleepUntilGlobal(n.toGlobal(n.localTime() + duration), untilEvent);
+}
+
+void Simulator::sleepUntilGlobal(int64_t target, bool untilEvent) {
+    Node &n = current();
+    while (true) {
+        int64_t next = std::max(n.now, std::min(target, nextEvent(n)));
+        yieldUntil(next);
+        bool fired = dispatch();
+        if (n.now >= target || (fired && untilEvent)) return;
+    }
+}
+
+bool Simulator::dispatch() {
+    Node &n = current();
+    Radio &r = n.radio;
+    bool fired = false;
+    if (r.mode == Radio::TX && n.now >= r.txEnd) {
+        r.mode = Radio::STANDBY;
+        if (r.txAsync && r.onTxDone) {
+            r.onTxDone();
+            fired = true;
+        }
+    }
+    if (r.mode == Radio::CAD && n.now >= r.cadEnd) {
+        r.mode = Radio::STANDBY;
+        if (r.onCadDone) {
+            r.onCadDone(channelActive(n));
+            fired = true;
+        }
+    }
+    bool due = true;
+    while (due) {
+        due = false;
+        for (esp_timer *t : n.timers) {
+            if (t->armed && n.toGlobal(t->alarm) <= n.now) {
+                t->armed = false;
+                t->callback(t->arg);
+                fired = due = true;
+                break;
+            }
+        }
+    }
+    Frame *f;
+    while (r.mode == Radio::RX && r.continuous && r.onReceive &&
+           receiveNext(n, f)) {
+        load(n, *f);
+        r.onReceive(f->data.size());
+        fired = true;
+    }
+    return fired;
+}
+
+std::deque<Frame>::iterator Simulator::firstStartingAt(int64_t time) {
+    // frames are appended in the order they start
+    return std::lower_bound(
+        channel.begin(), channel.end(), time,
+        [](const Frame &f, int64_t t) { return f.start < t; });
+}
+
+bool Simulator::decodable(const Node &n, const Frame &f) const {
+    const Radio &r = n.radio;
+    return f.frequency == r.frequency && f.sf == r.sf && f.bw == r.bw &&
+           rssi(f, n.id) >= sensitivity(f.sf, f.bw);
+}
+
+bool Simulator::channelActive(const Node &n) {
+    // Only preambles overlapping the detection which could be received are
+    // detected, not the payload of frames which started earlier
+    const Radio &r = n.radio;
+    double symbol = symbolTime(r.sf, r.bw);
+    for (auto it = firstStartingAt(r.cadStart - MAX_AIRTIME);
+         it != channel.end(); ++it) {
+        const Frame &f = *it;
+        if (f.start >= r.cadEnd) break;
+        if (f.src == n.id || !decodable(n, f)) continue;
+        if (f.start + PREAMBLE_SYMBOLS * symbol > r.cadStart) return true;
+    }
+    return false;
+}
+
+bool Simulator::receiveNext(Node &n, Frame *&received) {
+    Radio &r = n.radio;
+    while (true) {
+        Frame *candidate = nullptr;
+        for (auto it = firstStartingAt(r.rxSince); it != channel.end();
+             ++it) {
+            Frame &f = *it;
+            if (f.start > n.now) break;
+            if (f.src == n.id || f.end > n.now) continue;
+            if (f.end < r.consumedEnd ||
+                (f.end == r.consumedEnd && f.id <= r.consumedId))
+                continue;
+            if (!candidate || f.end < candidate->end ||
+                (f.end == candidate->end && f.id < candidate->id)) {
+                candidate = &f;
+            }
+        }
+        if (!candidate) return false;
+        r.consumedEnd = candidate->end;
+        r.consumedId = candidate->id;
+
+        if (candidate->frequency != r.frequency || candidate->sf != r.sf ||
+            candidate->bw != r.bw)
+            continue;
+        if (!decodable(n, *candidate)) {
+            n.stats.rxLost++;
+            continue;
+        }
+        double power = rssi(*candidate, n.id);
+        bool collided = false;
+        for (auto it = firstStartingAt(candidate->start - MAX_AIRTIME);
+             it != channel.end(); ++it) {
+            const Frame &g = *it;
+            if (g.start >= candidate->end) break;
+            if (&g == candidate || g.end <= candidate->start) continue;
+            if (g.frequency != candidate->frequency || g.sf != candidate->sf)
+                continue;
+            // capture effect: the stronger frame survives if it is at least
+            // captureThreshold above every interferer
+            if (power - rssi(g, n.id) < cfg.captureThreshold) {
+                collided = true;
+                break;
+            }
+        }
+        if (collided) {
+            n.stats.rxCollisions++;
+            continue;
+        }
+        if (cfg.linkLoss > 0 && random() < cfg.linkLoss) {
+            n.stats.rxLost++;
+            continue;
+        }
+        n.stats.rxFrames++;
+        received = candidate;
+        return true;
+    }
+}
+
+void Simulator::load(Node &n, const Frame &f) {
+    Radio &r = n.radio;
+    r.rxBuf = f.data;
+    r.rxIndex = 0;
+    r.rssi = lround(rssi(f, n.id));
+    r.snr = rssi(f, n.id) - noiseFloor(f.bw);
+}
+
+void Simulator::transmit(bool async) {
+    Node &n = current();
+    Radio &r = n.radio;
+    // with the default coding settings of the radio
+    static LoRaAirtime calc;
+    float airtime = calc.getAirtime(r.txBuf.size(), r.sf, r.bw);
+
+    Frame f;
+    f.id = ++frameCount;
+    f.src = n.id;
+    f.start = n.now;
+    f.end = n.now + (int64_t)(airtime * 1000);
+    f.sf = r.sf;
+    f.bw = r.bw;
+    f.frequency = r.frequency;
+    f.txPower = r.txPower;
+    f.data = r.txBuf;
+    channel.push_back(f);
+
+    n.stats.txFrames++;
+    n.stats.txAirtime += airtime;
+    r.mode = Radio::TX;
+    r.continuous = false;
+    r.txEnd = f.end;
+    r.txAsync = async;
+
+    // wake up nodes waiting for a receive interrupt
+    for (Node *m : nodes) {
+        const Radio &mr = m->radio;
+        if (m == &n || !(mr.mode == Radio::RX && mr.continuous &&
+                         mr.onReceive && f.end < m->wake))
+            continue;
+        if (queue.erase({m->wake, m->id})) {
+            m->wake = f.end;
+            queue.insert({m->wake, m->id});
+        }
+    }
+    if (!async) sleepUntilGlobal(f.end);
+}
+
+int Simulator::poll() {
+    Node &n = current();
+    Radio &r = n.radio;
+    if (r.mode != Radio::TX) {
+        if (r.mode != Radio::RX || r.continuous) startReceive(false);
+        Frame *f;
+        if (receiveNext(n, f)) {
+            load(n, *f);
+            r.mode = Radio::STANDBY;
+            return f->data.size();
+        }
+    }
+    sleep(cfg.pollInterval);
+    return 0;
+}
+
+void Simulator::startReceive(bool continuous) {
+    Node &n = current();
+    Radio &r = n.radio;
+    if (r.mode != Radio::RX) r.rxSince = n.now;
+    r.mode = Radio::RX;
+    r.continuous = continuous;
+}
+
+void Simulator::channelActivityDetection() {
+    Node &n = current();
+    Radio &r = n.radio;
+    r.mode = Radio::CAD;
+    r.continuous = false;
+    r.cadStart = n.now;
+    r.cadEnd = n.now + (int64_t)(CAD_SYMBOLS * symbolTime(r.sf, r.bw));
+}
+
+void Simulator::setMode(Radio::Mode mode) {
+    Radio &r = current().radio;
+    r.mode = mode;
+    r.continuous = false;
+}
+
+}  // namespace sim
@@ -0,0 +1,184 @@
+// Discrete-event simulator that runs many unmodified QMACClass instances
+// against a shared, simulated LoRa channel.
+//
+// Every node executes in its own coroutine. Nodes only give up control when
+// they advance their virtual clock (polling the radio, delay(), waiting for a
+// transmission to finish, ...). The scheduler always resumes the node with the
+// smallest virtual time, so whenever a node looks at the channel, every frame
+// that could have ended or collided up to that point is already known.
+
+#pragma once
+
+#include <esp_timer.h>
+#include <stdint.h>
+#include <ucontext.h>
+
+#include <deque>
+#include <functional>
+#include <set>
+#include <vector>
+
+struct esp_timer {
+    int node;
+    esp_timer_cb_t callback;
+    void *arg;
+    bool armed;
+    int64_t alarm;  // local time in us
+};
+
+namespace sim {
+
+struct Frame {
+    uint64_t id;
+    int src;
+    int64_t start;  // global time in us
+    int64_t end;
+    int sf;
+    long bw;
+    long frequency;
+    int txPower;
+    std::vector<uint8_t> data;
+};
+
+struct RadioStats {
+    uint32_t txFrames = 0;
+    double txAirtime = 0;  // ms
+    uint32_t rxFrames = 0;
+    uint32_t rxCollisions = 0;
+    uint32_t rxLost = 0;  // below sensitivity or dropped by the link
+};
+
+struct Radio {
+    enum Mode { SLEEP, STANDBY, RX, TX, CAD };
+    Mode mode = SLEEP;
+    bool continuous = false;
+    int64_t rxSince = 0;
+    // last frame that was evaluated for reception (end time, frame id)
+    int64_t consumedEnd = -1;
+    uint64_t consumedId = 0;
+    int64_t txEnd = 0;
+    bool txAsync = false;
+    int64_t cadStart = 0;
+    int64_t cadEnd = 0;
+    long frequency = 868000000;
+    int sf = 7;
+    long bw = 125000;
+    int txPower = 17;
+    std::vector<uint8_t> txBuf;
+    std::vector<uint8_t> rxBuf;
+    size_t rxIndex = 0;
+    int rssi = 0;
+    float snr = 0;
+    void (*onReceive)(int) = nullptr;
+    void (*onTxDone)() = nullptr;
+    void (*onCadDone)(bool) = nullptr;
+};
+
+// Thrown on the stack of a node which enters deep sleep, its entry function
+// catches it and starts the program over
+struct Reboot {};
+
+struct Node {
+    int id;
+    double x, y;
+    double drift;     // relative clock rate error, e.g. 20e-6
+    int64_t offset;   // local clock offset in us
+    int64_t now = 0;  // global time in us
+    int64_t wake = 0;
+    bool finished = false;
+    ucontext_t context;
+    std::vector<char> stack;
+    std::function<void(Node &)> entry;
+    std::vector<esp_timer *> timers;
+    Radio radio;
+    RadioStats stats;
+    void *user = nullptr;
+    std::vector<uint8_t> isolated;
+    // low power sleep of the SoC, see QMACPlatform
+    int64_t socSleep = 0;  // us
+    uint32_t reboots = 0;  // wakes from deep sleep
+    std::vector<uint64_t> retained;  // memory kept in deep sleep
+
+    int64_t localTime() const;
+    int64_t toGlobal(int64_t local) const;
+};
+
+struct ChannelConfig {
+    double pathLossExponent = 2.08;
+    double referenceLoss = 127.41;  // dB at referenceDistance
+    double referenceDistance = 40;  // m
+    double shadowing = 0;           // standard deviation in dB
+    double captureThreshold = 6;    // dB
+    double linkLoss = 0;            // additional per-frame loss probability
+    int64_t pollInterval = 1000;    // us consumed by an idle parsePacket()
+};
+
+class Simulator {
+   public:
+    explicit Simulator(uint64_t seed, ChannelConfig config = ChannelConfig());
+    ~Simulator();
+
+    Node &addNode(double x, double y, double drift, int64_t offset,
+                  int64_t start, std::function<void(Node &)> entry);
+    // Keep a separate copy of a global variable for every node, e.g. state
+    // that is a singleton on the device
+    void isolate(void *variable, size_t size);
+    // Runs all nodes until the global time reaches `until` (us).
+    void run(int64_t until);
+
+    Node &current() { return *nodes[running]; }
+    // Makes a node the running one between calls of run(), so the MAC can
+    // read its clock, e.g. for the statistics at the end. Variables isolated
+    // per node are not swapped in.
+    void select(int id) { running = id; }
+    Node &node(int id) { return *nodes[id]; }
+    size_t numNodes() const { return nodes.size(); }
+    int64_t now() const { return nodes[running]->now; }
+
+    // Advance the clock of the running node by `duration` local us, firing
+    // timers and radio interrupts on the way. When `untilEvent` is set, returns
+    // early after the first timer or radio callback.
+    void sleep(int64_t duration, bool untilEvent = false);
+    void sleepUntilGlobal(int64_t target, bool untilEvent = false);
+
+    // radio operations of the running node
+    void transmit(bool async);
+    int poll();
+    void load(Node &node, const Frame &frame);
+    void startReceive(bool continuous);
+    void channelActivityDetection();
+    void setMode(Radio::Mode mode);
+
+    double rssi(const Frame &frame, int to) const;
+    double random();
+    uint64_t randomInt(uint64_t bound);
+    const ChannelConfig &config() const { return cfg; }
+
+   private:
+    void yieldUntil(int64_t wake);
+    bool dispatch();
+    bool receiveNext(Node &node, Frame *&received);
+    bool decodable(const Node &node, const Frame &frame) const;
+    bool channelActive(const Node &node);
+    int64_t nextEvent(const Node &node);
+    std::deque<Frame>::iterator firstStartingAt(int64_t time);
+    void prune();
+    static void trampoline();
+
+    ChannelConfig cfg;
+    std::vector<Node *> nodes;
+    std::vector<std::pair<uint8_t *, size_t>> isolated;
+    size_t isolatedSize = 0;
+    std::vector<std::vector<double>> pathLoss;
+    std::set<std::pair<int64_t, int>> queue;
+    std::deque<Frame> channel;
+    uint64_t frameCount = 0;
+    uint64_t rng;
+    int64_t until = 0;
+    int running = -1;
+    ucontext_t scheduler;
+};
+
+extern Simulator *simulator;
+
+}  // namespace sim
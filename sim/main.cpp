@@ -0,0 +1,589 @@
+// QMAC network simulation. Runs one QMACClass per virtual node against the
+// simulated channel and prints per-node delivery, latency and airtime
+// statistics as CSV.
+//
+// Example: pio run -e native && .pio/build/native/program --nodes 50
+
+#include <QMAC.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+#include <set>
+#include <vector>
+
+#include "Simulator.h"
+
+// us between two samples of the schedules of the nodes
+#define SYNC_SAMPLE_INTERVAL 10000000
+
+LoRaAirtime LoRaCalc;
+
+struct Scenario {
+    int nodes = 10;
+    double duration = 3600;  // s
+    uint64_t seed = 1;
+    double interval = 120;  // mean s between packets of a node
+    int payload = 16;
+    double area = 200;     // side of the square the nodes are placed in, m
+    double spacing = 0;    // m, place the nodes on a line instead if set
+    double drift = 20;     // maximum clock drift, ppm
+    double stagger = 10;   // nodes are switched on within this time, s
+    int sink = -1;         // send everything to this node if set
+    bool broadcast = false;
+    bool interrupt = false;
+    bool nonblocking = false;  // drive the MAC with poll() instead of run()
+    bool aggregation = false;
+    QMACAckMode ackMode = QMAC_ACK_IMMEDIATE;
+    uint32_t ackDelay = 1000;  // ms
+    bool lbt = false;
+    int sf = 7;  // base spreading factor
+    bool adr = false;
+    float adrMargin = 5;  // dB
+    long maxBandwidth = 0;  // Hz
+    uint32_t dutyCycleWindow = 3600;  // s
+    uint32_t dutyCycleBurst = 360;    // s
+    double urgent = 0;  // share of packets pushed with high priority
+    double ttl = 0;     // s until a packet expires, 0 for never
+    int message = 0;    // bytes, send messages of this size instead of packets
+    int maxHops = 0;    // forward packets over up to this many hops if set
+    int guardTime = 0;  // ms, correct the drift with this guard time if set
+    int idleTimeout = 0;  // ms, adapt the active period if set
+    QMACSleepMode sleepMode = QMAC_STAY_AWAKE;
+    bool compression = false;
+    // share of the nodes sending the compact header, the others the legacy one
+    double compactHeaders = 0;
+    uint64_t sleepDuration = 60000;
+    uint64_t activeDuration = 5000;
+    sim::ChannelConfig channel;
+};
+
+// Every application payload starts with this tag so the receiver can
+// compute delivery and latency
+struct Tag {
+    uint16_t origin;
+    uint8_t priority;
+    uint32_t seq;
+    int64_t created;  // global time in us
+};
+
+struct App {
+    QMACClass mac;
+    int index;
+    uint32_t generated = 0;
+    uint32_t delivered = 0;  // unique packets of this node that arrived
+    uint32_t received = 0;   // unique packets this node received
+    uint32_t duplicates = 0;
+    std::set<std::pair<uint16_t, uint32_t>> seen;
+    std::vector<double> latencies;  // ms, of packets this node sent
+    std::vector<double> urgentLatencies;  // ms, of its high priority packets
+    std::vector<byte> message;  // being sent
+    uint32_t messagesDue = 0;   // waiting for the message being sent
+    int64_t nextPacket = 0;
+    bool synchronized = false;
+    // ms between its active periods and the ones of the reference node
+    std::vector<double> syncErrors;
+};
+
+static Scenario scenario;
+static std::vector<App *> apps;
+
+static int64_t exponential(double mean) {
+    double u = std::max(sim::simulator->random(), 1e-12);
+    return (int64_t)(-log(u) * mean * 1e6);
+}
+
+static byte pickDestination(App &app) {
+    if (scenario.sink >= 0 && scenario.sink != app.index) {
+        return apps[scenario.sink]->mac.localAddress;
+    } else if (!scenario.broadcast && scenario.sink < 0) {
+        int other = random(scenario.nodes - 1);
+        if (other >= app.index) other++;
+        return apps[other]->mac.localAddress;
+    }
+    return BCADDR;
+}
+
+static void generate(App &app, sim::Node &node) {
+    while (node.now >= app.nextPacket) {
+        // the latency counts from when the packet was due, the node may have
+        // been busy or asleep then
+        int64_t due = app.nextPacket;
+        app.nextPacket += exponential(scenario.interval);
+        if (scenario.message) {
+            // one message at a time, the others wait until it was sent
+            app.messagesDue++;
+            continue;
+        }
+        QMACPriority priority = sim::simulator->random() < scenario.urgent
+                                    ? QMAC_PRIORITY_HIGH
+                                    : QMAC_PRIORITY_NORMAL;
+        Tag tag = {(uint16_t)app.index, (uint8_t)priority, app.generated++,
+                   due};
+        byte payload[PAYLOAD_SIZE] = {};
+        memcpy(payload, &tag, sizeof(tag));
+        app.mac.push(payload, scenario.payload, pickDestination(app),
+                     priority, scenario.ttl * 1000);
+    }
+    if (app.messagesDue > 0 &&
+        app.mac.messageState() != QMAC_MESSAGE_SENDING) {
+        QMACPriority priority = sim::simulator->random() < scenario.urgent
+                                    ? QMAC_PRIORITY_HIGH
+                                    : QMAC_PRIORITY_NORMAL;
+        Tag tag = {(uint16_t)app.index, (uint8_t)priority, app.generated++,
+                   node.now};
+        app.message.resize(scenario.message);
+        for (int i = 0; i < scenario.message; i++) app.message[i] = i;
+        memcpy(app.message.data(), &tag, sizeof(tag));
+        app.mac.sendMessage(app.message.data(), scenario.message,
+                            pickDestination(app), priority,
+                            scenario.ttl * 1000);
+        app.messagesDue--;
+    }
+}
+
+static void deliver(App &app, sim::Node &node, const byte *payload,
+                    size_t length) {
+    if (length < sizeof(Tag)) return;
+    Tag tag;
+    memcpy(&tag, payload, sizeof(tag));
+    if (tag.origin >= apps.size()) return;
+    if (!app.seen.insert({tag.origin, tag.seq}).second) {
+        app.duplicates++;
+        return;
+    }
+    app.received++;
+    App &origin = *apps[tag.origin];
+    origin.delivered++;
+    origin.latencies.push_back((node.now - tag.created) / 1000.0);
+    if (tag.priority == QMAC_PRIORITY_HIGH) {
+        origin.urgentLatencies.push_back(origin.latencies.back());
+    }
+}
+
+static void consume(App &app, sim::Node &node) {
+    while (app.mac.numPacketsAvailable() > 0) {
+        Packet p = app.mac.pop();
+        deliver(app, node, p.payload, p.payloadLength);
+    }
+    size_t length;
+    while (const byte *message = app.mac.peekMessage(&length)) {
+        // the whole message has to arrive intact
+        bool intact = length == (size_t)scenario.message;
+        for (size_t i = sizeof(Tag); intact && i < length; i++) {
+            intact = message[i] == (byte)i;
+        }
+        if (intact) deliver(app, node, message, length);
+        app.mac.releaseMessage();
+    }
+}
+
+static void runNode(App &app, sim::Node &node) {
+    LoRa.begin(868E6);
+    app.mac.setSleepingDuration(scenario.sleepDuration);
+    app.mac.setActiveDuration(scenario.activeDuration);
+    app.mac.setInterruptReceive(scenario.interrupt);
+    app.mac.setAggregation(scenario.aggregation);
+    app.mac.setAckMode(scenario.ackMode);
+    app.mac.setAckDelay(scenario.ackDelay);
+    app.mac.setListenBeforeTalk(scenario.lbt);
+    app.mac.setBaseDataRate(scenario.sf);
+    app.mac.setAdaptiveDataRate(scenario.adr, scenario.adrMargin,
+                                scenario.maxBandwidth);
+    app.mac.setDutyCycle(scenario.dutyCycleWindow, scenario.dutyCycleBurst);
+    if (scenario.guardTime) app.mac.setDriftCorrection(true, scenario.guardTime);
+    if (scenario.idleTimeout) {
+        app.mac.setAdaptiveActivePeriod(true, scenario.idleTimeout);
+    }
+    app.mac.setLowPowerSleep(scenario.sleepMode);
+    app.mac.setCompression(scenario.compression);
+    if (app.index < scenario.compactHeaders * scenario.nodes) {
+        app.mac.setHeaderFormat(QMAC_HEADER_COMPACT);
+    }
+    if (scenario.maxHops) {
+        byte sink = scenario.sink >= 0 ? scenario.sink + 1 : BCADDR;
+        app.mac.setForwarding(true, sink, scenario.maxHops);
+    }
+    while (!app.mac.begin(app.index + 1));
+    // the application keeps its state in deep sleep
+    if (!app.synchronized) {
+        app.synchronized = true;
+        app.nextPacket = node.now + exponential(scenario.interval);
+        // the sink only collects packets
+        if (scenario.sink == app.index) app.nextPacket = INT64_MAX;
+    }
+
+    while (true) {
+        generate(app, node);
+        if (scenario.nonblocking) {
+            uint32_t timeout = app.mac.poll();
+            consume(app, node);
+            if (timeout) {
+                int64_t deadline =
+                    node.toGlobal(node.localTime() + timeout * 1000);
+                sim::simulator->sleepUntilGlobal(
+                    std::min(deadline, app.nextPacket), true);
+            }
+            continue;
+        }
+        app.mac.run();
+        consume(app, node);
+        if (!app.mac.isActive()) {
+            // the SoC sleeps in run() if the MAC was asleep already
+            if (scenario.sleepMode != QMAC_STAY_AWAKE) app.mac.run();
+            // nothing to do until the MAC wakes up or new data is produced
+            sim::simulator->sleepUntilGlobal(app.nextPacket, true);
+        }
+    }
+}
+
+static void nodeMain(sim::Node &node) {
+    App &app = *static_cast<App *>(node.user);
+    while (true) {
+        try {
+            runNode(app, node);
+        } catch (const sim::Reboot &) {
+            // the RAM of the MAC is lost in deep sleep
+            app.mac.~QMACClass();
+            new (&app.mac) QMACClass();
+        }
+    }
+}
+
+// Global time in us the next active period of the node starts, -1 if the MAC
+// has no schedule yet
+static int64_t nextActiveStart(const sim::Node &node, App &app) {
+    for (const esp_timer *t : node.timers) {
+        if (!t->armed) continue;
+        int64_t start = t->alarm;
+        if (app.mac.isActive()) start += scenario.sleepDuration * 1000;
+        return node.toGlobal(start);
+    }
+    return -1;
+}
+
+// Compares the schedules of all nodes with the one of the sink, or of the
+// first node without a sink
+static void sampleSchedules(sim::Simulator &simulator) {
+    int reference = scenario.sink >= 0 ? scenario.sink : 0;
+    App &ref = *apps[reference];
+    int64_t refStart = nextActiveStart(simulator.node(reference), ref);
+    if (!ref.synchronized || refStart < 0) return;
+    int64_t cycle =
+        (scenario.sleepDuration + scenario.activeDuration) * 1000;
+    for (App *app : apps) {
+        if (app == &ref || !app->synchronized) continue;
+        int64_t start = nextActiveStart(simulator.node(app->index), *app);
+        if (start < 0) continue;
+        int64_t error = ((start - refStart) % cycle + cycle) % cycle;
+        error = std::min(error, cycle - error);
+        app->syncErrors.push_back(error / 1000.0);
+    }
+}
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+// The header of the MAC's own record, with its columns prefixed so they do
+// not clash with the ones of the simulation, e.g. duplicates
+static void printStatsHeader() {
+    const char *name = QMACClass::statsCsvHeader();
+    while (*name) {
+        size_t length = strcspn(name, ",\n");
+        printf("mac_%.*s%c", (int)length, name, name[length]);
+        name += length + (name[length] != 0);
+    }
+}
+
+static void usage() {
+    fprintf(stderr,
+            "usage: program [--nodes N] [--duration s] [--seed N]\n"
+            "  [--interval s] [--payload bytes] [--area m] [--drift ppm]\n"
+            "  [--stagger s] [--sink node] [--broadcast] [--loss p]\n"
+            "  [--shadowing dB] [--capture dB] [--poll us] [--interrupt]\n"
+            "  [--nonblocking] [--aggregation] [--ack immediate|selective]\n"
+            "  [--ack-delay ms] [--lbt (requires --interrupt)] [--sf N]\n"
+            "  [--adr] [--adr-margin dB] [--max-bw Hz] [--dc-window s]\n"
+            "  [--dc-burst s] [--urgent share] [--ttl s] [--message bytes]\n"
+            "  [--forward hops] [--spacing m] [--drift-correction ms]\n"
+            "  [--sleep ms] [--active ms] [--adaptive idle_ms]\n"
+            "  [--low-power light|deep] [--compression]\n"
+            "  [--compact-header share]\n");
+    exit(1);
+}
+
+static void parseArgs(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (!strcmp(arg, "--broadcast")) {
+            scenario.broadcast = true;
+            continue;
+        }
+        if (!strcmp(arg, "--interrupt")) {
+            scenario.interrupt = true;
+            continue;
+        }
+        if (!strcmp(arg, "--nonblocking")) {
+            scenario.nonblocking = true;
+            continue;
+        }
+        if (!strcmp(arg, "--aggregation")) {
+            scenario.aggregation = true;
+            continue;
+        }
+        if (!strcmp(arg, "--lbt")) {
+            scenario.lbt = true;
+            continue;
+        }
+        if (!strcmp(arg, "--adr")) {
+            scenario.adr = true;
+            continue;
+        }
+        if (!strcmp(arg, "--compression")) {
+            scenario.compression = true;
+            continue;
+        }
+        if (i + 1 >= argc) usage();
+        const char *value = argv[++i];
+        if (!strcmp(arg, "--nodes")) {
+            scenario.nodes = atoi(value);
+        } else if (!strcmp(arg, "--duration")) {
+            scenario.duration = atof(value);
+        } else if (!strcmp(arg, "--seed")) {
+            scenario.seed = strtoull(value, nullptr, 10);
+        } else if (!strcmp(arg, "--interval")) {
+            scenario.interval = atof(value);
+        } else if (!strcmp(arg, "--payload")) {
+            scenario.payload = atoi(value);
+        } else if (!strcmp(arg, "--area")) {
+            scenario.area = atof(value);
+        } else if (!strcmp(arg, "--drift")) {
+            scenario.drift = atof(value);
+        } else if (!strcmp(arg, "--stagger")) {
+            scenario.stagger = atof(value);
+        } else if (!strcmp(arg, "--sink")) {
+            scenario.sink = atoi(value);
+        } else if (!strcmp(arg, "--loss")) {
+            scenario.channel.linkLoss = atof(value);
+        } else if (!strcmp(arg, "--shadowing")) {
+            scenario.channel.shadowing = atof(value);
+        } else if (!strcmp(arg, "--capture")) {
+            scenario.channel.captureThreshold = atof(value);
+        } else if (!strcmp(arg, "--poll")) {
+            scenario.channel.pollInterval = atoll(value);
+        } else if (!strcmp(arg, "--sleep")) {
+            scenario.sleepDuration = strtoull(value, nullptr, 10);
+        } else if (!strcmp(arg, "--active")) {
+            scenario.activeDuration = strtoull(value, nullptr, 10);
+        } else if (!strcmp(arg, "--ack")) {
+            if (!strcmp(value, "immediate")) {
+                scenario.ackMode = QMAC_ACK_IMMEDIATE;
+            } else if (!strcmp(value, "selective")) {
+                scenario.ackMode = QMAC_ACK_SELECTIVE;
+            } else {
+                usage();
+            }
+        } else if (!strcmp(arg, "--ack-delay")) {
+            scenario.ackDelay = strtoul(value, nullptr, 10);
+        } else if (!strcmp(arg, "--sf")) {
+            scenario.sf = atoi(value);
+        } else if (!strcmp(arg, "--adr-margin")) {
+            scenario.adrMargin = atof(value);
+        } else if (!strcmp(arg, "--max-bw")) {
+            scenario.maxBandwidth = atol(value);
+        } else if (!strcmp(arg, "--dc-window")) {
+            scenario.dutyCycleWindow = strtoul(value, nullptr, 10);
+        } else if (!strcmp(arg, "--dc-burst")) {
+            scenario.dutyCycleBurst = strtoul(value, nullptr, 10);
+        } else if (!strcmp(arg, "--urgent")) {
+            scenario.urgent = atof(value);
+        } else if (!strcmp(arg, "--compact-header")) {
+            scenario.compactHeaders = atof(value);
+        } else if (!strcmp(arg, "--ttl")) {
+            scenario.ttl = atof(value);
+        } else if (!strcmp(arg, "--message")) {
+            scenario.message = atoi(value);
+        } else if (!strcmp(arg, "--forward")) {
+            scenario.maxHops = atoi(value);
+        } else if (!strcmp(arg, "--spacing")) {
+            scenario.spacing = atof(value);
+        } else if (!strcmp(arg, "--drift-correction")) {
+            scenario.guardTime = atoi(value);
+        } else if (!strcmp(arg, "--adaptive")) {
+            scenario.idleTimeout = atoi(value);
+        } else if (!strcmp(arg, "--low-power")) {
+            if (!strcmp(value, "light")) {
+                scenario.sleepMode = QMAC_LIGHT_SLEEP;
+            } else if (!strcmp(value, "deep")) {
+                scenario.sleepMode = QMAC_DEEP_SLEEP;
+            } else {
+                usage();
+            }
+        } else {
+            usage();
+        }
+    }
+    scenario.payload = std::max(scenario.payload, (int)sizeof(Tag));
+    scenario.payload = std::min(scenario.payload, PAYLOAD_SIZE);
+    if (scenario.nodes < 2 || scenario.nodes > 254 ||
+        scenario.sink >= scenario.nodes ||
+        (scenario.lbt && !scenario.interrupt) || scenario.sf < 7 ||
+        scenario.sf > 12 || scenario.message < 0 ||
+        scenario.message > QMAC_REASSEMBLY_SIZE ||
+        (scenario.message && scenario.message < (int)sizeof(Tag)))
+        usage();
+}
+
+int main(int argc, char **argv) {
+    parseArgs(argc, argv);
+    sim::Simulator simulator(scenario.seed, scenario.channel);
+    simulator.isolate(&QMACClass::receiver, sizeof(QMACClass::receiver));
+
+    for (int i = 0; i < scenario.nodes; i++) {
+        App *app = new App();
+        app->index = i;
+        app->mac.localAddress = i + 1;
+        apps.push_back(app);
+        double x = simulator.random() * scenario.area;
+        double y = simulator.random() * scenario.area;
+        if (scenario.spacing > 0) {
+            x = i * scenario.spacing;
+            y = 0;
+        }
+        double drift = (2 * simulator.random() - 1) * scenario.drift * 1e-6;
+        int64_t offset = simulator.randomInt(1ull << 40);
+        int64_t start = simulator.random() * scenario.stagger * 1e6;
+        sim::Node &node =
+            simulator.addNode(x, y, drift, offset, start, nodeMain);
+        node.user = app;
+    }
+    int64_t until = scenario.duration * 1e6;
+    for (int64_t t = SYNC_SAMPLE_INTERVAL; t < until;
+         t += SYNC_SAMPLE_INTERVAL) {
+        simulator.run(t);
+        sampleSchedules(simulator);
+    }
+    simulator.run(until);
+
+    printf(
+        "node,address,synchronized,generated,delivered,pdr,received,"
+        "duplicates,latency_mean_ms,latency_p50_ms,latency_p95_ms,"
+        "latency_max_ms,tx_frames,tx_airtime_ms,duty_cycle,rx_frames,"
+        "rx_collisions,rx_lost,cpu_busy_ms,send_queue_hwm,send_queue_drops,"
+        "rx_queue_hwm,rx_queue_drops,dedup_hits,airtime_saved_ms,ack_frames,"
+        "ack_piggybacked,ack_airtime_ms,cad_checks,cad_hits,lbt_deferrals,"
+        "lbt_postponed,dc_refused,dc_refused_priority,expired,"
+        "queue_latency_high_ms,queue_latency_normal_ms,messages_failed,"
+        "messages_timed_out,forwarded,forward_drops,sink_hops,sync_cycles,"
+        "syncs_skipped,drift_corrections,sync_airtime_ms,sync_error_p50_ms,"
+        "sync_error_p95_ms,radio_on_ms,radio_on_per_period_ms,"
+        "periods_shortened,period_extensions,soc_sleep_ms,reboots,"
+        "coded_frames,codec_failures,codec_airtime_saved_ms,");
+    printStatsHeader();
+    uint64_t generated = 0, delivered = 0, collisions = 0, ackFrames = 0;
+    uint64_t expired = 0, syncCycles = 0, radioOn = 0, periods = 0;
+    double airtime = 0, ackAirtime = 0, syncAirtime = 0;
+    std::vector<double> latencies, urgentLatencies, syncErrors;
+    for (App *app : apps) {
+        const sim::Node &node = simulator.node(app->index);
+        double mean = 0;
+        for (double l : app->latencies) mean += l;
+        if (!app->latencies.empty()) mean /= app->latencies.size();
+        QMACQueueStats sendStats = app->mac.sendQueueStats();
+        QMACQueueStats rxStats = app->mac.receptionQueueStats();
+        QMACAckStats ackStats = app->mac.ackStats();
+        QMACLbtStats lbtStats = app->mac.lbtStats();
+        QMACDutyCycleStats dcStats = app->mac.dutyCycleStats();
+        QMACClassStats high = app->mac.classStats(QMAC_PRIORITY_HIGH);
+        QMACClassStats normal = app->mac.classStats(QMAC_PRIORITY_NORMAL);
+        QMACClassStats low = app->mac.classStats(QMAC_PRIORITY_LOW);
+        uint32_t nodeExpired = high.expired + normal.expired + low.expired;
+        QMACRoutingStats routing = app->mac.routingStats();
+        QMACSyncStats syncStats = app->mac.syncStats();
+        QMACActivityStats activity = app->mac.activityStats();
+        QMACCodecStats codec = app->mac.codecStats();
+        // the MAC's own record, as a node would write it to the serial port
+        simulator.select(app->index);
+        char record[512];
+        size_t length =
+            app->mac.dumpStats((byte *)record, sizeof(record) - 1);
+        record[length] = 0;
+        uint8_t sinkHops = NO_ROUTE;
+        if (scenario.sink >= 0) app->mac.nextHop(scenario.sink + 1, &sinkHops);
+        printf("%d,%d,%d,%u,%u,%.4f,%u,%u,%.1f,%.1f,%.1f,%.1f,%u,%.1f,%.5f,%u,"
+               "%u,%u,%.1f,%zu,%u,%zu,%u,%u,%.1f,%u,%u,%.1f,%u,%u,%u,%u,%u,"
+               "%u,%u,%u,%u,%u,%u,%u,%u,%d,%u,%u,%u,%.1f,%.3f,%.3f,%u,%.1f,%u,"
+               "%u,%.1f,%u,%u,%u,%.1f,%s",
+               app->index, app->mac.localAddress, app->synchronized,
+               app->generated, app->delivered,
+               app->generated ? (double)app->delivered / app->generated : 0,
+               app->received, app->duplicates, mean,
+               percentile(app->latencies, 0.5),
+               percentile(app->latencies, 0.95),
+               percentile(app->latencies, 1.0), node.stats.txFrames,
+               node.stats.txAirtime, node.stats.txAirtime * 1000 / until,
+               node.stats.rxFrames, node.stats.rxCollisions,
+               node.stats.rxLost, app->mac.busyTime() / 1000.0,
+               sendStats.highWaterMark, sendStats.drops, rxStats.highWaterMark,
+               rxStats.drops, app->mac.dedupStats().hits,
+               app->mac.airtimeSaved(), ackStats.frames, ackStats.piggybacked,
+               ackStats.airtime, lbtStats.checks, lbtStats.hits,
+               lbtStats.deferrals, lbtStats.postponed, dcStats.refused,
+               dcStats.refusedPriority, nodeExpired, high.meanLatency,
+               normal.meanLatency, app->mac.messageStats().failed,
+               app->mac.messageStats().timedOut, routing.forwarded,
+               routing.hopLimit + routing.noRoute + routing.disabled +
+                   routing.rejected,
+               sinkHops == NO_ROUTE ? -1 : sinkHops, syncStats.cycles,
+               syncStats.skipped, syncStats.corrections, syncStats.airtime,
+               percentile(app->syncErrors, 0.5),
+               percentile(app->syncErrors, 0.95), activity.radioOnTime,
+               activity.periods
+                   ? (double)activity.radioOnTime / activity.periods
+                   : 0,
+               activity.shortened, activity.extended, node.socSleep / 1000.0,
+               node.reboots, codec.coded, codec.failures, codec.airtimeSaved,
+               record);
+        generated += app->generated;
+        delivered += app->delivered;
+        collisions += node.stats.rxCollisions;
+        airtime += node.stats.txAirtime;
+        ackFrames += ackStats.frames;
+        ackAirtime += ackStats.airtime;
+        latencies.insert(latencies.end(), app->latencies.begin(),
+                         app->latencies.end());
+        urgentLatencies.insert(urgentLatencies.end(),
+                               app->urgentLatencies.begin(),
+                               app->urgentLatencies.end());
+        expired += nodeExpired;
+        syncCycles += syncStats.cycles;
+        syncAirtime += syncStats.airtime;
+        radioOn += activity.radioOnTime;
+        periods += activity.periods;
+        syncErrors.insert(syncErrors.end(), app->syncErrors.begin(),
+                          app->syncErrors.end());
+    }
+    fprintf(stderr,
+            "nodes=%d duration=%.0fs generated=%lu delivered=%lu pdr=%.4f "
+            "latency_p50=%.1fms latency_p95=%.1fms airtime=%.1fms "
+            "collisions=%lu ack_frames=%lu ack_airtime=%.1fms "
+            "delivered_bytes_per_airtime_s=%.1f urgent_latency_p95=%.1fms "
+            "expired=%lu sync_cycles=%lu sync_airtime=%.1fms "
+            "sync_error_p50=%.3fms sync_error_p95=%.3fms "
+            "radio_on_per_period=%.1fms\n",
+            scenario.nodes, scenario.duration, generated, delivered,
+            generated ? (double)delivered / generated : 0,
+            percentile(latencies, 0.5), percentile(latencies, 0.95), airtime,
+            collisions, ackFrames, ackAirtime,
+            airtime > 0 ? delivered * scenario.payload / (airtime / 1000) : 0,
+            percentile(urgentLatencies, 0.95), expired, syncCycles,
+            syncAirtime, percentile(syncErrors, 0.5),
+            percentile(syncErrors, 0.95),
+            periods ? (double)radioOn / periods : 0);
+    return 0;
+}
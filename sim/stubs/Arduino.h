@@ -0,0 +1,104 @@
+// Minimal host replacement for the Arduino core, used by the native
+// simulation environment. Time and randomness are virtual and provided by the
+// simulator (see sim/Simulator.cpp).
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HEX 16
+#define DEC 10
+#define IRAM_ATTR
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+class String {
+   public:
+    String() {}
+    String(const char *s) : s(s ? s : "") {}
+    String(const std::string &s) : s(s) {}
+    String(char c) : s(1, c) {}
+    String(int v, unsigned char base = DEC) { fromInt(v, base); }
+    String(unsigned int v, unsigned char base = DEC) { fromInt(v, base); }
+    String(long v, unsigned char base = DEC) { fromInt(v, base); }
+    String(unsigned long v, unsigned char base = DEC) { fromInt(v, base); }
+    String(long long v, unsigned char base = DEC) { fromInt(v, base); }
+    String(unsigned long long v, unsigned char base = DEC) {
+        fromInt(v, base);
+    }
+    String(unsigned char v, unsigned char base = DEC) { fromInt(v, base); }
+    String(float v, unsigned char decimals = 2) { fromFloat(v, decimals); }
+    String(double v, unsigned char decimals = 2) { fromFloat(v, decimals); }
+
+    const char *c_str() const { return s.c_str(); }
+    unsigned int length() const { return s.size(); }
+    void getBytes(unsigned char *buf, unsigned int size) const {
+        if (size == 0) return;
+        unsigned int n = s.size() < size - 1 ? s.size() : size - 1;
+        memcpy(buf, s.data(), n);
+        buf[n] = 0;
+    }
+
+    String &operator+=(const String &o) {
+        s += o.s;
+        return *this;
+    }
+    friend String operator+(const String &a, const String &b) {
+        return String(a.s + b.s);
+    }
+    friend String operator+(const String &a, const char *b) {
+        return String(a.s + b);
+    }
+    friend String operator+(const char *a, const String &b) {
+        return String(a + b.s);
+    }
+    bool operator==(const String &o) const { return s == o.s; }
+
+   private:
+    template <typename T>
+    void fromInt(T v, unsigned char base) {
+        char buf[32];
+        if (base == HEX) {
+            snprintf(buf, sizeof(buf), "%llx", (unsigned long long)v);
+        } else {
+            snprintf(buf, sizeof(buf), "%lld", (long long)v);
+        }
+        s = buf;
+    }
+    void fromFloat(double v, unsigned char decimals) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.*f", decimals, v);
+        s = buf;
+    }
+    std::string s;
+};
+
+class HardwareSerial {
+   public:
+    void begin(unsigned long) {}
+    operator bool() const { return true; }
+    int available() { return 0; }
+    void print(const String &s) { fputs(s.c_str(), stderr); }
+    void println(const String &s = String()) {
+        fputs(s.c_str(), stderr);
+        fputc('\n', stderr);
+    }
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,52 @@
+// Host replacement for sandeepmistry/arduino-LoRa. Mirrors the subset of the
+// LoRaClass API used by QMAC; every call is routed to the simulated radio of
+// the node that is currently executing (see sim/Simulator.cpp).
+
+#pragma once
+
+#include <Arduino.h>
+
+class LoRaClass {
+   public:
+    int begin(long frequency);
+    void end();
+
+    int beginPacket(int implicitHeader = false);
+    int endPacket(bool async = false);
+
+    int parsePacket(int size = 0);
+    int packetRssi();
+    float packetSnr();
+    long packetFrequencyError();
+
+    size_t write(uint8_t byte);
+    size_t write(const uint8_t *buffer, size_t size);
+
+    int available();
+    int read();
+    int peek();
+    size_t readBytes(uint8_t *buffer, size_t length);
+
+    void onReceive(void (*callback)(int));
+    void onTxDone(void (*callback)());
+    void receive(int size = 0);
+    void onCadDone(void (*callback)(boolean));
+    void channelActivityDetection();
+
+    void idle();
+    void sleep();
+
+    void setTxPower(int level, int outputPin = 0);
+    void setFrequency(long frequency);
+    void setSpreadingFactor(int sf);
+    void setSignalBandwidth(long sbw);
+    void setCodingRate4(int denominator);
+    void setPreambleLength(long length);
+    void setSyncWord(int sw);
+    void enableCrc();
+    void disableCrc();
+
+    void setPins(int ss = 18, int reset = 14, int dio0 = 26);
+};
+
+extern LoRaClass LoRa;
@@ -6,8 +6,6 @@
 #include <SPI.h>
 #include <TinyGPS++.h>
 
-#include <List.hpp>
-
 #include "esp_timer.h"
 
 #define SCK  5   // GPIO5  -- SX1278's SCK
@@ -58,6 +56,13 @@ void setup() {
 void loop() {
     if (Serial.available()) {
         String msg = Serial.readStringUntil('\n');
+        if (msg == "stats") {
+            // one CSV record of the MAC statistics
+            byte record[512];
+            Serial.print(QMACClass::statsCsvHeader());
+            Serial.write(record, QMAC.dumpStats(record, sizeof(record)));
+            return;
+        }
         byte buf[200];
         msg.getBytes(buf,msg.length());
         QMAC.push(buf, msg.length());
@@ -72,7 +77,8 @@ void loop() {
         LOG(state + " time: " + String(millis()));
         lastState = currentState;
     }
-    QMAC.run();
+    // never blocks, so serial input and GPS data are handled in time
+    QMAC.poll();
 
     while (QMAC.numPacketsAvailable() > 0) {
         Packet p = QMAC.pop();
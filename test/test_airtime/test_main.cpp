@@ -0,0 +1,99 @@
+// Checks LoRaAirtime against the floating point formula of the SX1276
+// datasheet over every spreading factor, bandwidth, code rate, header mode,
+// CRC and low data rate setting and every payload length. Run with
+// pio test -e native.
+
+#include <LoRaAirtime.h>
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+
+static_assert(LoRaAirtimeTable<7, 125000>::micros[7] == 30976,
+              "7 bytes at SF7 and 125 kHz take 30.25 symbols");
+static_assert(LoRaAirtimeTable<12, 125000>::micros[10] == 991232,
+              "the low data rate optimization is enabled at SF12");
+
+static const long BANDWIDTHS[] = {7800,  10400, 15600,  20800,  31250,
+                                  41700, 62500, 125000, 250000, 500000};
+
+// in us
+static double reference(int length, int sf, long bw, int cr, bool header,
+                        bool crc, bool de) {
+    double tSym = pow(2, sf) / bw * 1e6;
+    double payload = ceil((8.0 * length - 4 * sf + 28 + 16 * crc -
+                           20 * (header ? 0 : 1)) /
+                          (4 * (sf - 2 * de)));
+    double symbols = 8 + fmax(payload * cr, 0);
+    return (8 + 4.25 + symbols) * tSym;
+}
+
+// Calls check(sf, bw, cr, header, crc, de) for every combination of settings
+template <typename F>
+static void forEachSetting(F check) {
+    for (int sf = 6; sf <= 12; sf++) {
+        for (long bw : BANDWIDTHS) {
+            for (int cr = 5; cr <= 8; cr++) {
+                for (int flags = 0; flags < 8; flags++) {
+                    check(sf, bw, cr, flags & 1, flags & 2, flags & 4);
+                }
+            }
+        }
+    }
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+// the model is rounded to the nearest us
+void test_model_matches_formula() {
+    forEachSetting([](int sf, long bw, int cr, bool header, bool crc,
+                      bool de) {
+        for (int length = 0; length < 256; length++) {
+            uint32_t us = LoRaAirtimeModel::airtime(length, sf, bw, cr,
+                                                    header, crc, de, 8);
+            double error =
+                fabs(us - reference(length, sf, bw, cr, header, crc, de));
+            if (error >= 0.5) {
+                char message[96];
+                snprintf(message, sizeof(message),
+                         "%d bytes at SF%d, %ld Hz, 4/%d: error %.3f us",
+                         length, sf, bw, cr, error);
+                TEST_FAIL_MESSAGE(message);
+            }
+        }
+    });
+}
+
+// the table of the runtime settings holds the model in ms
+void test_table_matches_model() {
+    forEachSetting([](int sf, long bw, int cr, bool header, bool crc,
+                      bool de) {
+        LoRaAirtime calc;
+        calc.setSpreadingFactor(sf);
+        calc.setBandwidth(bw);
+        calc.setCodeRate(cr);
+        calc.setHasExplicitHeader(header);
+        calc.setCRC(crc);
+        calc.setLowDataRateEnabled(de);
+        for (int length = 0; length < 256; length++) {
+            uint32_t us = LoRaAirtimeModel::airtime(length, sf, bw, cr,
+                                                    header, crc, de, 8);
+            if (calc.getAirtime(length) != us / 1000.0f) {
+                char message[96];
+                snprintf(message, sizeof(message),
+                         "%d bytes at SF%d, %ld Hz, 4/%d: %f ms, not %u us",
+                         length, sf, bw, cr, calc.getAirtime(length),
+                         (unsigned)us);
+                TEST_FAIL_MESSAGE(message);
+            }
+        }
+    });
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_model_matches_formula);
+    RUN_TEST(test_table_matches_model);
+    return UNITY_END();
+}